@@ -1,2 +1,2 @@
 rm -rf bin; mkdir -p bin
-gcc -g -o bin/svm *.c svm/*.c parser/*.c
\ No newline at end of file
+gcc -g -pthread -o bin/svm *.c svm/*.c parser/*.c
\ No newline at end of file
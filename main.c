@@ -5,16 +5,27 @@
  * under the terms of the MIT license. See LICENSE for details.
  */
 
-#include "parser/lexer.h"
+#include "parser/parser.h"
+#include "parser/cache.h"
+#include "parser/link.h"
 #include "parser/token.h"
 #include "svm/svm.h"
 #include "svm/op.h"
+#include "svm/opt.h"
+#include "svm/trace.h"
+#include "svm/disasm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
 
 // https://cturt.github.io/cinoop.html
 // https://github.com/skx/simple.vm
@@ -27,14 +38,472 @@ void shutdown() {
   // svm_free(VM);
 }
 
-int run_file(char *filename, int dump_reg, int instr_max) {
+/* read a whole file, NULL if it can't be */
+static char *read_file(const char *filename, size_t *len) {
   struct stat sb;
-  if (stat(filename, &sb) != 0) {
+  if (stat(filename, &sb) != 0) return NULL;
+
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return NULL;
+
+  char *data = malloc(sb.st_size + 1);
+  if (!data) {
+    fclose(fp); return NULL;
+  }
+
+  /* abort on a short-read, or error */
+  size_t read = fread(data, 1, sb.st_size, fp);
+  fclose(fp);
+  if (read < (size_t)sb.st_size) {
+    free(data); return NULL;
+  }
+
+  data[read] = '\0';
+  *len = read;
+  return data;
+}
+
+
+static void print_diags(passembler_t *as, const char *filename) {
+  const pdiag_t *diags;
+  unsigned int n = assembler_diags(as, &diags);
+  for (unsigned int i = 0; i < n; i++)
+    printf("%s:%lu: %s%s\n", diags[i].file ? diags[i].file : filename, (unsigned long) diags[i].line,
+           diags[i].warning ? "warning: " : "", diags[i].message);
+}
+
+
+/* assemble `filename`, printing what went wrong against its lines */
+static int assemble_file(passembler_t *as, const char *filename) {
+  size_t len;
+  char *source = read_file(filename, &len);
+  if (!source) {
+    printf("failed to read file: %s\n", filename);
+    return -1;
+  }
+
+  assembler_path(as, filename);
+  int rc = assembler_assemble(as, source, len);
+  free(source);
+
+  print_diags(as, filename);
+  return rc;
+}
+
+
+/* the whole of a file for hashing, NULL if it can't be mapped */
+static const char *map_file(int fd, size_t *len) {
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0) return NULL;
+
+  void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return NULL;
+
+  *len = sb.st_size;
+  return map;
+}
+
+
+int run_file(char *filename, int dump_reg, int instr_max) {
+  const char *cache = getenv("CACHE");
+  passembler_t *as = NULL;
+  pimage_t img = { 0 };
+  const unsigned char *code;
+  unsigned int size;
+  size_t len = 0;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     printf("failed to read file: %s\n", filename);
     return 1;
   }
 
-  int size = sb.st_size;
+  /* the source is streamed through the assembler, only the cache needs
+     all of it at once */
+  const char *source = cache ? map_file(fd, &len) : NULL;
+
+  /* a cache hit skips assembly altogether */
+  if (source && cache_load(cache, source, len, &img) == 0) {
+    code = img.code; size = img.size;
+  } else {
+    as = assembler_new();
+    assembler_path(as, filename);
+    int rc = assembler_assemble_fd(as, fd);
+    print_diags(as, filename);
+
+    if (rc != 0) {
+      assembler_free(as);
+      if (source) munmap((void *) source, len);
+      close(fd);
+      return 1;
+    }
+
+    code = assembler_code(as, &size);
+
+    /* warnings would be lost on a hit, so only clean builds are kept, and
+       only of sources that are the whole of their program */
+    const pdiag_t *diags;
+    if (source && !assembler_diags(as, &diags) && !assembler_includes(as) && cache_store(cache, source, len, code, size) != 0)
+      fprintf(stderr, "%s: failed to write to cache %s\n", filename, cache);
+  }
+
+  if (source) munmap((void *) source, len);
+  close(fd);
+
+  svm_t *cpu = svm_new((unsigned char *) code, size);
+  if (!cpu) {
+    printf("failed to create virtual machine instance for file: %s\n", filename);
+    assembler_free(as); cache_unload(&img);
+    return 1;
+  }
+
+  /* run the bytecode */
+  svm_run_n_max(cpu, instr_max);
+
+  /* dump the registers? */
+  if (dump_reg) svm_reg_dump(cpu);
+
+  /* cleanup */
+  svm_free(cpu);
+  assembler_free(as);
+  cache_unload(&img);
+  return 0;
+}
+
+
+/**
+ * run an image that is already bytecode, as -O, -a and -l write them
+**/
+int run_image(char *filename, int dump_reg, int instr_max) {
+  size_t len;
+  char *code = read_file(filename, &len);
+  if (!code) {
+    printf("failed to read file: %s\n", filename);
+    return 1;
+  }
+
+  svm_t *cpu = (len && len <= 0xffff) ? svm_new((unsigned char *) code, len) : NULL;
+  free(code);
+  if (!cpu) {
+    printf("failed to create virtual machine instance for file: %s\n", filename);
+    return 1;
+  }
+
+  svm_run_n_max(cpu, instr_max);
+  if (dump_reg) svm_reg_dump(cpu);
+
+  svm_free(cpu);
+  return 0;
+}
+
+
+static void *watch_run(void *cpu) {
+  svm_run((svm_t *) cpu);
+  return NULL;
+}
+
+
+/**
+ * run a source file, reassembling it whenever it changes and patching the
+ * running program with the new code
+**/
+int watch_file(char *filename) {
+  passembler_t *as = assembler_new();
+  if (assemble_file(as, filename) != 0) {
+    assembler_free(as);
+    return 1;
+  }
+
+  unsigned int size;
+  const unsigned char *code = assembler_code(as, &size);
+
+  svm_t *cpu = svm_new((unsigned char *) code, size);
+  if (!cpu) {
+    printf("failed to create virtual machine instance for file: %s\n", filename);
+    assembler_free(as);
+    return 1;
+  }
+
+  struct stat sb;
+  time_t mtime = (stat(filename, &sb) == 0) ? sb.st_mtime : 0;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, watch_run, cpu) != 0) {
+    printf("failed to start virtual machine for file: %s\n", filename);
+    svm_free(cpu); assembler_free(as);
+    return 1;
+  }
+
+  while (__atomic_load_n(&cpu->running, __ATOMIC_RELAXED)) {
+    usleep(250 * 1000);
+    if (stat(filename, &sb) != 0 || sb.st_mtime == mtime) continue;
+    mtime = sb.st_mtime;
+
+    /* a bad edit leaves the running code alone */
+    if (assemble_file(as, filename) != 0) continue;
+
+    unsigned int nmap, reused, emitted;
+    const svm_remap_t *map = assembler_remap(as, &nmap);
+    code = assembler_code(as, &size);
+    assembler_stats(as, &reused, &emitted);
+
+    if (svm_patch(cpu, code, size, map, nmap) != 0)
+      printf("%s: can't patch the running program\n", filename);
+    else
+      fprintf(stderr, "%s: %u segments reassembled, %u reused\n", filename, emitted, reused);
+  }
+
+  pthread_join(thread, NULL);
+  svm_free(cpu);
+  assembler_free(as);
+  return 0;
+}
+
+
+/* a source file and what assembling it printed */
+typedef struct {
+  char *path;
+  char *report;
+  size_t report_len;
+  int failed;
+} batch_file_t;
+
+typedef struct {
+  batch_file_t *files;
+  unsigned int nfiles, cap;
+  unsigned int next;      /* the next file a worker takes */
+  const char *cache;
+} batch_t;
+
+
+static void batch_add(batch_t *b, const char *path) {
+  if (b->nfiles == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 64;
+    b->files = realloc(b->files, b->cap * sizeof(*b->files));
+    if (!b->files) svm_panic(NULL, "out of memory");
+  }
+  memset(&b->files[b->nfiles], '\0', sizeof(*b->files));
+  b->files[b->nfiles++].path = strdup(path);
+}
+
+
+static int by_path(const void *a, const void *b) {
+  return strcmp(((const batch_file_t *) a)->path, ((const batch_file_t *) b)->path);
+}
+
+
+/* every .in file under `dir` */
+static void batch_scan(batch_t *b, const char *dir) {
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  if (!d) return;
+
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.') continue;
+
+    char *path = malloc(strlen(dir) + strlen(e->d_name) + 2);
+    if (!path) svm_panic(NULL, "out of memory");
+    sprintf(path, "%s/%s", dir, e->d_name);
+
+    struct stat sb;
+    size_t len = strlen(e->d_name);
+    if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) batch_scan(b, path);
+    else if (len > 3 && !strcmp(e->d_name + len - 3, ".in")) batch_add(b, path);
+    free(path);
+  }
+
+  closedir(d);
+}
+
+
+static void batch_one(passembler_t *as, batch_file_t *f, const char *cache) {
+  FILE *report = open_memstream(&f->report, &f->report_len);
+  size_t len;
+
+  char *source = read_file(f->path, &len);
+  if (!source) {
+    fprintf(report, "failed to read file: %s\n", f->path);
+    f->failed = 1;
+    fclose(report);
+    return;
+  }
+
+  assembler_path(as, f->path);
+  f->failed = assembler_assemble(as, source, len) != 0;
+
+  const pdiag_t *diags;
+  unsigned int n = assembler_diags(as, &diags);
+  for (unsigned int i = 0; i < n; i++)
+    fprintf(report, "%s:%lu: %s%s\n", diags[i].file ? diags[i].file : f->path, (unsigned long) diags[i].line,
+            diags[i].warning ? "warning: " : "", diags[i].message);
+
+  if (!f->failed) {
+    unsigned int size;
+    const unsigned char *code = assembler_code(as, &size);
+
+    /* foo.in becomes foo.raw, as with the compiler */
+    char *out = malloc(strlen(f->path) + 5);
+    if (!out) svm_panic(NULL, "out of memory");
+    strcpy(out, f->path);
+    char *dot = strrchr(out, '.'), *slash = strrchr(out, '/');
+    if (dot && (!slash || dot > slash)) *dot = '\0';
+    strcat(out, ".raw");
+
+    FILE *fp = fopen(out, "wb");
+    if (!fp || fwrite(code, 1, size, fp) != size) {
+      fprintf(report, "failed to write file: %s\n", out);
+      f->failed = 1;
+    }
+    if (fp && fclose(fp) != 0) f->failed = 1;
+    free(out);
+
+    if (cache && !n && !assembler_includes(as)) cache_store(cache, source, len, code, size);
+  }
+
+  free(source);
+  fclose(report);
+}
+
+
+static void *batch_worker(void *udata) {
+  batch_t *b = udata;
+
+  /* one assembler per worker, segments shared between its files are
+     only emitted once */
+  passembler_t *as = assembler_new();
+
+  for (;;) {
+    unsigned int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (i >= b->nfiles) break;
+    batch_one(as, &b->files[i], b->cache);
+  }
+
+  assembler_free(as);
+  return NULL;
+}
+
+
+/**
+ * assemble every file named, and every .in file under each directory
+ * named, on all cores. reports come out in file order once all are done
+**/
+int batch_assemble(char **paths, int npaths, int jobs) {
+  batch_t b = { 0 };
+  b.cache = getenv("CACHE");
+
+  for (int i = 0; i < npaths; i++) {
+    struct stat sb;
+    if (stat(paths[i], &sb) == 0 && S_ISDIR(sb.st_mode)) batch_scan(&b, paths[i]);
+    else batch_add(&b, paths[i]);
+  }
+  qsort(b.files, b.nfiles, sizeof(*b.files), by_path);
+
+  if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0) jobs = 1;
+  if ((unsigned int) jobs > b.nfiles) jobs = b.nfiles ? b.nfiles : 1;
+
+  pthread_t *threads = malloc(jobs * sizeof(*threads));
+  if (!threads) svm_panic(NULL, "out of memory");
+
+  int started = 0;
+  for (; started < jobs; started++)
+    if (pthread_create(&threads[started], NULL, batch_worker, &b) != 0) break;
+
+  /* nothing started, do it here */
+  if (!started) batch_worker(&b);
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  free(threads);
+
+  unsigned int failed = 0;
+  for (unsigned int i = 0; i < b.nfiles; i++) {
+    batch_file_t *f = &b.files[i];
+    fwrite(f->report, 1, f->report_len, stdout);
+    failed += f->failed;
+    free(f->report);
+    free(f->path);
+  }
+
+  fprintf(stderr, "%u files assembled, %u failed\n", b.nfiles - failed, failed);
+  free(b.files);
+  return failed ? 1 : 0;
+}
+
+
+/**
+ * assemble a source into a module for the linker
+**/
+int module_file(char *filename, char *output) {
+  passembler_t *as = assembler_new();
+  assembler_module(as, true);
+
+  if (assemble_file(as, filename) != 0) {
+    assembler_free(as);
+    return 1;
+  }
+
+  FILE *fp = fopen(output, "wb");
+  if (!fp) {
+    printf("failed to open file: %s\n", output);
+    assembler_free(as); return 1;
+  }
+
+  int failed = assembler_write_module(as, fp) != 0;
+  failed |= fclose(fp) != 0;
+  if (failed) printf("failed to write file: %s\n", output);
+
+  assembler_free(as);
+  return failed;
+}
+
+
+/**
+ * link modules into a program, the first one's code runs first
+**/
+int link_files(char *output, char **inputs, int n) {
+  plink_t *l = link_new();
+
+  for (int i = 0; i < n; i++) {
+    size_t len;
+    char *data = read_file(inputs[i], &len);
+    if (!data) {
+      printf("failed to read file: %s\n", inputs[i]);
+      link_free(l); return 1;
+    }
+    link_add(l, inputs[i], (unsigned char *) data, len);
+    free(data);
+  }
+
+  char *const *errors;
+  unsigned int nerrors = link_errors(l, &errors);
+  if (!nerrors && link_finish(l) != 0) nerrors = link_errors(l, &errors);
+
+  for (unsigned int i = 0; i < nerrors; i++) printf("%s\n", errors[i]);
+  if (nerrors) {
+    link_free(l);
+    return 1;
+  }
+
+  unsigned int size;
+  const unsigned char *code = link_code(l, &size);
+
+  FILE *fp = fopen(output, "wb");
+  if (!fp || fwrite(code, 1, size, fp) != size) {
+    printf("failed to write file: %s\n", output);
+    if (fp) fclose(fp);
+    link_free(l); return 1;
+  }
+  fclose(fp);
+
+  link_free(l);
+  return 0;
+}
+
+
+/**
+ * run the optimizer over a compiled program, writing the result to `output`
+**/
+int optimize_file(char *filename, char *output) {
+  static unsigned char code[0xffff];
 
   FILE *fp = fopen(filename, "rb");
   if (!fp) {
@@ -42,62 +511,158 @@ int run_file(char *filename, int dump_reg, int instr_max) {
     return 1;
   }
 
-  // unsigned char *code = malloc(size);
-  // memset(code, '\0', size);
+  size_t size = fread(code, 1, sizeof(code), fp);
+  fclose(fp);
 
-  /* parse input `experimental` */
-  char *code = calloc(1, size);
-  memset(code, '\0', size);
+  unsigned int out_size = size;
+  unsigned char *out = svm_optimize(code, size, &out_size, OPT_ALL);
+  if (!out) printf("%s: left untouched\n", filename);
 
-  if (!code) {
-    printf("failed to allocate ram for file: %s\n", filename);
-    fclose(fp); return 1;
+  fp = fopen(output, "wb");
+  if (!fp) {
+    printf("failed to open file: %s\n", output);
+    free(out); return 1;
   }
 
-  /* abort on a short-read, or error */
-  size_t read = fread(code, 1, size, fp);
-  if (read < 1 || (read < (size_t)size)) {
-    printf("failed to completely read file: %s\n", filename);
-    fclose(fp); return 1;
+  fwrite(out ? out : code, 1, out_size, fp);
+  fclose(fp);
+
+  free(out);
+  return 0;
+}
+
+
+/**
+ * disassemble a compiled program to stdout, with addresses if asked
+**/
+int disasm_file(char *filename, int flags) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    printf("failed to open file: %s\n", filename);
+    return 1;
   }
 
+  struct stat sb;
+  unsigned char *code = NULL;
+  size_t size = 0;
+
+  if (fstat(fileno(fp), &sb) == 0 && sb.st_size > 0) {
+    code = malloc(sb.st_size);
+    if (code) size = fread(code, 1, sb.st_size, fp);
+  }
   fclose(fp);
 
-  /* parse input `experimental` */
-  lexer_init(code);
-  ptoken_t t = lexer_get_token();
-  while (t.type != TOK_EOF) {
-    if (t.type == TOK_ERROR) {
-      printf("%s: %lu: ", filename, t.line);
-      for (size_t i = 0; i < t.len; i++) putchar(*(t.start+i));
-      putchar('\n');
-    } // else printf("%s: ", token_name(t.type));
+  if (!code) {
+    printf("failed to read file: %s\n", filename);
+    return 1;
+  }
+
+  int rc = svm_disasm_write(stdout, code, size, flags);
+  free(code);
+  return rc ? 1 : 0;
+}
 
-    // for (size_t i = 0; i < t.len; i++) putchar(*(t.start+i));
-    // putchar('\n');
-    t = lexer_get_token();
+
+/**
+ * print a trace written by a TRACE=file run: the events, then the
+ * instructions the ring kept with the flags each one changed
+**/
+int dump_trace(char *filename) {
+  svm_trace_t *t = svm_trace_load(filename);
+  if (!t) {
+    printf("failed to read trace: %s\n", filename);
+    return 1;
   }
 
+  unsigned int n = svm_trace_records(t);
+  printf("%llu instructions, last %u kept, %u events\n", t->count, n, t->nevents);
 
-  // svm_t *cpu = svm_new(code, size);
-  // if (!cpu) {
-  //   printf("failed to create virtual machine instance for file: %s\n", filename);
-  //   return 1;
-  // }
+  for (unsigned int i = 0; i < t->nevents; i++) {
+    const svm_trace_event_t *e = &t->events[i];
+    if (e->kind == SVM_EV_SEED) {
+      printf("  #%llu seed", e->seq);
+      for (unsigned int b = 0; b < e->len; b++) printf(b % 4 ? "%02x" : " %02x", (unsigned char) e->data[b]);
+      putchar('\n');
+    } else
+      printf("  #%llu system \"%s\" -> %d\n", e->seq, e->data, (int) e->value);
+  }
 
-  /* run the bytecode */
-  // svm_run_n_max(cpu, instr_max);
+  static const char names[] = "zsco";
+  unsigned char prev = 0;
 
-  /* dump the registers? */
-  // if (dump_reg) svm_reg_dump(cpu);
+  for (unsigned int i = 0; i < n; i++) {
+    const svm_trace_rec_t *r = svm_trace_record(t, i);
+    unsigned long long seq = t->count - n + i + 1;
 
-  /* cleanup */
-  // svm_free(cpu);
-  // free(code);
+    /* the instruction as loaded, unless the program wrote over it */
+    char text[40];
+    op_insn_t insn;
+    if (r->ip < t->size && r->opcode == t->code[r->ip] &&
+        op_decode(t->code, t->size, r->ip, &insn))
+      svm_disasm_format(&insn, text, sizeof(text));
+    else
+      snprintf(text, sizeof(text), "%s", token_name((ptoken_type_t) r->opcode));
+
+    printf("%10llu  %04x  %-28s", seq, r->ip, text);
+
+    int nregs = 1;
+    switch (op_format(r->opcode)) {
+      case OPF_RR: case OPF_RRR: nregs = 2; break;
+      case OPF_NONE: case OPF_I: case OPF_REL: nregs = 0; break;
+      default: break;
+    }
+
+    for (int v = 0; v < nregs; v++) {
+      if (r->flags & (v ? SVM_TF_STR1 : SVM_TF_STR0)) printf("  str[%u]", r->value[v]);
+      else printf("  %d", (int) r->value[v]);
+    }
+
+    /* the flags this record's predecessor left behind */
+    if (i && ((r->flags ^ prev) & 0x0f)) {
+      printf("  ;");
+      for (int f = 0; f < 4; f++)
+        if ((r->flags ^ prev) & (1 << f)) printf(" %c=%d", names[f], !!(r->flags & (1 << f)));
+    }
+    putchar('\n');
+    prev = r->flags;
+  }
+
+  svm_trace_free(t);
   return 0;
 }
 
 
+/**
+ * run a trace's program again, feeding it the recorded random numbers and
+ * system results, and check it follows the recording
+**/
+int replay_trace(char *filename) {
+  svm_trace_t *t = svm_trace_load(filename);
+  if (!t) {
+    printf("failed to read trace: %s\n", filename);
+    return 1;
+  }
+
+  svm_t *cpu = svm_new(t->code, t->size);
+  if (!cpu) {
+    printf("failed to create virtual machine instance for trace: %s\n", filename);
+    svm_trace_free(t);
+    return 1;
+  }
+
+  unsigned long long total = t->total;
+  svm_trace_replay(cpu, t);
+  svm_run(cpu);
+
+  int ok = (t->count == total);
+  fprintf(stderr, "replay %s %llu of %llu instructions\n",
+          ok ? "matched" : "stopped after", t->count, total);
+
+  svm_free(cpu);
+  return !ok;
+}
+
+
 /**
  * simple driver for launching virtual machine
  * given a filename parse/execute the opcodes contained within it
@@ -108,9 +673,88 @@ int main(int argc, char **argv) {
 
   if (argc < 2) {
     printf("usage: %s input max\n", argv[0]);
+    printf("       %s -r input.raw [max]\n", argv[0]);
+    printf("       %s -O input.raw output.raw\n", argv[0]);
+    printf("       %s -T trace | -R trace\n", argv[0]);
+    printf("       %s -d input.raw | -D input.raw\n", argv[0]);
+    printf("       %s -w input\n", argv[0]);
+    printf("       %s -a [-j jobs] input|directory ...\n", argv[0]);
+    printf("       %s -c input output.svmo\n", argv[0]);
+    printf("       %s -l output.raw input.svmo ...\n", argv[0]);
     return 0;
   }
 
+  if (!strcmp(argv[1], "-r")) {
+    if (argc < 3) {
+      printf("usage: %s -r input.raw [max]\n", argv[0]);
+      return 1;
+    }
+    instr_max = (argc > 3) ? atoi(argv[3]) : 0;
+    if (getenv("DEBUG") != NULL) dump_reg = 1;
+    return run_image(argv[2], dump_reg, instr_max);
+  }
+
+  if (!strcmp(argv[1], "-O")) {
+    if (argc < 4) {
+      printf("usage: %s -O input.raw output.raw\n", argv[0]);
+      return 1;
+    }
+    return optimize_file(argv[2], argv[3]);
+  }
+
+  if (!strcmp(argv[1], "-c")) {
+    if (argc < 4) {
+      printf("usage: %s -c input output.svmo\n", argv[0]);
+      return 1;
+    }
+    return module_file(argv[2], argv[3]);
+  }
+
+  if (!strcmp(argv[1], "-l")) {
+    if (argc < 4) {
+      printf("usage: %s -l output.raw input.svmo ...\n", argv[0]);
+      return 1;
+    }
+    return link_files(argv[2], argv + 3, argc - 3);
+  }
+
+  if (!strcmp(argv[1], "-T") || !strcmp(argv[1], "-R")) {
+    if (argc < 3) {
+      printf("usage: %s %s trace\n", argv[0], argv[1]);
+      return 1;
+    }
+    return (argv[1][1] == 'T') ? dump_trace(argv[2]) : replay_trace(argv[2]);
+  }
+
+  if (!strcmp(argv[1], "-d") || !strcmp(argv[1], "-D")) {
+    if (argc < 3) {
+      printf("usage: %s %s input.raw\n", argv[0], argv[1]);
+      return 1;
+    }
+    return disasm_file(argv[2], (argv[1][1] == 'D') ? SVM_DISASM_ADDRESS : 0);
+  }
+
+  if (!strcmp(argv[1], "-a")) {
+    int first = 2, jobs = 0;
+    if (argc > 3 && !strcmp(argv[2], "-j")) {
+      jobs = atoi(argv[3]);
+      first = 4;
+    }
+    if (argc <= first) {
+      printf("usage: %s -a [-j jobs] input|directory ...\n", argv[0]);
+      return 1;
+    }
+    return batch_assemble(argv + first, argc - first, jobs);
+  }
+
+  if (!strcmp(argv[1], "-w")) {
+    if (argc < 3) {
+      printf("usage: %s -w input\n", argv[0]);
+      return 1;
+    }
+    return watch_file(argv[2]);
+  }
+
   if (argc >= 2) {
     instr_max = (argv[2] ? atoi(argv[2]) : 0);
     if (getenv("DEBUG") != NULL) dump_reg = 1;
@@ -0,0 +1,141 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "../svm/op.h"
+
+/**
+ * The compiled-image cache.
+ *
+ * Images are filed under a hash of their source and of the opcode table,
+ * so an edited script, or a vm whose opcodes moved, never finds a stale
+ * one and nothing has to be invalidated. Each file is a header and the
+ * code, which is mapped read-only and handed to the vm as it is.
+ *
+ * Files are written to a temporary name and renamed into place, so a
+ * reader only ever sees a whole image however many writers race.
+ */
+
+#define CACHE_MAGIC   "SVMC"
+#define CACHE_FORMAT  1   /* bump when the assembler's output changes */
+
+typedef struct {
+  char magic[4];
+  unsigned int format;
+  unsigned int table;       /* op_table_version */
+  unsigned int size;        /* of the code after the header */
+  unsigned long long hash;  /* of the source */
+  unsigned long long len;
+} pcache_header_t;
+
+
+static unsigned long long hash_source(const char *s, size_t len) {
+  unsigned long long hash = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) s[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+
+static void header(pcache_header_t *h, const char *source, size_t len, unsigned int size) {
+  memset(h, '\0', sizeof(*h));
+  memcpy(h->magic, CACHE_MAGIC, 4);
+  h->format = CACHE_FORMAT;
+  h->table = op_table_version();
+  h->size = size;
+  h->hash = hash_source(source, len);
+  h->len = len;
+}
+
+
+static void path(char *buf, size_t n, const char *dir, const pcache_header_t *h) {
+  snprintf(buf, n, "%s/%016llx-%08x.svmc", dir, h->hash, h->table);
+}
+
+
+int cache_load(const char *dir, const char *source, size_t len, pimage_t *img) {
+  pcache_header_t want;
+  char file[4096];
+  struct stat sb;
+
+  header(&want, source, len, 0);
+  path(file, sizeof(file), dir, &want);
+
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return -1;
+
+  if (fstat(fd, &sb) != 0 || (size_t) sb.st_size <= sizeof(want)) {
+    close(fd); return -1;
+  }
+
+  void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  /* the name says what it should hold, the header says what it does */
+  const pcache_header_t *h = map;
+  if (memcmp(h->magic, CACHE_MAGIC, 4) || h->format != want.format ||
+      h->table != want.table || h->hash != want.hash || h->len != want.len ||
+      !h->size || h->size > 0xffff || h->size != sb.st_size - sizeof(*h)) {
+    munmap(map, sb.st_size);
+    return -1;
+  }
+
+  img->code = (const unsigned char *) map + sizeof(*h);
+  img->size = h->size;
+  img->map = map;
+  img->maplen = sb.st_size;
+  return 0;
+}
+
+
+void cache_unload(pimage_t *img) {
+  if (img->map) munmap(img->map, img->maplen);
+  memset(img, '\0', sizeof(*img));
+}
+
+
+int cache_store(const char *dir, const char *source, size_t len,
+                const unsigned char *code, unsigned int size) {
+  static unsigned int serial;
+  pcache_header_t h;
+  char file[4096], tmp[4160];
+
+  header(&h, source, len, size);
+  path(file, sizeof(file), dir, &h);
+
+  /* threads storing the same source get a file each, the last rename wins */
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%u.tmp", file, (long) getpid(),
+           __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+
+  /* the directory may not be there the first time */
+  mkdir(dir, 0777);
+
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) return -1;
+
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(code, 1, size, fp);
+  int failed = ferror(fp);
+
+  if (fclose(fp) != 0 || failed || rename(tmp, file) != 0) {
+    remove(tmp);
+    return -1;
+  }
+
+  return 0;
+}
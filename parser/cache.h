@@ -0,0 +1,29 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+/* a cached image, mapped straight from its file */
+typedef struct {
+  const unsigned char *code;
+  unsigned int size;
+  void *map;
+  size_t maplen;
+} pimage_t;
+
+/* 0 and the image if `source` was assembled before, -1 if not */
+int cache_load(const char *dir, const char *source, size_t len, pimage_t *img);
+void cache_unload(pimage_t *img);
+
+/* keep the image `source` assembled to, returns -1 if it couldn't be */
+int cache_store(const char *dir, const char *source, size_t len,
+                const unsigned char *code, unsigned int size);
+
+#endif
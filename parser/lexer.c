@@ -7,8 +7,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "lexer.h"
 #include "token.h"
+#include "scan.h"
 #include "../util.h"
 
 /*
@@ -32,9 +35,17 @@
 
 [-] system #3         # Call the (string) command stored in register 3
 
+[-] hash #1, #2       # Store the hash of the string in register 2 in register 1
+[-] prefix #1, #2     # Set the Z-flag if the string in reg 1 starts with reg 2
+[-] find #1, #2, #3   # Store the offset of reg 3 in reg 2 (or -1) in reg 1
+[-] switch #1, "a": l1, "b": l2  # Jump to the label for the string in reg 1
+
 [-] add #1, #2, #3    # Add register 2 + register 3 contents, store in reg 1
 [-] sub #1, #2, #3    # sub register 2 + register 3 contents, store in reg 1
 [-] mul #1, #2, #3    # multiply register 2 + register 3 contents, store in reg 1
+[-] lft #1, #2, #3    # shift register 2 left by register 3, store in reg 1
+[-] rgt #1, #2, #3    # shift register 2 right by register 3, store in reg 1
+[-] not #1, #2        # store the bitwise complement of register 2 in reg 1
 [-] concat #1, #2,#3  # store concatenated strings from reg2 + reg3 in reg1.
 
 [-] dec #2            # Decrement the integer in register 2
@@ -52,6 +63,7 @@
 [-] peek #1, #4       # Load register 1 with the contents of the address in #4.
 [-] poke #1, #4       # Set the address stored in register4 with the contents of reg1.
 [-] random #2         # Store a random integer in register #2.
+[-] random_fill #1, #2 # Fill #2 bytes from the address in #1 with random bytes.
 
 [-] push #1           # Store the contents of register #1 in the stack
 [-] pop  #1           # Load register #1 with the contents of the stack.
@@ -61,58 +73,18 @@
 
 */
 
+/* an opcode's mnemonic, the first opcode listed wins a shared one */
 static pkeyword_t keywords[] = {
-  { "nop", 3, TOK_OP_NOP },
-  { "exit", 4, TOK_OP_EXIT },
-  { "peek", 4, TOK_OP_PEEK },
-  { "poke", 4, TOK_OP_POKE },
-  { "memcpy", 5, TOK_OP_MEMCPY },
-
-  { "goto", 4, TOK_OP_JUMP_TO },
-  { "jmpz", 4, TOK_OP_JUMP_Z },
-  { "jmpnz", 5, TOK_OP_JUMP_NZ },
-
-  { "pop", 3, TOK_OP_STACK_POP },
-  { "ret", 3, TOK_OP_STACK_RET },
-  { "call", 4, TOK_OP_STACK_CALL },
-  { "push", 4, TOK_OP_STACK_PUSH },
-
-  { "or",  2, TOK_OP_MATH_OR },
-  { "xor", 3, TOK_OP_MATH_XOR },
-  { "add", 3, TOK_OP_MATH_ADD },
-  { "sub", 3, TOK_OP_MATH_SUB },
-  { "mul", 3, TOK_OP_MATH_MUL },
-  { "div", 3, TOK_OP_MATH_DIV },
-  { "inc", 3, TOK_OP_MATH_INC },
-  { "dec", 3, TOK_OP_MATH_DEC },
-  { "and", 3, TOK_OP_MATH_AND },
-  { "lft", 3, TOK_OP_MATH_LFT },
-  { "rgt", 3, TOK_OP_MATH_RGT },
-  { "not", 3, TOK_OP_MATH_NOT },
-
-  { "store", 5, TOP_OP_INT_STORE },
-  { "random", 6, TOK_OP_INT_RANDOM },
-  { "print_int", 9, TOK_OP_INT_PRINT },
-  { "int2string", 10, TOK_OP_INT_TOSTRING },
-
-  { "store", 5, TOK_OP_STRING_STORE },
-  { "concat", 6, TOK_OP_STRING_CONCAT },
-  { "system", 6, TOK_OP_STRING_SYSTEM },
-  { "print_str", 9, TOK_OP_STRING_PRINT },
-  { "string2int", 10, TOK_OP_STRING_TOINT },
-
-  { "cmp", 3, TOK_OP_CMP_REG },
-  { "cmp", 3, TOK_OP_CMP_IMMEDIATE },
-  { "cmp", 3, TOK_OP_CMP_STRING },
-  { "is_string", 9, TOK_OP_IS_STRING },
-  { "is_integer", 10, TOK_OP_IS_NUMBER },
-
-  { "store", 5, TOK_OP_STORE_REG },
+#define OP(name, value, format, handler, unchecked, mnemonic) \
+  { mnemonic, sizeof(mnemonic) - 1, TOK_OP_##name },
+#include "../svm/op_list.h"
+#undef OP
 
   { NULL,       0, TOK_EOF,          },
 };
 
-plexer_t Lexer;
+/* one per thread, so assemblers can run side by side */
+_Thread_local plexer_t Lexer;
 
 static unsigned hash(const char *name) {
   unsigned hash = 0;
@@ -121,11 +93,94 @@ static unsigned hash(const char *name) {
   return hash;
 }
 
-void lexer_init(const char *source) {
+void lexer_init(const char *source, size_t len) {
   Lexer.source = source;
   Lexer.token_start = source;
   Lexer.current = source;
+  Lexer.end = source + len;
   Lexer.line = 0;
+  Lexer.read = NULL;
+  Lexer.eof = true;
+  Lexer.failed = false;
+}
+
+
+static long read_fd(void *udata, char *buf, size_t n) {
+  ssize_t r;
+  do r = read(*(int *) udata, buf, n);
+  while (r < 0 && errno == EINTR);
+  return r;
+}
+
+
+void lexer_init_fd(int fd) {
+  Lexer.fd = fd;
+  lexer_init_reader(read_fd, &Lexer.fd);
+}
+
+
+void lexer_init_reader(plexer_read_t read, void *udata) {
+  if (!Lexer.buf) {
+    Lexer.buf = malloc(LEXER_CHUNK);
+    if (!Lexer.buf) ERROR("out of memory");
+    Lexer.cap = LEXER_CHUNK;
+  }
+
+  lexer_init(Lexer.buf, 0);
+  Lexer.read = read;
+  Lexer.udata = udata;
+  Lexer.eof = false;
+}
+
+
+bool lexer_failed(void) {
+  return Lexer.failed;
+}
+
+
+void lexer_done(void) {
+  free(Lexer.buf);
+  Lexer.buf = NULL;
+  Lexer.cap = 0;
+  lexer_init(NULL, 0);
+}
+
+
+/**
+ * Read the next piece of a stream. The token being lexed moves to the
+ * front of the window with the rest of the window after it, the window
+ * only grows for a token longer than itself. Returns false at the end.
+ */
+static bool refill() {
+  if (Lexer.eof) return false;
+
+  size_t keep = Lexer.end - Lexer.token_start;
+  size_t at = Lexer.current - Lexer.token_start;
+
+  if (keep + LEXER_CHUNK / 2 > Lexer.cap) {
+    size_t cap = Lexer.cap * 2;
+    char *buf = malloc(cap);
+    if (!buf) ERROR("out of memory");
+    memcpy(buf, Lexer.token_start, keep);
+    free(Lexer.buf);
+    Lexer.buf = buf;
+    Lexer.cap = cap;
+  } else {
+    memmove(Lexer.buf, Lexer.token_start, keep);
+  }
+
+  long n = Lexer.read(Lexer.udata, Lexer.buf + keep, Lexer.cap - keep);
+
+  if (n <= 0) {
+    Lexer.eof = true;
+    Lexer.failed = (n < 0);
+    n = 0;
+  }
+
+  Lexer.source = Lexer.token_start = Lexer.buf;
+  Lexer.current = Lexer.buf + at;
+  Lexer.end = Lexer.buf + keep + n;
+  return n > 0;
 }
 
 static bool is_alpha(char c) {
@@ -143,7 +198,9 @@ static bool is_alpha_num(char c) {
 }
 
 static bool is_at_end() {
-  return *Lexer.current == '\0';
+  while (Lexer.current >= Lexer.end)
+    if (!refill()) return true;
+  return false;
 }
 
 static char advance() {
@@ -151,22 +208,18 @@ static char advance() {
   return Lexer.current[-1];
 }
 
+/* '\0' at the end, a NUL in the source is lexed as an error */
 static char peek() {
+  if (is_at_end()) return '\0';
   return *Lexer.current;
 }
 
 static char next() {
-  if (is_at_end()) return '\0';
+  while (Lexer.current + 1 >= Lexer.end)
+    if (!refill()) return '\0';
   return Lexer.current[1];
 }
 
-static bool match(char e) {
-  if (is_at_end()) return false;
-  if (*Lexer.current != e) return false;
-  Lexer.current++;
-  return true;
-}
-
 ptoken_t make_token(ptoken_type_t t) {
   ptoken_t token;
   token.type = t;
@@ -187,44 +240,48 @@ ptoken_t make_token(ptoken_type_t t) {
 
 ptoken_t error_token(const char c) {
   ptoken_t token;
+  (void) c;
   token.type = TOK_ERROR;
-  token.start = &c;
+  token.start = Lexer.current - 1;
   token.len = 1;
   token.line = Lexer.line;
   return token;
 }
 
-#define WHITESPACE  " \n\t\r"
+/* an error the lexer can put in words, longer than any bad character */
+static ptoken_t error_message(const char *msg) {
+  ptoken_t token;
+  token.type = TOK_ERROR;
+  token.start = msg;
+  token.len = strlen(msg);
+  token.line = Lexer.line;
+  return token;
+}
 
+/* nothing skipped is kept across a refill */
 void skip_whitespace() {
-  for (;;) {
-    char c = peek();
+  size_t lines;
 
-    while (c && strchr(WHITESPACE, c)) {
-      if (c == '\n') Lexer.line++;
-      advance();
-      c = peek();
-    }
+  while (!is_at_end()) {
+    Lexer.current = scan_space(Lexer.current, Lexer.end, &lines);
+    Lexer.token_start = Lexer.current;
+    Lexer.line += lines;
+    if (Lexer.current == Lexer.end) continue;
 
-    if (peek() == '#' && !is_digit(next())) {
-      while (!match('\n') && !is_at_end()) advance();
-       // advance();
-      if (peek() == '\n') {
-        // putchar('n');
-        advance();
-        advance();
-        Lexer.line++;
-        // putchar('\n');
-      }
-    }
+    /* a comment runs to the end of the line, the newline is whitespace */
+    if (*Lexer.current != '#' || is_digit(next())) return;
 
-    return;
+    while (!is_at_end()) {
+      Lexer.current = scan_line(Lexer.current, Lexer.end);
+      Lexer.token_start = Lexer.current;
+      if (Lexer.current < Lexer.end) break;
+    }
   }
 }
 
 static ptoken_t indentifier() {
   while (is_alpha_num(peek())) advance();
-  ptoken_type_t type = TOK_COMMENT;
+  ptoken_type_t type = TOK_IDENTIFIER;
 
   size_t len = Lexer.current - Lexer.token_start;
   for(pkeyword_t *key = keywords; key->name != NULL; key++){
@@ -237,6 +294,13 @@ static ptoken_t indentifier() {
 }
 
 static ptoken_t number() {
+  if (Lexer.token_start[0] == '0' && (peek() == 'x' || peek() == 'X')) {
+    advance();
+    while (is_digit(peek()) || (peek() >= 'a' && peek() <= 'f') ||
+           (peek() >= 'A' && peek() <= 'F')) advance();
+    return make_token(TOK_NUMBER);
+  }
+
   while (is_digit(peek())) advance();
 
   /* look for fractional part */
@@ -249,34 +313,46 @@ static ptoken_t number() {
   return make_token(TOK_NUMBER);
 }
 
+/* the '#' is already taken */
 static ptoken_t _register() {
-  if (match('#'))
-    while (is_digit(peek())) advance();
+  while (is_digit(peek())) advance();
   return make_token(TOK_REGISTER);
 }
 
+/* ":name" defines a label, a ':' on its own ends a switch case's string */
 static ptoken_t label() {
-  if (match(':'))
-    // if ()
-    while (is_digit(peek())) advance();
-  return make_token(TOK_REGISTER);
+  if (!is_alpha_num(peek())) return make_token(TOK_COLON);
+  while (is_alpha_num(peek())) advance();
+  return make_token(TOK_LABEL);
 }
 
 static ptoken_t string() {
-  while (peek() != '"' && !is_at_end()) {
-    if (peek() == '\n') Lexer.line++;
-    advance();
-  }
+  bool whole = true;
+  size_t lines;
 
-  /* unterminated string */
-  // if (is_at_end()) return error_token("unterminated string");
+  for (;;) {
+    if (is_at_end()) return error_message("unterminated string");
+
+    Lexer.current = scan_quote(Lexer.current, Lexer.end, &lines);
+    Lexer.line += lines;
+
+    /* no string this long assembles, stop keeping it */
+    if (Lexer.current - Lexer.token_start >= LEXER_STRING_MAX) {
+      Lexer.token_start = Lexer.current;
+      whole = false;
+    }
+
+    if (Lexer.current < Lexer.end) break;
+  }
 
   /* the closing '"' */
   advance();
+  if (!whole) return error_message("string longer than 65535 bytes");
   return make_token(TOK_STRING);
 }
 
 ptoken_t lexer_get_token() {
+  Lexer.token_start = Lexer.current;
   skip_whitespace();
 
   /* next token starts with current character */
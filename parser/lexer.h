@@ -9,16 +9,43 @@
 #define LEXER_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include "token.h"
 
+#define LEXER_CHUNK       65536    /* read from a stream at a time */
+#define LEXER_STRING_MAX  0x10001  /* the longest string kept, with its opening quote */
+
+/* up to `n` bytes into `buf`, 0 at the end and -1 if reading failed */
+typedef long (*plexer_read_t)(void *udata, char *buf, size_t n);
+
 typedef struct {
   const char *source;
   const char *token_start;
   const char *current;
+  const char *end;
   size_t line;
+
+  /* reading a stream: the window, and where it comes from */
+  plexer_read_t read;
+  void *udata;
+  int fd;
+  char *buf;
+  size_t cap;
+  bool eof, failed;
 } plexer_t;
 
-void lexer_init(const char *source);
+/* lex `len` bytes of memory, which needn't end in a NUL */
+void lexer_init(const char *source, size_t len);
+
+/**
+ * Lex what `fd` has, a window at a time. A token's text only lasts until
+ * the next lexer_get_token, which may move the window.
+ */
+void lexer_init_fd(int fd);
+void lexer_init_reader(plexer_read_t read, void *udata);
+bool lexer_failed(void);
+void lexer_done(void);
+
 ptoken_t lexer_get_token();
 
 #endif
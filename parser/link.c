@@ -0,0 +1,388 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link.h"
+#include "../svm/op.h"
+
+/**
+ * The linker.
+ *
+ * A module is code assembled on its own, with the labels it defines and
+ * the 16-bit fields that wait on where it ends up: addresses in itself,
+ * and labels other modules define. Linking lays modules out one after
+ * another, the first at 0 where the vm starts, and fills those in.
+ *
+ * Code that only branches with the relative instructions has no fields
+ * for its own labels at all, so a library assembled once is copied into
+ * each program as it is and only its calls out are touched.
+ *
+ * A module is a header, the code, then the records:
+ *
+ *   label  addr16 len16 name[len]
+ *   field  at16 kind8 len16 name[len]
+ */
+
+#define LINK_MAGIC   "SVMO"
+#define LINK_FORMAT  1
+
+typedef struct {
+  char magic[4];
+  unsigned int format;
+  unsigned int table;       /* op_table_version */
+  unsigned int size;        /* of the code */
+  unsigned int nsyms, nrelocs;
+} plink_header_t;
+
+typedef struct {
+  char *name;               /* the file it came from */
+  unsigned char *code;
+  unsigned int size, base;
+  plink_sym_t *syms;
+  unsigned int nsyms;
+  plink_reloc_t *relocs;
+  unsigned int nrelocs;
+  char *names;              /* the records' names point in here */
+} pmodule_t;
+
+/* a label, once laid out */
+typedef struct {
+  const char *name;
+  unsigned int addr;
+  const pmodule_t *module;
+} plabel_t;
+
+struct plink_t {
+  pmodule_t *modules;
+  unsigned int nmodules, modules_cap;
+
+  plabel_t *labels;         /* open addressing on the name */
+  unsigned int labels_cap;
+
+  unsigned char *code;
+  unsigned int size;
+
+  char **errors;
+  unsigned int nerrors, errors_cap;
+};
+
+
+static void *grow(void *ptr, unsigned int *cap, unsigned int need, size_t size) {
+  if (need <= *cap) return ptr;
+
+  unsigned int n = *cap ? *cap : 16;
+  while (n < need) n *= 2;
+
+  void *p = realloc(ptr, n * size);
+  if (!p) svm_panic(NULL, "out of memory");
+  *cap = n;
+  return p;
+}
+
+
+static char *copy(const char *s, size_t len) {
+  char *p = malloc(len + 1);
+  if (!p) svm_panic(NULL, "out of memory");
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+
+static unsigned long long hash_name(const char *s) {
+  unsigned long long hash = 14695981039346656037ull;
+  for (; *s; s++) {
+    hash ^= (unsigned char) *s;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+
+static void error(plink_t *l, const char *fmt, ...) {
+  char buf[512];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  l->errors = grow(l->errors, &l->errors_cap, l->nerrors + 1, sizeof(*l->errors));
+  l->errors[l->nerrors++] = copy(buf, strlen(buf));
+}
+
+
+static void put16(FILE *fp, unsigned int v) {
+  fputc(v & 0xff, fp);
+  fputc((v >> 8) & 0xff, fp);
+}
+
+
+static void put_name(FILE *fp, const char *name) {
+  size_t len = name ? strlen(name) : 0;
+  put16(fp, len);
+  if (len) fwrite(name, 1, len, fp);
+}
+
+
+int link_write(FILE *fp, const unsigned char *code, unsigned int size,
+               const plink_sym_t *syms, unsigned int nsyms,
+               const plink_reloc_t *relocs, unsigned int nrelocs) {
+  plink_header_t h;
+
+  memset(&h, '\0', sizeof(h));
+  memcpy(h.magic, LINK_MAGIC, 4);
+  h.format = LINK_FORMAT;
+  h.table = op_table_version();
+  h.size = size;
+  h.nsyms = nsyms;
+  h.nrelocs = nrelocs;
+
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(code, 1, size, fp);
+
+  for (unsigned int i = 0; i < nsyms; i++) {
+    put16(fp, syms[i].addr);
+    put_name(fp, syms[i].name);
+  }
+  for (unsigned int i = 0; i < nrelocs; i++) {
+    put16(fp, relocs[i].at);
+    fputc(relocs[i].kind, fp);
+    put_name(fp, relocs[i].name);
+  }
+
+  return ferror(fp) ? -1 : 0;
+}
+
+
+plink_t *link_new(void) {
+  plink_t *l = calloc(1, sizeof(*l));
+  if (!l) svm_panic(NULL, "out of memory");
+  return l;
+}
+
+
+void link_free(plink_t *l) {
+  if (!l) return;
+
+  for (unsigned int i = 0; i < l->nmodules; i++) {
+    pmodule_t *m = &l->modules[i];
+    free(m->name);
+    free(m->code);
+    free(m->syms);
+    free(m->relocs);
+    free(m->names);
+  }
+  for (unsigned int i = 0; i < l->nerrors; i++) free(l->errors[i]);
+
+  free(l->modules);
+  free(l->labels);
+  free(l->code);
+  free(l->errors);
+  free(l);
+}
+
+
+/* reading a module's records */
+typedef struct {
+  const unsigned char *p, *end;
+  char *names;
+  bool bad;
+} preader_t;
+
+
+static unsigned int get16(preader_t *r) {
+  if (r->end - r->p < 2) {
+    r->bad = true;
+    return 0;
+  }
+  r->p += 2;
+  return r->p[-2] | (r->p[-1] << 8);
+}
+
+
+static const char *get_name(preader_t *r) {
+  unsigned int len = get16(r);
+  if (!len || r->bad) return NULL;
+  if ((unsigned int) (r->end - r->p) < len) {
+    r->bad = true;
+    return NULL;
+  }
+
+  char *name = r->names;
+  memcpy(name, r->p, len);
+  name[len] = '\0';
+  r->names += len + 1;
+  r->p += len;
+  return name;
+}
+
+
+int link_add(plink_t *l, const char *name, const unsigned char *data, size_t len) {
+  plink_header_t h;
+
+  if (len < sizeof(h)) {
+    error(l, "%s: not a module", name);
+    return -1;
+  }
+
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, LINK_MAGIC, 4) || h.format != LINK_FORMAT) {
+    error(l, "%s: not a module", name);
+    return -1;
+  }
+  if (h.table != op_table_version()) {
+    error(l, "%s: assembled for other opcodes, assemble it again", name);
+    return -1;
+  }
+  if (h.size > 0xffff || h.size > len - sizeof(h) || h.nsyms > len || h.nrelocs > len) {
+    error(l, "%s: module is cut short", name);
+    return -1;
+  }
+
+  pmodule_t m;
+  memset(&m, '\0', sizeof(m));
+
+  m.code = malloc(h.size ? h.size : 1);
+  m.syms = calloc(h.nsyms ? h.nsyms : 1, sizeof(*m.syms));
+  m.relocs = calloc(h.nrelocs ? h.nrelocs : 1, sizeof(*m.relocs));
+  m.names = malloc(len);     /* more than the names and their NULs need */
+  if (!m.code || !m.syms || !m.relocs || !m.names) svm_panic(NULL, "out of memory");
+
+  memcpy(m.code, data + sizeof(h), h.size);
+  m.size = h.size;
+
+  preader_t r = { data + sizeof(h) + h.size, data + len, m.names, false };
+
+  for (unsigned int i = 0; i < h.nsyms && !r.bad; i++) {
+    m.syms[i].addr = get16(&r);
+    m.syms[i].name = get_name(&r);
+    if (!m.syms[i].name || m.syms[i].addr > m.size) r.bad = true;
+  }
+  m.nsyms = h.nsyms;
+
+  for (unsigned int i = 0; i < h.nrelocs && !r.bad; i++) {
+    m.relocs[i].at = get16(&r);
+    if (r.p < r.end) m.relocs[i].kind = *r.p++;
+    else r.bad = true;
+    m.relocs[i].name = get_name(&r);
+
+    if (m.relocs[i].at + 2 > m.size || m.relocs[i].kind > LINK_REL ||
+        (m.relocs[i].kind == LINK_ABS && !m.relocs[i].name))
+      r.bad = true;
+  }
+  m.nrelocs = h.nrelocs;
+
+  if (r.bad) {
+    error(l, "%s: module is cut short", name);
+    free(m.code); free(m.syms); free(m.relocs); free(m.names);
+    return -1;
+  }
+
+  m.name = copy(name, strlen(name));
+  l->modules = grow(l->modules, &l->modules_cap, l->nmodules + 1, sizeof(*l->modules));
+  l->modules[l->nmodules++] = m;
+  return 0;
+}
+
+
+static plabel_t *label_slot(plink_t *l, const char *name) {
+  unsigned int slot = hash_name(name) & (l->labels_cap - 1);
+  while (l->labels[slot].name && strcmp(l->labels[slot].name, name))
+    slot = (slot + 1) & (l->labels_cap - 1);
+  return &l->labels[slot];
+}
+
+
+int link_finish(plink_t *l) {
+  unsigned int size = 0, nsyms = 0;
+
+  for (unsigned int i = 0; i < l->nmodules; i++) {
+    l->modules[i].base = size;
+    size += l->modules[i].size;
+    nsyms += l->modules[i].nsyms;
+  }
+
+  if (size > 0xffff) error(l, "program is %u bytes, the most is 65535", size);
+  if (!size) error(l, "no code to link");
+  if (l->nerrors) return -1;
+
+  /* every module's labels, in one table */
+  unsigned int cap = 16;
+  while (cap < nsyms * 2 + 2) cap *= 2;
+  l->labels = calloc(cap, sizeof(*l->labels));
+  if (!l->labels) svm_panic(NULL, "out of memory");
+  l->labels_cap = cap;
+
+  for (unsigned int i = 0; i < l->nmodules; i++) {
+    const pmodule_t *m = &l->modules[i];
+    for (unsigned int s = 0; s < m->nsyms; s++) {
+      plabel_t *label = label_slot(l, m->syms[s].name);
+      if (label->name) {
+        error(l, "label '%s' is defined in %s and in %s", label->name, label->module->name, m->name);
+        continue;
+      }
+      *label = (plabel_t) { m->syms[s].name, m->base + m->syms[s].addr, m };
+    }
+  }
+
+  unsigned char *code = malloc(size);
+  if (!code) svm_panic(NULL, "out of memory");
+
+  for (unsigned int i = 0; i < l->nmodules; i++) {
+    const pmodule_t *m = &l->modules[i];
+    memcpy(code + m->base, m->code, m->size);
+
+    for (unsigned int r = 0; r < m->nrelocs; r++) {
+      const plink_reloc_t *rel = &m->relocs[r];
+      unsigned char *field = code + m->base + rel->at;
+      unsigned int value = field[0] | (field[1] << 8);
+
+      if (rel->name) {
+        const plabel_t *label = label_slot(l, rel->name);
+        if (!label->name) {
+          error(l, "%s: no label '%s'", m->name, rel->name);
+          continue;
+        }
+        value = label->addr;
+      } else if (rel->kind == LINK_LOCAL) {
+        value += m->base;
+      }
+
+      if (rel->kind == LINK_REL) value = OP_REL_OFFSET(m->base + rel->at + 2, value);
+
+      field[0] = value & 0xff;
+      field[1] = (value >> 8) & 0xff;
+    }
+  }
+
+  if (l->nerrors) {
+    free(code);
+    return -1;
+  }
+
+  l->code = code;
+  l->size = size;
+  return 0;
+}
+
+
+const unsigned char *link_code(const plink_t *l, unsigned int *size) {
+  if (size) *size = l->size;
+  return l->code;
+}
+
+
+unsigned int link_errors(const plink_t *l, char *const **errors) {
+  *errors = l->errors;
+  return l->nerrors;
+}
@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct plink_t plink_t;
+
+/* a label a module defines, at an offset into its code */
+typedef struct {
+  const char *name;
+  unsigned int addr;
+} plink_sym_t;
+
+typedef enum {
+  LINK_LOCAL,   /* an address in the module, moves with it */
+  LINK_ABS,     /* the address of `name` */
+  LINK_REL      /* `name`, or the address already there if NULL, as a rel16 */
+} plink_kind_t;
+
+/* a 16-bit field at `at` the linker fills in */
+typedef struct {
+  unsigned int at;
+  plink_kind_t kind;
+  const char *name;
+} plink_reloc_t;
+
+/* write a module, 0 on success */
+int link_write(FILE *fp, const unsigned char *code, unsigned int size,
+               const plink_sym_t *syms, unsigned int nsyms,
+               const plink_reloc_t *relocs, unsigned int nrelocs);
+
+plink_t *link_new(void);
+void link_free(plink_t *l);
+
+/* add a module read from `name`, in the order they are to be laid out */
+int link_add(plink_t *l, const char *name, const unsigned char *data, size_t len);
+
+/* lay the modules out one after another and fill in their fields, 0 on success */
+int link_finish(plink_t *l);
+
+const unsigned char *link_code(const plink_t *l, unsigned int *size);
+unsigned int link_errors(const plink_t *l, char *const **errors);
+
+#endif
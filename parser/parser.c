@@ -1 +1,1245 @@
-#include "parser.h"
\ No newline at end of file
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "parser.h"
+#include "lexer.h"
+#include "link.h"
+#include "preproc.h"
+#include "token.h"
+#include "../svm/op.h"
+#include "../svm/str.h"
+
+/**
+ * The assembler.
+ *
+ * Reads what the Perl compiler reads and emits the same bytes. The source
+ * is cut into segments, one per label, each running from its ":name" line
+ * to the next. A segment's bytes don't depend on where it ends up, label
+ * references are left as fixups, so segments are cached by their text and
+ * only the ones an edit touched are lexed and emitted again. Building an
+ * image is then copying segments into place and filling in fixups.
+ *
+ * The source goes through the preprocessor first, segments are cut from
+ * what it expands to, and diagnostics are moved back to the lines they
+ * came from.
+ *
+ * After a build, assembler_remap says where each labelled segment of the
+ * previous image went and whether its bytes changed, which is what
+ * svm_patch needs to move a running vm onto the new image.
+ */
+
+#define MAX_OPERANDS 3
+
+typedef struct {
+  char *label;          /* the label wanted, NULL for `addr` */
+  unsigned int at;      /* offset of the addr16 in the segment */
+  size_t line;          /* in the segment, from 0 */
+  bool rel;             /* a rel16, counting from the end of the field */
+  unsigned int addr;
+} pfixup_t;
+
+typedef struct {
+  size_t line;          /* in the segment, from 0 */
+  bool warning;
+  char *message;
+} pnote_t;
+
+typedef struct psegment_t psegment_t;
+
+struct psegment_t {
+  unsigned long long hash;
+  char *text;           /* NUL-terminated copy of the source */
+  size_t len;
+  char *label;          /* NULL for code ahead of the first label */
+
+  unsigned char *code;
+  unsigned int size, cap;
+
+  pfixup_t *fixups;
+  unsigned int nfixups, fixups_cap;
+
+  pnote_t *notes;       /* kept so a cached segment reports them again */
+  unsigned int nnotes;
+  bool failed;
+
+  unsigned int mark;    /* last build that used it */
+};
+
+/* a segment's place in a build */
+typedef struct {
+  psegment_t *seg;
+  unsigned int addr;
+  size_t line;          /* of its first line, from 0 */
+} pplace_t;
+
+struct passembler_t {
+  psegment_t **cache;
+  unsigned int ncache, cache_cap;
+  psegment_t **index;   /* open addressing on the text hash */
+  unsigned int index_cap;
+
+  pplace_t *places, *good;
+  unsigned int nplaces, places_cap, ngood;
+
+  unsigned char *code;
+  unsigned int size;
+
+  pdiag_t *diags;
+  unsigned int ndiags, diags_cap;
+
+  svm_remap_t *map;
+  unsigned int nmap;
+  bool have_map;
+
+  bool module;          /* labels it doesn't define are left for the linker */
+  plink_reloc_t *relocs;
+  unsigned int nrelocs, relocs_cap;
+
+  char *path;
+  ppreproc_t *pp;       /* the last build's, diagnostics point into it */
+  char *text;           /* what it expanded to */
+  size_t text_cap;
+
+  unsigned int build;
+  unsigned int reused, emitted;
+};
+
+typedef enum { A_REG, A_NUM, A_NAME, A_STR } poperand_kind_t;
+
+typedef struct {
+  poperand_kind_t kind;
+  unsigned int value;
+  const char *text;     /* a name, or a string with its escapes expanded */
+  unsigned int len;
+  size_t line;
+} poperand_t;
+
+/* the segment being emitted */
+typedef struct {
+  psegment_t *seg;
+  ptoken_t tok;
+  bool line_start;      /* tok is the first on its line */
+  size_t base;          /* the lexer's line for the segment's first */
+
+  /* operand text, which a streaming lexer doesn't keep past the next token */
+  char **held;
+  unsigned int nheld, held_cap;
+
+  passembler_t *stream; /* set when labels start segments as they come */
+  unsigned int total;   /* bytes in the segments before this one */
+} pstate_t;
+
+
+static void *grow(void *ptr, unsigned int *cap, unsigned int need, size_t size) {
+  if (need <= *cap) return ptr;
+
+  unsigned int n = *cap ? *cap : 16;
+  while (n < need) n *= 2;
+
+  void *p = realloc(ptr, n * size);
+  if (!p) svm_panic(NULL, "out of memory");
+  *cap = n;
+  return p;
+}
+
+
+static char *copy(const char *s, size_t len) {
+  char *p = malloc(len + 1);
+  if (!p) svm_panic(NULL, "out of memory");
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+
+static unsigned long long hash_text(const char *s, size_t len) {
+  unsigned long long hash = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) s[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+
+static bool is_name(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+
+/*
+ * Emitting a segment
+ */
+
+static void note(pstate_t *p, size_t line, bool warning, const char *fmt, ...) {
+  psegment_t *s = p->seg;
+  char buf[256];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  pnote_t *notes = realloc(s->notes, (s->nnotes + 1) * sizeof(*notes));
+  if (!notes) svm_panic(NULL, "out of memory");
+  s->notes = notes;
+  s->notes[s->nnotes++] = (pnote_t) { line - p->base, warning, copy(buf, strlen(buf)) };
+  if (!warning) s->failed = true;
+}
+
+
+static void advance(pstate_t *p) {
+  size_t line = p->tok.line;
+  bool first = (p->tok.type == TOK_EOF);
+
+  p->tok = lexer_get_token();
+  p->line_start = first || p->tok.line != line;
+}
+
+
+/* a copy of `len` bytes that lasts until the statement is done */
+static char *hold(pstate_t *p, const char *s, size_t len) {
+  p->held = grow(p->held, &p->held_cap, p->nheld + 1, sizeof(*p->held));
+  return p->held[p->nheld++] = copy(s, len);
+}
+
+
+static void release(pstate_t *p) {
+  for (unsigned int i = 0; i < p->nheld; i++) free(p->held[i]);
+  p->nheld = 0;
+}
+
+
+/* what the lexer couldn't make sense of, a character or its own words */
+static void bad_token(pstate_t *p) {
+  const ptoken_t *t = &p->tok;
+  unsigned char c = t->start[0];
+
+  if (t->len > 1) note(p, t->line, false, "%.*s", (int) t->len, t->start);
+  else if (c > ' ' && c < 127) note(p, t->line, false, "unexpected '%c'", c);
+  else note(p, t->line, false, "unexpected byte 0x%02x", c);
+}
+
+
+/* skip what's left of a bad line */
+static void recover(pstate_t *p, size_t line) {
+  while (p->tok.type != TOK_EOF && p->tok.line == line) advance(p);
+}
+
+
+static void emit(pstate_t *p, unsigned int byte) {
+  psegment_t *s = p->seg;
+  s->code = grow(s->code, &s->cap, s->size + 1, 1);
+  s->code[s->size++] = byte;
+}
+
+
+static void emit16(pstate_t *p, unsigned int value) {
+  emit(p, value & 0xff);
+  emit(p, (value >> 8) & 0xff);
+}
+
+
+static void emit_bytes(pstate_t *p, const char *data, unsigned int len) {
+  psegment_t *s = p->seg;
+  s->code = grow(s->code, &s->cap, s->size + len, 1);
+  memcpy(s->code + s->size, data, len);
+  s->size += len;
+}
+
+
+/* the target of a relative jump, filled in when the image is built */
+static void emit_rel(pstate_t *p, const poperand_t *o) {
+  psegment_t *s = p->seg;
+  s->fixups = grow(s->fixups, &s->fixups_cap, s->nfixups + 1, sizeof(*s->fixups));
+  s->fixups[s->nfixups++] = (pfixup_t) {
+    o->kind == A_NAME ? copy(o->text, o->len) : NULL, s->size, o->line - p->base, true, o->value
+  };
+  emit16(p, 0);
+}
+
+
+/* a number, or the address of a label filled in when the image is built */
+static void emit_value(pstate_t *p, const poperand_t *o) {
+  if (o->kind == A_NUM) {
+    emit16(p, o->value);
+    return;
+  }
+
+  psegment_t *s = p->seg;
+  s->fixups = grow(s->fixups, &s->fixups_cap, s->nfixups + 1, sizeof(*s->fixups));
+  s->fixups[s->nfixups++] = (pfixup_t) {
+    copy(o->text, o->len), s->size, o->line - p->base, false, 0
+  };
+  emit16(p, 0);
+}
+
+
+static bool parse_number(const char *s, size_t len, unsigned int *value) {
+  unsigned long long v = 0;
+  size_t i = 0;
+  int base = 10;
+
+  if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) { base = 16; i = 2; }
+  if (i == len) return false;
+
+  for (; i < len; i++) {
+    int d;
+    if (s[i] >= '0' && s[i] <= '9') d = s[i] - '0';
+    else if (base == 16 && s[i] >= 'a' && s[i] <= 'f') d = s[i] - 'a' + 10;
+    else if (base == 16 && s[i] >= 'A' && s[i] <= 'F') d = s[i] - 'A' + 10;
+    else return false;
+
+    v = v * base + d;
+    if (v > 0xffffffffull) return false;
+  }
+
+  *value = (unsigned int) v;
+  return true;
+}
+
+
+/* a string token's contents with \n and \t expanded, in place */
+static unsigned int unescape(char *s, size_t len) {
+  unsigned int n = 0;
+
+  for (size_t i = 1; i + 1 < len; i++) {
+    char c = s[i];
+    if (c == '\\' && i + 2 < len && (s[i + 1] == 'n' || s[i + 1] == 't')) {
+      c = (s[++i] == 'n') ? '\n' : '\t';
+    }
+    s[n++] = c;
+  }
+
+  return n;
+}
+
+
+static bool operand(pstate_t *p, poperand_t *o) {
+  o->value = 0;
+  o->text = NULL;
+  o->len = 0;
+  o->line = p->tok.line;
+
+  switch (p->tok.type) {
+    case TOK_REGISTER:
+      o->kind = A_REG;
+      if (!parse_number(p->tok.start + 1, p->tok.len - 1, &o->value) ||
+          o->value >= REGISTER_COUNT) {
+        note(p, p->tok.line, false, "no register '%.*s'", (int) p->tok.len, p->tok.start);
+        return false;
+      }
+      break;
+
+    case TOK_NUMBER:
+      o->kind = A_NUM;
+      if (!parse_number(p->tok.start, p->tok.len, &o->value) || o->value > 0xffff) {
+        note(p, p->tok.line, false, "'%.*s' doesn't fit in 16 bits", (int) p->tok.len, p->tok.start);
+        return false;
+      }
+      break;
+
+    case TOK_STRING:
+      o->kind = A_STR;
+      if (p->tok.len - 2 > 0xffff) {
+        note(p, p->tok.line, false, "string longer than 65535 bytes");
+        return false;
+      }
+      o->text = hold(p, p->tok.start, p->tok.len);
+      o->len = unescape((char *) o->text, p->tok.len);
+      break;
+
+    case TOK_IDENTIFIER:
+      o->kind = A_NAME;
+      o->text = hold(p, p->tok.start, p->tok.len);
+      o->len = p->tok.len;
+      break;
+
+    case TOK_ERROR:
+      bad_token(p);
+      advance(p);
+      return false;
+
+    default:
+      /* a label may share its name with an instruction */
+      if (p->tok.type >= 0 && p->tok.type <= 0xff && p->tok.len && is_name(p->tok.start[0])) {
+        o->kind = A_NAME;
+        o->text = hold(p, p->tok.start, p->tok.len);
+        o->len = p->tok.len;
+        break;
+      }
+      note(p, p->tok.line, false, "expected an operand, not '%.*s'", (int) p->tok.len, p->tok.start);
+      return false;
+  }
+
+  advance(p);
+  return true;
+}
+
+
+static void string_operand(pstate_t *p, const poperand_t *o) {
+  emit16(p, o->len);
+  emit_bytes(p, o->text, o->len);
+}
+
+
+typedef struct {
+  const char *str;
+  unsigned int len, hash;
+  poperand_t dest;
+} pcase_t;
+
+
+static int case_order(const void *a, const void *b) {
+  unsigned int x = ((const pcase_t *) a)->hash, y = ((const pcase_t *) b)->hash;
+  return (x > y) - (x < y);
+}
+
+
+/**
+ * switch #1, "GET": get, "POST": 0x0200
+ *
+ * Entries are sorted by hash for the vm's binary search, with their
+ * strings pooled after the table.
+ */
+static void switch_statement(pstate_t *p, const poperand_t *reg, size_t line) {
+  pcase_t *cases = NULL;
+  unsigned int ncases = 0, cap = 0, pool = 0;
+  bool ok = true;
+
+  while (ok && p->tok.type == TOK_COMMA) {
+    poperand_t str;
+    advance(p);
+
+    if (p->tok.type != TOK_STRING) {
+      note(p, p->tok.line, false, "expected a string to switch on");
+      ok = false; break;
+    }
+    if (!operand(p, &str)) { ok = false; break; }
+
+    cases = grow(cases, &cap, ncases + 1, sizeof(*cases));
+    pcase_t *c = &cases[ncases++];
+    c->str = str.text;
+    c->len = str.len;
+    c->hash = svm_hash_bytes(c->str, c->len);
+    pool += c->len;
+
+    /* "a": dest, or "a":dest which lexes as a label */
+    if (p->tok.type == TOK_LABEL) {
+      c->dest.text = hold(p, p->tok.start + 1, p->tok.len - 1);
+      c->dest.len = p->tok.len - 1;
+      c->dest.line = p->tok.line;
+      c->dest.kind = parse_number(c->dest.text, c->dest.len, &c->dest.value) ? A_NUM : A_NAME;
+      advance(p);
+    } else if (p->tok.type == TOK_COLON) {
+      advance(p);
+      ok = operand(p, &c->dest) && (c->dest.kind == A_NUM || c->dest.kind == A_NAME);
+      if (!ok) note(p, line, false, "expected a destination for case \"%.*s\"", (int) c->len, c->str);
+    } else {
+      note(p, line, false, "expected ':' after case \"%.*s\"", (int) c->len, c->str);
+      ok = false;
+    }
+  }
+
+  if (ok && (ncases > 0xffff || pool > 0xffff)) {
+    note(p, line, false, "switch too large");
+    ok = false;
+  }
+
+  if (ok) {
+    qsort(cases, ncases, sizeof(*cases), case_order);
+
+    emit(p, STRING_SWITCH);
+    emit(p, reg->value);
+    emit16(p, ncases);
+    emit16(p, pool);
+
+    unsigned int at = 0;
+    for (unsigned int i = 0; i < ncases; i++) {
+      emit16(p, cases[i].hash & 0xffff);
+      emit16(p, cases[i].hash >> 16);
+      emit16(p, cases[i].len);
+      emit16(p, at);
+      emit_value(p, &cases[i].dest);
+      at += cases[i].len;
+    }
+
+    for (unsigned int i = 0; i < ncases; i++) emit_bytes(p, cases[i].str, cases[i].len);
+  }
+
+  free(cases);
+  if (!ok) recover(p, line);
+}
+
+
+/* db 1, 2, 0x10 */
+static void data_statement(pstate_t *p, size_t line) {
+  if (p->tok.line != line) return;
+
+  for (;;) {
+    poperand_t o;
+    if (!operand(p, &o)) { recover(p, line); return; }
+    if (o.kind != A_NUM || o.value > 0xff) {
+      note(p, line, false, "data must be numbers from 0 to 255");
+      recover(p, line); return;
+    }
+    emit(p, o.value);
+
+    if (p->tok.type != TOK_COMMA) return;
+    advance(p);
+  }
+}
+
+
+/* which of the opcodes sharing a mnemonic the operands ask for */
+static int variant(int opcode, const poperand_t *o, unsigned int n) {
+  poperand_kind_t second = (n > 1) ? o[1].kind : A_NUM;
+
+  switch (opcode) {
+    case INT_STORE:
+      if (second == A_STR) return STRING_STORE;
+      if (second == A_REG) return STORE_REG;
+      return INT_STORE;
+
+    case CMP_REG:
+      if (second == A_STR) return CMP_STRING;
+      if (second == A_REG) return CMP_REG;
+      return CMP_IMMEDIATE;
+
+    case JUMP_LT: return (n && o[0].kind == A_REG) ? JUMP_LT_IMM : JUMP_LT;
+    case JUMP_GT: return (n && o[0].kind == A_REG) ? JUMP_GT_IMM : JUMP_GT;
+  }
+
+  return opcode;
+}
+
+
+static bool shape(op_format_t format, const poperand_t *o, unsigned int n) {
+#define IS(i, k) (o[i].kind == (k))
+#define IS_VALUE(i) (IS(i, A_NUM) || IS(i, A_NAME))
+  switch (format) {
+    case OPF_NONE: return n == 0;
+    case OPF_R: return n == 1 && IS(0, A_REG);
+    case OPF_RR: return n == 2 && IS(0, A_REG) && IS(1, A_REG);
+    case OPF_RRR: return n == 3 && IS(0, A_REG) && IS(1, A_REG) && IS(2, A_REG);
+    case OPF_RI: return n == 2 && IS(0, A_REG) && IS_VALUE(1);
+    case OPF_I: case OPF_REL: return n == 1 && IS_VALUE(0);
+    case OPF_RS: return n == 2 && IS(0, A_REG) && IS(1, A_STR);
+    case OPF_RIA: return n == 3 && IS(0, A_REG) && IS(1, A_NUM) && IS_VALUE(2);
+    case OPF_SWITCH: case OPF_TABLE: return n == 1 && IS(0, A_REG);
+  }
+  return false;
+#undef IS
+#undef IS_VALUE
+}
+
+
+static void statement(pstate_t *p) {
+  ptoken_type_t type = p->tok.type;
+  size_t line = p->tok.line;
+  int opcode = -1;
+  bool multi;
+  char name[32];
+
+  /* the token goes with the next one, keep its name for messages */
+  snprintf(name, sizeof(name), "%.*s", (int) p->tok.len, p->tok.start);
+  advance(p);
+
+  if (type == TOK_IDENTIFIER) {
+    if (!strcmp(name, "jmp")) opcode = JUMP_TO;
+    else if (!strcasecmp(name, "db") || !strcasecmp(name, "data")) {
+      data_statement(p, line);
+      return;
+    }
+  } else if (type >= 0 && type <= 0xff) {
+    opcode = type;
+  }
+
+  if (opcode < 0) {
+    note(p, line, false, "unknown instruction '%s'", name);
+    recover(p, line);
+    return;
+  }
+
+  /* jump tables and switches take a list after their register */
+  multi = (opcode == JUMP_TABLE || opcode == STRING_SWITCH);
+
+  poperand_t o[MAX_OPERANDS];
+  unsigned int n = 0;
+
+  if (p->tok.type != TOK_EOF && p->tok.line == line) {
+    for (;;) {
+      if (!operand(p, &o[n])) { recover(p, line); return; }
+      n++;
+      if (p->tok.type != TOK_COMMA || n == MAX_OPERANDS || (multi && n == 1)) break;
+      advance(p);
+    }
+  }
+
+  opcode = variant(opcode, o, n);
+  op_format_t format = op_format(opcode);
+
+  if (!shape(format, o, n)) {
+    note(p, line, false, "wrong operands for '%s'", name);
+    recover(p, line);
+    return;
+  }
+
+  if (opcode == STRING_SWITCH) {
+    switch_statement(p, &o[0], line);
+    return;
+  }
+
+  if (opcode == JUMP_TABLE) {
+    poperand_t dests[1];
+    unsigned int count = 0, at;
+
+    emit(p, JUMP_TABLE);
+    emit(p, o[0].value);
+    at = p->seg->size;
+    emit16(p, 0);
+
+    while (p->tok.type == TOK_COMMA) {
+      advance(p);
+      if (!operand(p, &dests[0]) || (dests[0].kind != A_NUM && dests[0].kind != A_NAME)) {
+        note(p, line, false, "expected a destination in the jump table");
+        recover(p, line);
+        return;
+      }
+      emit_value(p, &dests[0]);
+      count++;
+    }
+
+    p->seg->code[at] = count & 0xff;
+    p->seg->code[at + 1] = (count >> 8) & 0xff;
+  } else {
+    emit(p, opcode);
+
+    switch (format) {
+      case OPF_NONE: break;
+      case OPF_R: case OPF_RR: case OPF_RRR:
+        for (unsigned int i = 0; i < n; i++) emit(p, o[i].value);
+        break;
+      case OPF_RI: emit(p, o[0].value); emit_value(p, &o[1]); break;
+      case OPF_I: emit_value(p, &o[0]); break;
+      case OPF_REL: emit_rel(p, &o[0]); break;
+      case OPF_RS: emit(p, o[0].value); string_operand(p, &o[1]); break;
+      case OPF_RIA: emit(p, o[0].value); emit16(p, o[1].value); emit_value(p, &o[2]); break;
+      case OPF_SWITCH: case OPF_TABLE: break;
+    }
+  }
+
+  if (p->tok.type != TOK_EOF && p->tok.line == line) {
+    if (p->tok.type == TOK_ERROR) bad_token(p);
+    else note(p, line, false, "unexpected '%.*s'", (int) p->tok.len, p->tok.start);
+    recover(p, line);
+  }
+}
+
+
+static psegment_t *stream_segment(passembler_t *as, const char *label, size_t len, size_t line);
+
+
+/* a label in a stream ends one segment and starts the next */
+static void split(pstate_t *p) {
+  p->total += p->seg->size;
+  p->base = p->tok.line;
+  p->seg = stream_segment(p->stream, p->tok.start + 1, p->tok.len - 1, p->tok.line);
+  advance(p);
+}
+
+
+static void emit_statements(pstate_t *p) {
+  while (p->tok.type != TOK_EOF) {
+    if (p->tok.type == TOK_ERROR) {
+      bad_token(p);
+      recover(p, p->tok.line);
+      continue;
+    }
+    if (p->tok.type == TOK_LABEL) {
+      if (p->stream && p->line_start) {
+        split(p);
+        continue;
+      }
+      note(p, p->tok.line, false, "a label must start its line");
+      recover(p, p->tok.line);
+      continue;
+    }
+
+    statement(p);
+    release(p);
+
+    /* past what the vm can hold, reading further won't help */
+    if (p->stream && p->total + p->seg->size > 0xffff) break;
+  }
+
+  release(p);
+  free(p->held);
+}
+
+
+static void emit_segment(psegment_t *s) {
+  pstate_t p = { 0 };
+  p.seg = s;
+  p.tok.type = TOK_EOF;
+
+  lexer_init(s->text, s->len);
+  advance(&p);
+
+  /* the label that starts it is where it goes, nothing to emit */
+  if (s->label && p.tok.type == TOK_LABEL) advance(&p);
+
+  emit_statements(&p);
+}
+
+
+/*
+ * The segment cache
+ */
+
+static void segment_free(psegment_t *s) {
+  for (unsigned int i = 0; i < s->nfixups; i++) free(s->fixups[i].label);
+  for (unsigned int i = 0; i < s->nnotes; i++) free(s->notes[i].message);
+  free(s->fixups);
+  free(s->notes);
+  free(s->code);
+  free(s->text);
+  free(s->label);
+  free(s);
+}
+
+
+static void index_build(passembler_t *as) {
+  unsigned int cap = 16;
+  while (cap < as->ncache * 2 + 2) cap *= 2;
+
+  free(as->index);
+  as->index = calloc(cap, sizeof(*as->index));
+  if (!as->index) svm_panic(NULL, "out of memory");
+  as->index_cap = cap;
+
+  for (unsigned int i = 0; i < as->ncache; i++) {
+    /* streamed segments have no text to be found by */
+    if (!as->cache[i]->text) continue;
+
+    unsigned int slot = as->cache[i]->hash & (cap - 1);
+    while (as->index[slot]) slot = (slot + 1) & (cap - 1);
+    as->index[slot] = as->cache[i];
+  }
+}
+
+
+static psegment_t *segment_find(passembler_t *as, unsigned long long hash, const char *text, size_t len) {
+  unsigned int slot = hash & (as->index_cap - 1);
+
+  for (psegment_t *s; (s = as->index[slot]) != NULL; slot = (slot + 1) & (as->index_cap - 1))
+    if (s->hash == hash && s->len == len && !memcmp(s->text, text, len)) return s;
+
+  return NULL;
+}
+
+
+/* a line whose first non-blank is ':' starts a segment */
+static bool starts_segment(const char *line, const char *end) {
+  while (line < end && (*line == ' ' || *line == '\t')) line++;
+  return line < end && *line == ':' && line + 1 < end && is_name(line[1]);
+}
+
+
+static psegment_t *segment_get(passembler_t *as, const char *text, size_t len) {
+  unsigned long long hash = hash_text(text, len);
+  psegment_t *s = segment_find(as, hash, text, len);
+
+  if (s) {
+    as->reused++;
+    return s;
+  }
+
+  s = calloc(1, sizeof(*s));
+  if (!s) svm_panic(NULL, "out of memory");
+  s->hash = hash;
+  s->text = copy(text, len);
+  s->len = len;
+
+  /* a labelled segment's first line is its label */
+  if (starts_segment(text, text + len)) {
+    const char *name = memchr(s->text, ':', len);
+    size_t n = 0;
+    while (is_name(name[1 + n])) n++;
+    s->label = copy(name + 1, n);
+  }
+
+  emit_segment(s);
+  as->emitted++;
+
+  as->cache = grow(as->cache, &as->cache_cap, as->ncache + 1, sizeof(*as->cache));
+  as->cache[as->ncache++] = s;
+
+  /* keep the index under half full */
+  if (as->ncache * 2 > as->index_cap) index_build(as);
+  else {
+    unsigned int slot = hash & (as->index_cap - 1);
+    while (as->index[slot]) slot = (slot + 1) & (as->index_cap - 1);
+    as->index[slot] = s;
+  }
+
+  return s;
+}
+
+
+static void place(passembler_t *as, const char *text, size_t len, size_t line) {
+  psegment_t *s = segment_get(as, text, len);
+
+  as->places = grow(as->places, &as->places_cap, as->nplaces + 1, sizeof(*as->places));
+  as->places[as->nplaces++] = (pplace_t) { s, 0, line };
+  s->mark = as->build;
+}
+
+
+/**
+ * A segment for a stream. There is no text to key it by, so it stays out
+ * of the index, but it lives in the cache like the others until a build
+ * no longer uses it.
+ */
+static psegment_t *stream_segment(passembler_t *as, const char *label, size_t len, size_t line) {
+  psegment_t *s = calloc(1, sizeof(*s));
+  if (!s) svm_panic(NULL, "out of memory");
+  if (label) s->label = copy(label, len);
+
+  as->cache = grow(as->cache, &as->cache_cap, as->ncache + 1, sizeof(*as->cache));
+  as->cache[as->ncache++] = s;
+  as->emitted++;
+
+  as->places = grow(as->places, &as->places_cap, as->nplaces + 1, sizeof(*as->places));
+  as->places[as->nplaces++] = (pplace_t) { s, 0, line };
+  s->mark = as->build;
+  return s;
+}
+
+
+/*
+ * Building
+ */
+
+static void diag(passembler_t *as, size_t line, bool warning, const char *fmt, ...) {
+  char buf[256];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  as->diags = grow(as->diags, &as->diags_cap, as->ndiags + 1, sizeof(*as->diags));
+  as->diags[as->ndiags++] = (pdiag_t) { NULL, line, warning, copy(buf, strlen(buf)) };
+}
+
+
+static void diags_clear(passembler_t *as) {
+  for (unsigned int i = 0; i < as->ndiags; i++) free(as->diags[i].message);
+  as->ndiags = 0;
+}
+
+
+static const pplace_t *label_find(pplace_t **table, unsigned int cap, const char *name, size_t len) {
+  unsigned long long hash = hash_text(name, len);
+
+  for (unsigned int slot = hash & (cap - 1); table[slot]; slot = (slot + 1) & (cap - 1)) {
+    const char *label = table[slot]->seg->label;
+    if (strlen(label) == len && !memcmp(label, name, len)) return table[slot];
+  }
+
+  return NULL;
+}
+
+
+/* the labels of `places`, first definition wins */
+static pplace_t **labels(passembler_t *as, pplace_t *places, unsigned int n,
+                         unsigned int *cap, bool warn) {
+  unsigned int c = 16;
+  while (c < n * 2 + 2) c *= 2;
+
+  pplace_t **table = calloc(c, sizeof(*table));
+  if (!table) svm_panic(NULL, "out of memory");
+
+  for (unsigned int i = 0; i < n; i++) {
+    const char *label = places[i].seg->label;
+    if (!label) continue;
+
+    size_t len = strlen(label);
+    if (label_find(table, c, label, len)) {
+      if (warn) diag(as, places[i].line + 1, true, "label '%s' defined again, the first one is used", label);
+      continue;
+    }
+
+    unsigned int slot = hash_text(label, len) & (c - 1);
+    while (table[slot]) slot = (slot + 1) & (c - 1);
+    table[slot] = &places[i];
+  }
+
+  *cap = c;
+  return table;
+}
+
+
+/* match each new segment to the old one of the same label */
+static void remap(passembler_t *as, const unsigned char *old_code) {
+  unsigned int cap;
+  pplace_t **old = labels(as, as->good, as->ngood, &cap, false);
+  const pplace_t *prelude = (as->ngood && !as->good[0].seg->label) ? &as->good[0] : NULL;
+
+  free(as->map);
+  as->map = calloc(as->nplaces + 1, sizeof(*as->map));
+  if (!as->map) svm_panic(NULL, "out of memory");
+  as->nmap = 0;
+  as->have_map = true;
+
+  for (unsigned int i = 0; i < as->nplaces; i++) {
+    const pplace_t *now = &as->places[i];
+    const char *label = now->seg->label;
+    const pplace_t *was = label ? label_find(old, cap, label, strlen(label))
+                                : (i == 0 ? prelude : NULL);
+    if (!was) continue;
+
+    svm_remap_t *m = &as->map[as->nmap++];
+    m->from = was->addr;
+    m->len = was->seg->size;
+    m->to = now->addr;
+    m->same = (was->seg->size == now->seg->size) &&
+              !memcmp(old_code + was->addr, as->code + now->addr, now->seg->size);
+  }
+
+  free(old);
+}
+
+
+passembler_t *assembler_new(void) {
+  passembler_t *as = calloc(1, sizeof(*as));
+  if (!as) svm_panic(NULL, "out of memory");
+  index_build(as);
+  return as;
+}
+
+
+void assembler_free(passembler_t *as) {
+  if (!as) return;
+  for (unsigned int i = 0; i < as->ncache; i++) segment_free(as->cache[i]);
+  diags_clear(as);
+  free(as->cache);
+  free(as->index);
+  free(as->places);
+  free(as->good);
+  free(as->code);
+  free(as->diags);
+  free(as->map);
+  free(as->relocs);
+  free(as->path);
+  free(as->text);
+  preproc_free(as->pp);
+  free(as);
+}
+
+
+void assembler_module(passembler_t *as, bool module) {
+  as->module = module;
+}
+
+
+void assembler_path(passembler_t *as, const char *path) {
+  free(as->path);
+  as->path = path ? copy(path, strlen(path)) : NULL;
+}
+
+
+static void build_start(passembler_t *as) {
+  as->build++;
+  as->reused = as->emitted = 0;
+  as->nplaces = 0;
+  diags_clear(as);
+  preproc_free(as->pp);
+  as->pp = preproc_new(as->path);
+}
+
+
+static int build_finish(passembler_t *as, bool failed);
+
+
+int assembler_assemble(passembler_t *as, const char *source, size_t len) {
+  size_t n = 0;
+  long got;
+
+  build_start(as);
+  preproc_source(as->pp, source, len);
+
+  /* expand it all, the segments are cut from that */
+  do {
+    if (as->text_cap - n < LEXER_CHUNK) {
+      as->text_cap = (as->text_cap ? as->text_cap : LEXER_CHUNK) * 2;
+      as->text = realloc(as->text, as->text_cap);
+      if (!as->text) svm_panic(NULL, "out of memory");
+    }
+    got = preproc_read(as->pp, as->text + n, as->text_cap - n);
+    if (got > 0) n += got;
+  } while (got > 0);
+
+  const char *end = as->text + n, *start = as->text, *line = as->text;
+  size_t lineno = 0, start_line = 0;
+
+  /* cut the source into segments */
+  while (line < end) {
+    const char *eol = memchr(line, '\n', end - line);
+    const char *next = eol ? eol + 1 : end;
+
+    if (line != start && starts_segment(line, next)) {
+      place(as, start, line - start, start_line);
+      start = line;
+      start_line = lineno;
+    }
+
+    line = next;
+    lineno++;
+  }
+  if (start < end) place(as, start, end - start, start_line);
+
+  return build_finish(as, false);
+}
+
+
+/**
+ * Assemble what can be read from `fd`, a window at a time. Nothing is
+ * cached, segments are emitted as the labels go by, so memory follows
+ * the size of the image rather than of the source.
+ */
+static long read_expanded(void *udata, char *buf, size_t n) {
+  return preproc_read(udata, buf, n);
+}
+
+
+int assembler_assemble_fd(passembler_t *as, int fd) {
+  pstate_t p = { 0 };
+
+  build_start(as);
+  preproc_fd(as->pp, fd);
+  p.stream = as;
+  p.seg = stream_segment(as, NULL, 0, 0);
+  p.tok.type = TOK_EOF;
+
+  lexer_init_reader(read_expanded, as->pp);
+  advance(&p);
+  emit_statements(&p);
+
+  bool failed = lexer_failed();
+  if (failed) diag(as, p.tok.line + 1, false, "failed to read the source");
+  lexer_done();
+
+  return build_finish(as, failed);
+}
+
+
+static void reloc(passembler_t *as, unsigned int at, plink_kind_t kind, const char *label) {
+  as->relocs = grow(as->relocs, &as->relocs_cap, as->nrelocs + 1, sizeof(*as->relocs));
+  as->relocs[as->nrelocs++] = (plink_reloc_t) { at, kind, label };
+}
+
+
+/* lay the segments out, link them, and keep the image if it is good */
+static int build_finish(passembler_t *as, bool failed) {
+  unsigned int size = 0;
+  as->nrelocs = 0;
+  const ppdiag_t *pd;
+  unsigned int npd = preproc_diags(as->pp, &pd);
+
+  for (unsigned int i = 0; i < npd; i++) failed |= !pd[i].warning;
+
+  /* lay them out */
+  for (unsigned int i = 0; i < as->nplaces; i++) {
+    pplace_t *pl = &as->places[i];
+    psegment_t *s = pl->seg;
+
+    for (unsigned int n = 0; n < s->nnotes; n++)
+      diag(as, pl->line + s->notes[n].line + 1, s->notes[n].warning, "%s", s->notes[n].message);
+    failed |= s->failed;
+
+    pl->addr = size;
+    size += s->size;
+  }
+
+  if (size > 0xffff) {
+    diag(as, 1, false, "program is %u bytes, the most is 65535", size);
+    failed = true;
+  }
+  if (!size && !failed) {
+    diag(as, 1, false, "no code generated");
+    failed = true;
+  }
+
+  /* build the image and fill in the labels */
+  unsigned char *code = NULL;
+  unsigned int cap;
+  pplace_t **table = labels(as, as->places, as->nplaces, &cap, true);
+
+  if (!failed) {
+    code = malloc(size);
+    if (!code) svm_panic(NULL, "out of memory");
+  }
+
+  for (unsigned int i = 0; i < as->nplaces; i++) {
+    const pplace_t *pl = &as->places[i];
+    const psegment_t *s = pl->seg;
+
+    if (code && s->size) memcpy(code + pl->addr, s->code, s->size);
+
+    for (unsigned int f = 0; f < s->nfixups; f++) {
+      const pfixup_t *fx = &s->fixups[f];
+      const pplace_t *target = fx->label ? label_find(table, cap, fx->label, strlen(fx->label)) : NULL;
+      unsigned int at = pl->addr + fx->at, value = target ? target->addr : fx->addr;
+
+      if (fx->label && !target && as->module) {
+        reloc(as, at, fx->rel ? LINK_REL : LINK_ABS, fx->label);
+        continue;
+      }
+      if (fx->label && !target) {
+        diag(as, pl->line + fx->line + 1, false, "no label '%s'", fx->label);
+        failed = true;
+        continue;
+      }
+
+      /* a module's own addresses move with it, relative ones don't */
+      if (as->module && fx->label && !fx->rel) reloc(as, at, LINK_LOCAL, NULL);
+      if (as->module && !fx->label && fx->rel) {
+        reloc(as, at, LINK_REL, NULL);
+      } else if (fx->rel) {
+        value = OP_REL_OFFSET(at + 2, value);
+      }
+
+      if (code) {
+        code[at] = value & 0xff;
+        code[at + 1] = (value >> 8) & 0xff;
+      }
+    }
+  }
+  free(table);
+
+  /* in line order, keeping the order within a line */
+  for (unsigned int i = 1; i < as->ndiags; i++) {
+    pdiag_t d = as->diags[i];
+    unsigned int j = i;
+    for (; j > 0 && as->diags[j - 1].line > d.line; j--) as->diags[j] = as->diags[j - 1];
+    as->diags[j] = d;
+  }
+
+  /* back to the lines they came from, the preprocessor's own go first */
+  for (unsigned int i = 0; i < as->ndiags; i++) {
+    size_t line;
+    as->diags[i].file = preproc_where(as->pp, as->diags[i].line - 1, &line);
+    as->diags[i].line = line + 1;
+  }
+
+  if (npd) {
+    as->diags = grow(as->diags, &as->diags_cap, as->ndiags + npd, sizeof(*as->diags));
+    memmove(as->diags + npd, as->diags, as->ndiags * sizeof(*as->diags));
+    for (unsigned int i = 0; i < npd; i++) {
+      as->diags[i] = (pdiag_t) { pd[i].file, pd[i].line, pd[i].warning,
+                                 copy(pd[i].message, strlen(pd[i].message)) };
+    }
+    as->ndiags += npd;
+  }
+
+  if (failed) {
+    free(code);
+  } else {
+    /* the new image is good, note where the old one went */
+    unsigned char *old = as->code;
+    as->code = code;
+    as->size = size;
+
+    if (old) remap(as, old);
+    else { free(as->map); as->map = NULL; as->nmap = 0; as->have_map = false; }
+    free(old);
+
+    pplace_t *places = realloc(as->good, (as->nplaces ? as->nplaces : 1) * sizeof(*places));
+    if (!places) svm_panic(NULL, "out of memory");
+    memcpy(places, as->places, as->nplaces * sizeof(*places));
+    as->good = places;
+    as->ngood = as->nplaces;
+  }
+
+  /* keep what this build or the last good one uses */
+  for (unsigned int i = 0; i < as->ngood; i++) as->good[i].seg->mark = as->build;
+
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < as->ncache; i++) {
+    if (as->cache[i]->mark == as->build) as->cache[kept++] = as->cache[i];
+    else segment_free(as->cache[i]);
+  }
+  if (kept != as->ncache) {
+    as->ncache = kept;
+    index_build(as);
+  }
+
+  return failed ? -1 : 0;
+}
+
+
+const unsigned char *assembler_code(const passembler_t *as, unsigned int *size) {
+  if (size) *size = as->size;
+  return as->code;
+}
+
+
+unsigned int assembler_diags(const passembler_t *as, const pdiag_t **diags) {
+  *diags = as->diags;
+  return as->ndiags;
+}
+
+
+/**
+ * NULL after the first build, there is nothing to move from. Segments
+ * whose label went away aren't in the map, so svm_patch won't apply while
+ * a vm is inside one.
+ */
+const svm_remap_t *assembler_remap(const passembler_t *as, unsigned int *n) {
+  *n = as->nmap;
+  return as->have_map ? as->map : NULL;
+}
+
+
+/* the labels are the first definition of each, as in a build */
+int assembler_write_module(passembler_t *as, FILE *fp) {
+  unsigned int cap, nsyms = 0;
+  pplace_t **table = labels(as, as->good, as->ngood, &cap, false);
+  plink_sym_t *syms = calloc(as->ngood ? as->ngood : 1, sizeof(*syms));
+  if (!syms) svm_panic(NULL, "out of memory");
+
+  for (unsigned int i = 0; i < as->ngood; i++) {
+    const char *label = as->good[i].seg->label;
+    if (label && label_find(table, cap, label, strlen(label)) == &as->good[i])
+      syms[nsyms++] = (plink_sym_t) { label, as->good[i].addr };
+  }
+
+  int rc = link_write(fp, as->code, as->size, syms, nsyms, as->relocs, as->nrelocs);
+  free(syms);
+  free(table);
+  return rc;
+}
+
+
+unsigned int assembler_includes(const passembler_t *as) {
+  return as->pp ? preproc_includes(as->pp) : 0;
+}
+
+
+void assembler_stats(const passembler_t *as, unsigned int *reused, unsigned int *emitted) {
+  if (reused) *reused = as->reused;
+  if (emitted) *emitted = as->emitted;
+}
@@ -11,6 +11,49 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
+#include "../svm/svm.h"
+
+typedef struct passembler_t passembler_t;
+
+/* an error, or a warning, against a line of the source */
+typedef struct {
+  const char *file; /* NULL for the source itself, or an included file */
+  size_t line;      /* from 1 */
+  bool warning;
+  char *message;
+} pdiag_t;
+
+passembler_t *assembler_new(void);
+void assembler_free(passembler_t *as);
+
+/* where the source is, so includes are found next to it, NULL for the current directory */
+void assembler_path(passembler_t *as, const char *path);
+
+/* build modules for the linker, labels they don't define are left to it */
+void assembler_module(passembler_t *as, bool module);
+
+/* 0 on success, -1 with the diagnostics saying why */
+int assembler_assemble(passembler_t *as, const char *source, size_t len);
+
+/* the same for a source read as it goes, in bounded memory and without caching */
+int assembler_assemble_fd(passembler_t *as, int fd);
+
+/* the last image that assembled */
+const unsigned char *assembler_code(const passembler_t *as, unsigned int *size);
+unsigned int assembler_diags(const passembler_t *as, const pdiag_t **diags);
+
+/* where the image before the last one's code went, for svm_patch */
+const svm_remap_t *assembler_remap(const passembler_t *as, unsigned int *n);
+
+/* the last build as a module, after it assembled in module mode */
+int assembler_write_module(passembler_t *as, FILE *fp);
+
+/* files the last build included, an image built with any depends on more than its source */
+unsigned int assembler_includes(const passembler_t *as);
+
+/* segments the last build took from the cache, and emitted afresh */
+void assembler_stats(const passembler_t *as, unsigned int *reused, unsigned int *emitted);
 
 #endif
@@ -0,0 +1,1134 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "preproc.h"
+#include "../svm/svm.h"
+
+/**
+ * The preprocessor.
+ *
+ * Sits between a source and the lexer, a line at a time:
+ *
+ *   .include "lib/print.in"    the file's lines, once per program however
+ *                              often it is included
+ *   .define BASE 0x0200        BASE is replaced wherever it is a word
+ *   .define STEP BASE + 16     a constant expression is worked out here
+ *   .macro pair a, b           lines up to .endm are kept, `pair #1, #2`
+ *     push a                   expands them with the arguments put in
+ *     push b                   for the parameters; "@@" in the body
+ *   .endm                      becomes a suffix unique to each expansion,
+ *                              for labels
+ *
+ * An operand of an instruction that works out to a constant, like
+ * `store #1, BASE * 2 + 1`, is replaced by the number, so no instruction
+ * is spent on arithmetic the assembler can do. Operators are those of C,
+ * with C's precedence.
+ *
+ * Every expanded line remembers the file and line it came from, as runs
+ * of lines rather than one entry per line, so a stream of any length
+ * costs memory in proportion to its includes and expansions only.
+ */
+
+#define PP_DEPTH 32     /* includes, or macros, within each other */
+#define PP_CHUNK 65536  /* read from a file at a time */
+
+typedef struct {
+  char *p;
+  size_t len, cap;
+} pbuf_t;
+
+typedef struct {
+  char *name;
+  char *value;
+} pdefine_t;
+
+typedef struct {
+  char *name;
+  char **params;
+  unsigned int nparams;
+  pbuf_t body;
+  const char *file;
+  size_t line;
+} pmacro_t;
+
+typedef struct {
+  int fd;               /* -1 for a source in memory */
+  bool own, eof;
+  const char *mem, *mem_end;
+  char *buf;
+  size_t start, end, cap;
+  const char *file;     /* NULL for the main source */
+  char *dir;            /* includes are found here, NULL for the current directory */
+  size_t line;
+} pinput_t;
+
+/* a run of expanded lines from one place */
+typedef struct {
+  size_t out;
+  const char *file;
+  size_t line;
+  unsigned int step;    /* 0 for the lines of a macro, all from one line */
+} pspan_t;
+
+struct ppreproc_t {
+  pinput_t inputs[PP_DEPTH];
+  unsigned int ninputs;
+
+  char **names;         /* of included files, as reported */
+  unsigned int nnames, names_cap;
+  char **seen;          /* real paths of files already included */
+  unsigned int nseen, seen_cap;
+
+  pdefine_t *defines;
+  unsigned int ndefines, defines_cap;
+  unsigned int *index;  /* defines by name, 1 + their position */
+  unsigned int index_cap;
+
+  pmacro_t *macros;
+  unsigned int nmacros, macros_cap;
+  pmacro_t *defining;
+  unsigned int expansions;
+
+  pbuf_t out;
+  size_t out_pos, out_line;
+
+  pspan_t *spans;
+  unsigned int nspans, spans_cap;
+
+  ppdiag_t *diags;
+  unsigned int ndiags, diags_cap;
+
+  char *dir;
+  bool failed, done;
+};
+
+
+static void *grow(void *ptr, unsigned int *cap, unsigned int need, size_t size) {
+  if (need <= *cap) return ptr;
+
+  unsigned int n = *cap ? *cap : 16;
+  while (n < need) n *= 2;
+
+  void *p = realloc(ptr, n * size);
+  if (!p) svm_panic(NULL, "out of memory");
+  *cap = n;
+  return p;
+}
+
+
+static char *copy(const char *s, size_t len) {
+  char *p = malloc(len + 1);
+  if (!p) svm_panic(NULL, "out of memory");
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+
+static void put(pbuf_t *b, const char *s, size_t len) {
+  if (b->len + len + 1 > b->cap) {
+    size_t cap = b->cap ? b->cap : 256;
+    while (b->len + len + 1 > cap) cap *= 2;
+    b->p = realloc(b->p, cap);
+    if (!b->p) svm_panic(NULL, "out of memory");
+    b->cap = cap;
+  }
+  memcpy(b->p + b->len, s, len);
+  b->len += len;
+  b->p[b->len] = '\0';
+}
+
+
+static bool is_alpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+
+static bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+static const char *skip_blank(const char *p, const char *end) {
+  while (p < end && is_blank(*p)) p++;
+  return p;
+}
+
+
+static const char *trim_end(const char *p, const char *end) {
+  while (end > p && is_blank(end[-1])) end--;
+  return end;
+}
+
+
+static const char *word_end(const char *p, const char *end) {
+  while (p < end && (is_alpha(*p) || is_digit(*p))) p++;
+  return p;
+}
+
+
+/* where a line's comment starts, a '#' before a digit is a register */
+static const char *comment(const char *p, const char *end) {
+  for (; p < end; p++) {
+    if (*p == '"') {
+      for (p++; p < end && *p != '"'; p++) ;
+      if (p == end) break;
+    } else if (*p == '#' && !(p + 1 < end && is_digit(p[1]))) {
+      return p;
+    }
+  }
+  return end;
+}
+
+
+static unsigned long long hash(const char *s, size_t len) {
+  unsigned long long h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+
+static void diag(ppreproc_t *pp, const char *file, size_t line, bool warning, const char *fmt, ...) {
+  char buf[256];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  pp->diags = grow(pp->diags, &pp->diags_cap, pp->ndiags + 1, sizeof(*pp->diags));
+  pp->diags[pp->ndiags++] = (ppdiag_t) { file, line + 1, warning, copy(buf, strlen(buf)) };
+}
+
+
+/*
+ * Constant expressions
+ */
+
+typedef struct {
+  const char *p, *end;
+  bool names;           /* a word that isn't a number, a label perhaps */
+  bool bad;             /* not an expression at all */
+  const char *error;    /* an expression that can't be worked out */
+} pexpr_t;
+
+static long long expr_or(pexpr_t *e);
+
+
+static bool accept(pexpr_t *e, const char *op) {
+  size_t n = strlen(op);
+  e->p = skip_blank(e->p, e->end);
+  if ((size_t) (e->end - e->p) < n || memcmp(e->p, op, n)) return false;
+
+  /* '<' and '<<' are different operators, the same for the rest */
+  if (n == 1 && e->p + 1 < e->end && e->p[1] == op[0] && (op[0] == '<' || op[0] == '>'))
+    return false;
+
+  e->p += n;
+  return true;
+}
+
+
+static long long primary(pexpr_t *e) {
+  e->p = skip_blank(e->p, e->end);
+  if (e->p == e->end) { e->bad = true; return 0; }
+
+  if (accept(e, "(")) {
+    long long v = expr_or(e);
+    if (!accept(e, ")")) e->bad = true;
+    return v;
+  }
+
+  if (accept(e, "-")) return -primary(e);
+  if (accept(e, "+")) return primary(e);
+  if (accept(e, "~")) return ~primary(e);
+
+  const char *start = e->p;
+
+  if (is_digit(*e->p)) {
+    const char *w = word_end(e->p, e->end);
+    char *stop, *text = copy(start, w - start);
+    long long v = strtoll(text, &stop, (w - start > 2 && start[0] == '0' &&
+                                        (start[1] == 'x' || start[1] == 'X')) ? 16 : 10);
+    if (*stop) e->bad = true;
+    free(text);
+    e->p = w;
+    return v;
+  }
+
+  if (is_alpha(*e->p)) {
+    e->p = word_end(e->p, e->end);
+    e->names = true;
+    return 0;
+  }
+
+  e->bad = true;
+  return 0;
+}
+
+
+static long long expr_mul(pexpr_t *e) {
+  long long v = primary(e);
+  for (;;) {
+    if (accept(e, "*")) v *= primary(e);
+    else if (accept(e, "/") || accept(e, "%")) {
+      bool div = (e->p[-1] == '/');
+      long long r = primary(e);
+      if (!r) {
+        if (!e->names) e->error = "division by zero";
+        r = 1;
+      }
+      v = div ? v / r : v % r;
+    }
+    else return v;
+  }
+}
+
+
+static long long expr_add(pexpr_t *e) {
+  long long v = expr_mul(e);
+  for (;;) {
+    if (accept(e, "+")) v += expr_mul(e);
+    else if (accept(e, "-")) v -= expr_mul(e);
+    else return v;
+  }
+}
+
+
+static long long expr_shift(pexpr_t *e) {
+  long long v = expr_add(e);
+  for (;;) {
+    if (accept(e, "<<")) v = (long long) ((unsigned long long) v << (expr_add(e) & 63));
+    else if (accept(e, ">>")) v >>= (expr_add(e) & 63);
+    else return v;
+  }
+}
+
+
+static long long expr_and(pexpr_t *e) {
+  long long v = expr_shift(e);
+  while (accept(e, "&")) v &= expr_shift(e);
+  return v;
+}
+
+
+static long long expr_xor(pexpr_t *e) {
+  long long v = expr_and(e);
+  while (accept(e, "^")) v ^= expr_and(e);
+  return v;
+}
+
+
+static long long expr_or(pexpr_t *e) {
+  long long v = expr_xor(e);
+  while (accept(e, "|")) v |= expr_xor(e);
+  return v;
+}
+
+
+/**
+ * Work out `s` if it is a constant expression: 1 and the value if it is,
+ * 0 if it isn't one (it names something, or isn't an expression), and -1
+ * with `error` set if it is one that can't be worked out.
+ */
+static int eval(const char *s, const char *end, long long *value, const char **error) {
+  pexpr_t e = { s, end, false, false, NULL };
+  long long v = expr_or(&e);
+
+  if (skip_blank(e.p, e.end) != e.end) e.bad = true;
+  if (e.bad || e.names) return 0;
+  if (e.error) {
+    *error = e.error;
+    return -1;
+  }
+
+  *value = v;
+  return 1;
+}
+
+
+static bool has_operator(const char *p, const char *end) {
+  for (; p < end; p++) {
+    switch (*p) {
+      case '+': case '-': case '*': case '/': case '%': case '(': case ')':
+      case '<': case '>': case '&': case '|': case '^': case '~':
+        return true;
+    }
+  }
+  return false;
+}
+
+
+/*
+ * Defines and macros
+ */
+
+static pdefine_t *define_find(const ppreproc_t *pp, const char *name, size_t len) {
+  if (!pp->ndefines) return NULL;
+
+  for (unsigned int slot = hash(name, len) & (pp->index_cap - 1); pp->index[slot];
+       slot = (slot + 1) & (pp->index_cap - 1)) {
+    pdefine_t *d = &pp->defines[pp->index[slot] - 1];
+    if (!strncmp(d->name, name, len) && !d->name[len]) return d;
+  }
+
+  return NULL;
+}
+
+
+static void index_build(ppreproc_t *pp) {
+  unsigned int cap = 16;
+  while (cap < pp->ndefines * 2 + 2) cap *= 2;
+
+  free(pp->index);
+  pp->index = calloc(cap, sizeof(*pp->index));
+  if (!pp->index) svm_panic(NULL, "out of memory");
+  pp->index_cap = cap;
+
+  for (unsigned int i = 0; i < pp->ndefines; i++) {
+    unsigned int slot = hash(pp->defines[i].name, strlen(pp->defines[i].name)) & (cap - 1);
+    while (pp->index[slot]) slot = (slot + 1) & (cap - 1);
+    pp->index[slot] = i + 1;
+  }
+}
+
+
+static pmacro_t *macro_find(const ppreproc_t *pp, const char *name, size_t len) {
+  for (unsigned int i = 0; i < pp->nmacros; i++)
+    if (!strncmp(pp->macros[i].name, name, len) && !pp->macros[i].name[len]) return &pp->macros[i];
+  return NULL;
+}
+
+
+typedef const char *(*plookup_t)(void *ctx, const char *name, size_t len);
+
+
+static const char *lookup_define(void *ctx, const char *name, size_t len) {
+  pdefine_t *d = define_find(ctx, name, len);
+  return d ? d->value : NULL;
+}
+
+
+typedef struct {
+  const pmacro_t *macro;
+  char **args;
+} pcall_t;
+
+
+static const char *lookup_param(void *ctx, const char *name, size_t len) {
+  const pcall_t *call = ctx;
+  for (unsigned int i = 0; i < call->macro->nparams; i++)
+    if (!strncmp(call->macro->params[i], name, len) && !call->macro->params[i][len])
+      return call->args[i];
+  return NULL;
+}
+
+
+/**
+ * Copy a line, replacing the words `lookup` knows. Strings, comments and
+ * the name of a label being defined are left alone, and with `id` set
+ * "@@" becomes "_<id>".
+ */
+static void replace(pbuf_t *out, const char *p, const char *end,
+                    plookup_t lookup, void *ctx, unsigned int id) {
+  const char *first = skip_blank(p, end);
+
+  while (p < end) {
+    const char *start = p;
+
+    if (*p == '"') {
+      for (p++; p < end && *p != '"'; p++) ;
+      if (p < end) p++;
+      put(out, start, p - start);
+    } else if (*p == '#' && !(p + 1 < end && is_digit(p[1]))) {
+      put(out, p, end - p);
+      return;
+    } else if (id && *p == '@' && p + 1 < end && p[1] == '@') {
+      char num[16];
+      put(out, num, snprintf(num, sizeof(num), "_%u", id));
+      p += 2;
+    } else if (is_digit(*p)) {
+      p = word_end(p, end);
+      put(out, start, p - start);
+    } else if (is_alpha(*p)) {
+      p = word_end(p, end);
+      const char *with = (start == first + 1 && *first == ':') ? NULL : lookup(ctx, start, p - start);
+      if (with) put(out, with, strlen(with));
+      else put(out, start, p - start);
+    } else {
+      put(out, p++, 1);
+    }
+  }
+}
+
+
+/* the end of the operand starting at `p`: a comma outside strings and brackets */
+static const char *operand_end(const char *p, const char *end) {
+  int depth = 0;
+
+  for (; p < end; p++) {
+    if (*p == '"') {
+      for (p++; p < end && *p != '"'; p++) ;
+      if (p == end) break;
+    }
+    else if (*p == '(') depth++;
+    else if (*p == ')') depth--;
+    else if (*p == ',' && depth <= 0) break;
+  }
+
+  return p;
+}
+
+
+/* an instruction with its constant operands worked out */
+static void fold(ppreproc_t *pp, pbuf_t *out, const char *p, const char *end,
+                 const char *file, size_t line) {
+  const char *stop = comment(p, end);
+  const char *at = skip_blank(p, stop);
+
+  /* labels, and lines with nothing to work out */
+  if (at == stop || *at == ':' || !has_operator(at, stop)) {
+    put(out, p, end - p);
+    return;
+  }
+
+  at = word_end(at, stop);
+  put(out, p, at - p);
+
+  while (at < stop) {
+    const char *e = operand_end(at, stop);
+    const char *s = skip_blank(at, e), *t = trim_end(s, e);
+    const char *error = NULL;
+    long long v;
+    int r = 0;
+
+    if (s < t && has_operator(s, t) && !memchr(s, '"', t - s)) {
+      r = eval(s, t, &v, &error);
+      if (r > 0 && (v < -32768 || v > 0xffff)) {
+        diag(pp, file, line, false, "%.*s is %lld, it doesn't fit in 16 bits", (int) (t - s), s, v);
+        v = 0;
+      }
+      /* reported here, the assembler is given something it will take */
+      if (r < 0) {
+        diag(pp, file, line, false, "%s", error);
+        v = 0;
+        r = 1;
+      }
+    }
+
+    if (r > 0) {
+      char num[24];
+      put(out, at, s - at);
+      put(out, num, snprintf(num, sizeof(num), "%lld", v & 0xffff));
+      put(out, t, e - t);
+    } else {
+      put(out, at, e - at);
+    }
+
+    at = e;
+    if (at < stop) put(out, at++, 1);
+  }
+
+  put(out, stop, end - stop);
+}
+
+
+/*
+ * Output
+ */
+
+/* the last `n` lines put in the output came from `file`, from `line` on */
+static void span(ppreproc_t *pp, const char *file, size_t line, size_t n) {
+  /* carry on the last run if it leads here */
+  if (pp->nspans) {
+    pspan_t *s = &pp->spans[pp->nspans - 1];
+    size_t k = pp->out_line - s->out;
+
+    if (s->file == file && s->line + k * s->step == line && (n == 1 || s->step == 1)) goto done;
+    if (s->file == file && k == 1 && s->line == line && n == 1) {
+      s->step = 0;
+      goto done;
+    }
+  }
+
+  pp->spans = grow(pp->spans, &pp->spans_cap, pp->nspans + 1, sizeof(*pp->spans));
+  pp->spans[pp->nspans++] = (pspan_t) { pp->out_line, file, line, 1 };
+
+done:
+  pp->out_line += n;
+}
+
+
+/* end the line being put in the output, it came from `line` of `file` */
+static void mark(ppreproc_t *pp, const char *file, size_t line) {
+  put(&pp->out, "\n", 1);
+  span(pp, file, line, 1);
+}
+
+
+const char *preproc_where(const ppreproc_t *pp, size_t line, size_t *src_line) {
+  unsigned int lo = 0, hi = pp->nspans;
+
+  if (!hi) {
+    *src_line = line;
+    return NULL;
+  }
+
+  /* the last run starting at or before `line` */
+  while (hi - lo > 1) {
+    unsigned int mid = (lo + hi) / 2;
+    if (pp->spans[mid].out <= line) lo = mid;
+    else hi = mid;
+  }
+
+  const pspan_t *s = &pp->spans[lo];
+  *src_line = s->line + (line - s->out) * s->step;
+  return s->file;
+}
+
+
+/*
+ * Directives
+ */
+
+static void include(ppreproc_t *pp, const char *p, const char *end, const char *file, size_t line) {
+  const pinput_t *from = &pp->inputs[pp->ninputs - 1];
+
+  if (end - p < 2 || *p != '"' || end[-1] != '"') {
+    diag(pp, file, line, false, ".include needs a file name in quotes");
+    return;
+  }
+  if (pp->ninputs == PP_DEPTH) {
+    diag(pp, file, line, false, "includes nested too deeply");
+    return;
+  }
+
+  /* relative to the file doing the including */
+  pbuf_t path = { 0 };
+  if (p[1] != '/' && from->dir) {
+    put(&path, from->dir, strlen(from->dir));
+    put(&path, "/", 1);
+  }
+  put(&path, p + 1, end - p - 2);
+
+  char real[PATH_MAX];
+  if (!realpath(path.p, real)) {
+    diag(pp, file, line, false, "can't open '%s'", path.p);
+    free(path.p);
+    return;
+  }
+
+  for (unsigned int i = 0; i < pp->nseen; i++) {
+    if (!strcmp(pp->seen[i], real)) {
+      free(path.p);
+      return;
+    }
+  }
+
+  int fd = open(real, O_RDONLY);
+  if (fd < 0) {
+    diag(pp, file, line, false, "can't open '%s'", path.p);
+    free(path.p);
+    return;
+  }
+
+  pp->seen = grow(pp->seen, &pp->seen_cap, pp->nseen + 1, sizeof(*pp->seen));
+  pp->seen[pp->nseen++] = copy(real, strlen(real));
+  pp->names = grow(pp->names, &pp->names_cap, pp->nnames + 1, sizeof(*pp->names));
+  pp->names[pp->nnames++] = path.p;
+
+  pinput_t *in = &pp->inputs[pp->ninputs++];
+  memset(in, '\0', sizeof(*in));
+  in->fd = fd;
+  in->own = true;
+  in->file = path.p;
+
+  const char *slash = strrchr(path.p, '/');
+  if (slash) in->dir = copy(path.p, slash - path.p);
+}
+
+
+static void define(ppreproc_t *pp, const char *p, const char *end, const char *file, size_t line) {
+  const char *name = p, *name_end = word_end(p, end);
+
+  if (name == end || !is_alpha(*name)) {
+    diag(pp, file, line, false, ".define needs a name");
+    return;
+  }
+
+  /* worked out now, with the names defined so far */
+  pbuf_t value = { 0 };
+  const char *v = skip_blank(name_end, end), *error = NULL;
+  long long n;
+
+  replace(&value, v, end, lookup_define, pp, 0);
+  put(&value, "", 0);
+
+  int r = eval(value.p, value.p + value.len, &n, &error);
+  if (r < 0) diag(pp, file, line, false, "%s", error);
+  if (r > 0) {
+    char num[24];
+    value.len = 0;
+    put(&value, num, snprintf(num, sizeof(num), "%lld", n));
+  }
+
+  pdefine_t *d = define_find(pp, name, name_end - name);
+  if (d) {
+    diag(pp, file, line, true, "'%.*s' defined again", (int) (name_end - name), name);
+    free(d->value);
+    d->value = value.p;
+    return;
+  }
+
+  pp->defines = grow(pp->defines, &pp->defines_cap, pp->ndefines + 1, sizeof(*pp->defines));
+  pp->defines[pp->ndefines++] = (pdefine_t) { copy(name, name_end - name), value.p };
+
+  if (pp->ndefines * 2 > pp->index_cap) index_build(pp);
+  else {
+    unsigned int slot = hash(name, name_end - name) & (pp->index_cap - 1);
+    while (pp->index[slot]) slot = (slot + 1) & (pp->index_cap - 1);
+    pp->index[slot] = pp->ndefines;
+  }
+}
+
+
+static void macro(ppreproc_t *pp, const char *p, const char *end, const char *file, size_t line) {
+  const char *name = p, *name_end = word_end(p, end);
+
+  if (name == end || !is_alpha(*name)) {
+    diag(pp, file, line, false, ".macro needs a name");
+    return;
+  }
+
+  pmacro_t *m = macro_find(pp, name, name_end - name);
+  if (m) {
+    diag(pp, file, line, true, "macro '%.*s' defined again", (int) (name_end - name), name);
+    for (unsigned int i = 0; i < m->nparams; i++) free(m->params[i]);
+    free(m->params);
+    free(m->body.p);
+  } else {
+    pp->macros = grow(pp->macros, &pp->macros_cap, pp->nmacros + 1, sizeof(*pp->macros));
+    m = &pp->macros[pp->nmacros++];
+    m->name = copy(name, name_end - name);
+  }
+
+  m->params = NULL;
+  m->nparams = 0;
+  memset(&m->body, '\0', sizeof(m->body));
+  m->file = file;
+  m->line = line;
+
+  for (p = skip_blank(name_end, end); p < end; ) {
+    const char *w = word_end(p, end);
+    if (w == p || !is_alpha(*p)) {
+      diag(pp, file, line, false, "bad parameter list for macro '%s'", m->name);
+      break;
+    }
+
+    m->params = realloc(m->params, (m->nparams + 1) * sizeof(*m->params));
+    if (!m->params) svm_panic(NULL, "out of memory");
+    m->params[m->nparams++] = copy(p, w - p);
+
+    p = skip_blank(w, end);
+    if (p < end && *p == ',') p = skip_blank(p + 1, end);
+  }
+
+  pp->defining = m;
+}
+
+
+static bool is_directive(const char *p, const char *end, const char *name) {
+  size_t n = strlen(name);
+  return (size_t) (end - p) >= n && !memcmp(p, name, n) && (p + n == end || is_blank(p[n]));
+}
+
+
+static void directive(ppreproc_t *pp, const char *p, const char *end, const char *file, size_t line) {
+  const char *word = p + 1, *word_stop = word_end(word, end);
+  const char *rest = skip_blank(word_stop, end);
+  const char *rest_end = trim_end(rest, comment(rest, end));
+  size_t n = word_stop - word;
+
+  if (n == 7 && !memcmp(word, "include", n)) include(pp, rest, rest_end, file, line);
+  else if (n == 6 && !memcmp(word, "define", n)) define(pp, rest, rest_end, file, line);
+  else if (n == 5 && !memcmp(word, "macro", n)) macro(pp, rest, rest_end, file, line);
+  else if (n == 4 && !memcmp(word, "endm", n)) diag(pp, file, line, false, ".endm without .macro");
+  else diag(pp, file, line, false, "unknown directive '.%.*s'", (int) n, word);
+}
+
+
+/*
+ * Lines
+ */
+
+static void process(ppreproc_t *pp, const char *text, size_t len,
+                    const char *file, size_t line, unsigned int depth);
+
+
+static void expand(ppreproc_t *pp, const pmacro_t *m, const char *p, const char *end,
+                   const char *file, size_t line, unsigned int depth) {
+  char **args = NULL;
+  unsigned int nargs = 0;
+
+  if (depth == PP_DEPTH) {
+    diag(pp, file, line, false, "macros nested too deeply");
+    mark(pp, file, line);
+    return;
+  }
+
+  end = trim_end(p, comment(p, end));
+  for (p = skip_blank(p, end); p < end; ) {
+    const char *e = operand_end(p, end);
+    args = realloc(args, (nargs + 1) * sizeof(*args));
+    if (!args) svm_panic(NULL, "out of memory");
+    args[nargs++] = copy(p, trim_end(p, e) - p);
+    p = (e < end) ? skip_blank(e + 1, end) : end;
+  }
+
+  if (nargs != m->nparams) {
+    diag(pp, file, line, false, "macro '%s' takes %u arguments, not %u", m->name, m->nparams, nargs);
+    mark(pp, file, line);
+  } else {
+    pcall_t call = { m, args };
+    unsigned int id = ++pp->expansions;
+    const char *body = m->body.p, *body_end = body + m->body.len;
+
+    /* each line is expanded as if it had been written here */
+    while (body < body_end) {
+      const char *nl = memchr(body, '\n', body_end - body);
+      pbuf_t b = { 0 };
+
+      replace(&b, body, nl, lookup_param, &call, id);
+      process(pp, b.p ? b.p : "", b.len, file, line, depth + 1);
+      free(b.p);
+      body = nl + 1;
+    }
+  }
+
+  for (unsigned int i = 0; i < nargs; i++) free(args[i]);
+  free(args);
+}
+
+
+static void process(ppreproc_t *pp, const char *text, size_t len,
+                    const char *file, size_t line, unsigned int depth) {
+  const char *end = text + len, *p = skip_blank(text, end);
+
+  if (pp->defining) {
+    if (is_directive(p, end, ".endm")) pp->defining = NULL;
+    else if (is_directive(p, end, ".macro")) diag(pp, file, line, false, "a macro can't be defined in another");
+    else {
+      put(&pp->defining->body, text, len);
+      put(&pp->defining->body, "\n", 1);
+    }
+    mark(pp, file, line);
+    return;
+  }
+
+  if (p < end && *p == '.') {
+    if (depth) diag(pp, file, line, false, "directives can't be used in a macro");
+    else directive(pp, p, end, file, line);
+    mark(pp, file, line);
+    return;
+  }
+
+  /* a macro's name where an instruction would be */
+  const char *w = word_end(p, end);
+  const pmacro_t *m = (w > p && pp->nmacros) ? macro_find(pp, p, w - p) : NULL;
+  if (m) {
+    expand(pp, m, w, end, file, line, depth);
+    return;
+  }
+
+  if (!pp->ndefines) {
+    fold(pp, &pp->out, text, end, file, line);
+    mark(pp, file, line);
+    return;
+  }
+
+  pbuf_t defined = { 0 };
+  replace(&defined, text, end, lookup_define, pp, 0);
+  put(&defined, "", 0);
+  fold(pp, &pp->out, defined.p, defined.p + defined.len, file, line);
+  mark(pp, file, line);
+  free(defined.p);
+}
+
+
+/*
+ * Input
+ */
+
+static bool input_line(ppreproc_t *pp, pinput_t *in, const char **text, size_t *len, bool *last) {
+  if (in->fd < 0) {
+    if (in->mem >= in->mem_end) return false;
+
+    const char *nl = memchr(in->mem, '\n', in->mem_end - in->mem);
+    *last = !nl;
+    *text = in->mem;
+    *len = (nl ? nl : in->mem_end) - in->mem;
+    in->mem = nl ? nl + 1 : in->mem_end;
+    return true;
+  }
+
+  if (!in->buf) {
+    in->buf = malloc(PP_CHUNK);
+    if (!in->buf) svm_panic(NULL, "out of memory");
+    in->cap = PP_CHUNK;
+  }
+
+  for (;;) {
+    char *nl = memchr(in->buf + in->start, '\n', in->end - in->start);
+    if (nl || (in->eof && in->start < in->end)) {
+      *last = !nl;
+      *text = in->buf + in->start;
+      *len = (nl ? nl : in->buf + in->end) - *text;
+      in->start = nl ? (size_t) (nl + 1 - in->buf) : in->end;
+      return true;
+    }
+    if (in->eof) return false;
+
+    /* keep the start of the line, read the rest */
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+
+    if (in->cap - in->end < PP_CHUNK / 2) {
+      in->cap *= 2;
+      in->buf = realloc(in->buf, in->cap);
+      if (!in->buf) svm_panic(NULL, "out of memory");
+    }
+
+    ssize_t n;
+    do n = read(in->fd, in->buf + in->end, in->cap - in->end);
+    while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+      in->eof = true;
+      if (n < 0 && in->own) diag(pp, in->file, in->line, false, "failed to read '%s'", in->file);
+      else if (n < 0) pp->failed = true;
+    } else {
+      in->end += n;
+    }
+  }
+}
+
+
+static void input_close(pinput_t *in) {
+  if (in->own) close(in->fd);
+  free(in->buf);
+  free(in->dir);
+}
+
+
+/**
+ * The whole lines from `p` that come through as they are, with no
+ * directive and nothing to work out, while nothing is defined.
+ */
+static const char *plain(const char *p, const char *end, size_t *lines) {
+  const char *done = p;
+  size_t n = 0;
+
+  while (p < end) {
+    p = skip_blank(p, end);
+    if (p < end && *p == '.') break;
+
+    for (; p < end && *p != '\n'; p++) {
+      if (*p == '"') {
+        for (p++; p < end && *p != '"' && *p != '\n'; p++) ;
+        if (p == end || *p == '\n') goto out;
+      } else if (*p == '#' && !(p + 1 < end && is_digit(p[1]))) {
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl : end;
+        break;
+      } else if (has_operator(p, p + 1)) {
+        goto out;
+      }
+    }
+
+    /* not a whole line yet */
+    if (p == end) break;
+    done = ++p;
+    n++;
+  }
+
+out:
+  *lines = n;
+  return done;
+}
+
+
+/* the next lines of input through, false at the end */
+static bool step(ppreproc_t *pp) {
+  while (pp->ninputs) {
+    pinput_t *in = &pp->inputs[pp->ninputs - 1];
+    const char *text;
+    size_t len, n = 0;
+    bool last;
+
+    /* most lines need nothing done, those go through a run at a time */
+    if (!pp->ndefines && !pp->nmacros) {
+      const char *from = (in->fd < 0) ? in->mem : in->buf + in->start;
+      const char *to = (in->fd < 0) ? in->mem_end : in->buf + in->end;
+      const char *stop = in->buf || in->fd < 0 ? plain(from, to, &n) : NULL;
+
+      if (n) {
+        put(&pp->out, from, stop - from);
+        span(pp, in->file, in->line, n);
+        in->line += n;
+        if (in->fd < 0) in->mem = stop;
+        else in->start = stop - in->buf;
+        return true;
+      }
+    }
+
+    if (input_line(pp, in, &text, &len, &last)) {
+      process(pp, text, len, in->file, in->line++, 0);
+
+      /* a source that doesn't end its last line comes out the same */
+      if (last && pp->ninputs == 1 && pp->out.len && pp->out.p[pp->out.len - 1] == '\n')
+        pp->out.len--;
+      return true;
+    }
+
+    input_close(in);
+    pp->ninputs--;
+  }
+
+  if (pp->defining) {
+    diag(pp, pp->defining->file, pp->defining->line, false, "macro '%s' has no .endm", pp->defining->name);
+    pp->defining = NULL;
+  }
+
+  return false;
+}
+
+
+long preproc_read(ppreproc_t *pp, char *buf, size_t n) {
+  /* what the last read left goes to the front */
+  if (pp->out_pos) {
+    memmove(pp->out.p, pp->out.p + pp->out_pos, pp->out.len - pp->out_pos);
+    pp->out.len -= pp->out_pos;
+    pp->out_pos = 0;
+  }
+
+  /* as many lines as fit, rather than a read per line */
+  while (!pp->done && pp->out.len - pp->out_pos < n) {
+    if (!step(pp)) pp->done = true;
+  }
+
+  if (pp->out_pos == pp->out.len) return pp->failed ? -1 : 0;
+
+  if (n > pp->out.len - pp->out_pos) n = pp->out.len - pp->out_pos;
+  memcpy(buf, pp->out.p + pp->out_pos, n);
+  pp->out_pos += n;
+  return n;
+}
+
+
+ppreproc_t *preproc_new(const char *path) {
+  ppreproc_t *pp = calloc(1, sizeof(*pp));
+  if (!pp) svm_panic(NULL, "out of memory");
+
+  if (path) {
+    char real[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash) pp->dir = copy(path, slash - path);
+
+    /* a file including itself gets nothing */
+    if (realpath(path, real)) {
+      pp->seen = grow(pp->seen, &pp->seen_cap, 1, sizeof(*pp->seen));
+      pp->seen[pp->nseen++] = copy(real, strlen(real));
+    }
+  }
+
+  return pp;
+}
+
+
+static pinput_t *input_main(ppreproc_t *pp) {
+  pinput_t *in = &pp->inputs[0];
+  memset(in, '\0', sizeof(*in));
+  in->dir = pp->dir ? copy(pp->dir, strlen(pp->dir)) : NULL;
+  pp->ninputs = 1;
+  return in;
+}
+
+
+void preproc_source(ppreproc_t *pp, const char *source, size_t len) {
+  pinput_t *in = input_main(pp);
+  in->fd = -1;
+  in->mem = source;
+  in->mem_end = source + len;
+}
+
+
+void preproc_fd(ppreproc_t *pp, int fd) {
+  pinput_t *in = input_main(pp);
+  in->fd = fd;
+}
+
+
+unsigned int preproc_includes(const ppreproc_t *pp) {
+  return pp->nnames;
+}
+
+
+unsigned int preproc_diags(const ppreproc_t *pp, const ppdiag_t **diags) {
+  *diags = pp->diags;
+  return pp->ndiags;
+}
+
+
+void preproc_free(ppreproc_t *pp) {
+  if (!pp) return;
+
+  while (pp->ninputs) input_close(&pp->inputs[--pp->ninputs]);
+
+  for (unsigned int i = 0; i < pp->nnames; i++) free(pp->names[i]);
+  for (unsigned int i = 0; i < pp->nseen; i++) free(pp->seen[i]);
+  for (unsigned int i = 0; i < pp->ndefines; i++) {
+    free(pp->defines[i].name);
+    free(pp->defines[i].value);
+  }
+  for (unsigned int i = 0; i < pp->nmacros; i++) {
+    pmacro_t *m = &pp->macros[i];
+    for (unsigned int j = 0; j < m->nparams; j++) free(m->params[j]);
+    free(m->params);
+    free(m->body.p);
+    free(m->name);
+  }
+  for (unsigned int i = 0; i < pp->ndiags; i++) free(pp->diags[i].message);
+
+  free(pp->names);
+  free(pp->seen);
+  free(pp->defines);
+  free(pp->index);
+  free(pp->macros);
+  free(pp->out.p);
+  free(pp->spans);
+  free(pp->diags);
+  free(pp->dir);
+  free(pp);
+}
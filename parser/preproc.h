@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef PREPROC_H
+#define PREPROC_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct ppreproc_t ppreproc_t;
+
+/* an error in a directive, against the file and line it was on */
+typedef struct {
+  const char *file;   /* NULL for the main source */
+  size_t line;        /* from 1 */
+  bool warning;
+  char *message;
+} ppdiag_t;
+
+/* `path` names the main source, includes are found next to it */
+ppreproc_t *preproc_new(const char *path);
+void preproc_free(ppreproc_t *pp);
+
+/* where the main source comes from, one of these before reading */
+void preproc_source(ppreproc_t *pp, const char *source, size_t len);
+void preproc_fd(ppreproc_t *pp, int fd);
+
+/* up to `n` bytes of expanded text, 0 at the end and -1 if reading failed */
+long preproc_read(ppreproc_t *pp, char *buf, size_t n);
+
+/* the file (NULL for the main source) and line, from 0, expanded line `line` came from */
+const char *preproc_where(const ppreproc_t *pp, size_t line, size_t *src_line);
+
+/* files included, each counted once */
+unsigned int preproc_includes(const ppreproc_t *pp);
+
+unsigned int preproc_diags(const ppreproc_t *pp, const ppdiag_t **diags);
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+#include "scan.h"
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+/**
+ * Scanning for the lexer.
+ *
+ * Whitespace, comments and strings are most of a generated source, and
+ * the lexer steps over them a block at a time: compare a block against
+ * each byte wanted, turn the result into a bitmask, and take the lowest
+ * set bit. The newlines passed over come from the same masks with a
+ * popcount, so counting lines costs nothing extra.
+ *
+ * Blocks are 32 bytes with AVX2 and 16 with SSE2, whichever the build
+ * targets; the tail and other targets go a byte at a time. `lines` is
+ * the number of newlines before the byte returned.
+ */
+
+#if defined(__AVX2__)
+
+#define BLOCK 32
+typedef __m256i block_t;
+typedef unsigned int mask_t;
+
+static inline block_t load(const char *p) { return _mm256_loadu_si256((const block_t *) p); }
+static inline block_t splat(char c) { return _mm256_set1_epi8(c); }
+static inline mask_t eq(block_t a, block_t b) { return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)); }
+
+#elif defined(__SSE2__)
+
+#define BLOCK 16
+typedef __m128i block_t;
+typedef unsigned int mask_t;
+
+static inline block_t load(const char *p) { return _mm_loadu_si128((const block_t *) p); }
+static inline block_t splat(char c) { return _mm_set1_epi8(c); }
+static inline mask_t eq(block_t a, block_t b) { return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)); }
+
+#endif
+
+#define ALL ((mask_t) ((1ull << BLOCK) - 1))
+
+
+const char *scan_space(const char *p, const char *end, size_t *lines) {
+  size_t n = 0;
+
+#ifdef BLOCK
+  const block_t nl = splat('\n'), sp = splat(' '), tab = splat('\t'), cr = splat('\r');
+
+  while (end - p >= BLOCK) {
+    block_t b = load(p);
+    mask_t newline = eq(b, nl);
+    mask_t space = newline | eq(b, sp) | eq(b, tab) | eq(b, cr);
+
+    if (space != ALL) {
+      unsigned int i = __builtin_ctz(~space);
+      *lines = n + __builtin_popcount(newline & ((1u << i) - 1));
+      return p + i;
+    }
+
+    n += __builtin_popcount(newline);
+    p += BLOCK;
+  }
+#endif
+
+  for (; p < end; p++) {
+    if (*p == '\n') n++;
+    else if (*p != ' ' && *p != '\t' && *p != '\r') break;
+  }
+
+  *lines = n;
+  return p;
+}
+
+
+const char *scan_quote(const char *p, const char *end, size_t *lines) {
+  size_t n = 0;
+
+#ifdef BLOCK
+  const block_t nl = splat('\n'), quote = splat('"');
+
+  while (end - p >= BLOCK) {
+    block_t b = load(p);
+    mask_t newline = eq(b, nl), found = eq(b, quote);
+
+    if (found) {
+      unsigned int i = __builtin_ctz(found);
+      *lines = n + __builtin_popcount(newline & ((1u << i) - 1));
+      return p + i;
+    }
+
+    n += __builtin_popcount(newline);
+    p += BLOCK;
+  }
+#endif
+
+  for (; p < end && *p != '"'; p++)
+    if (*p == '\n') n++;
+
+  *lines = n;
+  return p;
+}
+
+
+const char *scan_line(const char *p, const char *end) {
+  /* the C library's memchr is already vectorised */
+  const char *nl = memchr(p, '\n', end - p);
+  return nl ? nl : end;
+}
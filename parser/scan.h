@@ -0,0 +1,22 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/* the first byte from `p` that isn't a space, tab, CR or newline, or `end` */
+const char *scan_space(const char *p, const char *end, size_t *lines);
+
+/* the first '"' from `p`, or `end` */
+const char *scan_quote(const char *p, const char *end, size_t *lines);
+
+/* the first newline from `p`, or `end` */
+const char *scan_line(const char *p, const char *end);
+
+#endif
@@ -19,55 +19,13 @@ const char *token_name(ptoken_type_t token) {
     case TOK_NUMBER: return "NUMBER";
     case TOK_LABEL: return "LABEL";
     case TOK_REGISTER: return "REGISTER";
+    case TOK_IDENTIFIER: return "IDENTIFIER";
 
 
-    case TOK_OP_EXIT: return "EXIT";
-
-    case TOP_OP_INT_STORE: return "INT_STORE";
-    case TOK_OP_INT_PRINT: return "INT_PRINT";
-    case TOK_OP_INT_TOSTRING: return "INT_TOSTRING";
-    case TOK_OP_INT_RANDOM: return "INT_RANDOM";
-
-    case TOK_OP_JUMP_TO: return "JUMP_TO";
-    case TOK_OP_JUMP_Z: return "JUMP_Z";
-    case TOK_OP_JUMP_NZ: return "JUMP_NZ";
-
-    case TOK_OP_MATH_XOR: return "MATH_XOR";
-    case TOK_OP_MATH_ADD: return "MATH_ADD";
-    case TOK_OP_MATH_SUB: return "MATH_SUB";
-    case TOK_OP_MATH_MUL: return "MATH_MUL";
-    case TOK_OP_MATH_DIV: return "MATH_DIV";
-    case TOK_OP_MATH_INC: return "MATH_INC";
-    case TOK_OP_MATH_DEC: return "MATH_DEC";
-    case TOK_OP_MATH_AND: return "MATH_AND";
-    case TOK_OP_MATH_LFT: return "MATH_LFT";
-    case TOK_OP_MATH_RGT: return "MATH_RGT";
-    case TOK_OP_MATH_NOT: return "MATH_NOT";
-    case TOK_OP_MATH_OR: return "MATH_OR";
-
-    case TOK_OP_STRING_STORE: return "STRING_STORE";
-    case TOK_OP_STRING_PRINT: return "STRING_PRINT";
-    case TOK_OP_STRING_CONCAT: return "STRING_CONCAT";
-    case TOK_OP_STRING_SYSTEM: return "STRING_SYSTEM";
-    case TOK_OP_STRING_TOINT: return "STRING_TOINT";
-
-    case TOK_OP_CMP_REG: return "CMP_REG";
-    case TOK_OP_CMP_IMMEDIATE: return "CMP_IMMEDIATE";
-    case TOK_OP_CMP_STRING: return "CMP_STRING";
-    case TOK_OP_IS_STRING: return "IS_STRING";
-    case TOK_OP_IS_NUMBER: return "IS_NUMBER";
-
-    case TOK_OP_NOP: return "NOP";
-    case TOK_OP_STORE_REG: return "STORE_REG";
-
-    case TOK_OP_PEEK: return "PEEK";
-    case TOK_OP_POKE: return "POKE";
-    case TOK_OP_MEMCPY: return "MEMCPY";
-
-    case TOK_OP_STACK_PUSH: return "STACK_PUSH";
-    case TOK_OP_STACK_POP: return "STACK_POP";
-    case TOK_OP_STACK_RET: return "STACK_RET";
-    case TOK_OP_STACK_CALL: return "STACK_CALL";
+#define OP(name, value, format, handler, unchecked, mnemonic) \
+    case TOK_OP_##name: return #name;
+#include "../svm/op_list.h"
+#undef OP
 
     case TOK_COLON: return ":";
     case TOK_COMMA: return ",";
@@ -21,67 +21,16 @@ typedef enum {
   TOK_NUMBER,
   TOK_REGISTER,
   TOK_LABEL,
+  TOK_IDENTIFIER,
   TOK_END,
 
-  TOK_OP_EXIT = 0x00,
-
-
-  /* int operation */
-  TOP_OP_INT_STORE,
-  TOK_OP_INT_PRINT,
-  TOK_OP_INT_TOSTRING,
-  TOK_OP_INT_RANDOM,
-
-  /* jump operations */
-  TOK_OP_JUMP_TO = 0x10,
-  TOK_OP_JUMP_Z,
-  TOK_OP_JUMP_NZ,
-
-  /* math operations */
-  TOK_OP_MATH_XOR = 0x20,
-  TOK_OP_MATH_ADD,
-  TOK_OP_MATH_SUB,
-  TOK_OP_MATH_MUL,
-  TOK_OP_MATH_DIV,
-  TOK_OP_MATH_INC,
-  TOK_OP_MATH_DEC,
-  TOK_OP_MATH_AND,
-  TOK_OP_MATH_LFT,
-  TOK_OP_MATH_RGT,
-  TOK_OP_MATH_NOT,
-  TOK_OP_MATH_OR,
-
-  /* string operations */
-  TOK_OP_STRING_STORE = 0x30,
-  TOK_OP_STRING_PRINT,
-  TOK_OP_STRING_CONCAT,
-  TOK_OP_STRING_SYSTEM,
-  TOK_OP_STRING_TOINT,
-
-  /* comparison/test operations */
-  TOK_OP_CMP_REG = 0x40,
-  TOK_OP_CMP_IMMEDIATE,
-  TOK_OP_CMP_STRING,
-  TOK_OP_IS_STRING,
-  TOK_OP_IS_NUMBER,
-
-  /* misc */
-  TOK_OP_NOP = 0x50,
-  TOK_OP_STORE_REG,
-
-  /* peek/poke operations */
-  TOK_OP_PEEK = 0x60,
-  TOK_OP_POKE,
-  TOK_OP_MEMCPY,
-
-  /* stack operations */
-  TOK_OP_STACK_PUSH = 0x70,
-  TOK_OP_STACK_POP,
-  TOK_OP_STACK_RET,
-  TOK_OP_STACK_CALL,
+  /* one per opcode, with the opcode's value */
+#define OP(name, value, format, handler, unchecked, mnemonic) TOK_OP_##name = value,
+#include "../svm/op_list.h"
+#undef OP
 
   /* misc. */
-  TOK_COMMA,
+  TOK_COMMA = 0x100,
   TOK_COLON,
 } ptoken_type_t;
 
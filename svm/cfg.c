@@ -0,0 +1,454 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "op.h"
+
+/**
+ * Basic blocks, control-flow and call graphs for a bytecode image.
+ *
+ * Every path is followed from address 0 and through every `call` target,
+ * so only code that is actually reachable ends up in a block. Blocks end
+ * at a jump, call, ret or exit, or where another block begins; a jump into
+ * the middle of an instruction gives overlapping blocks, which is fine.
+ *
+ * Targets outside the image only hold code once a POKE or MEMCPY has
+ * written it, they get an empty CFG_BLOCK_DYNAMIC block. So does an
+ * opcode that isn't built in: a native handler decides its operands and
+ * what it does, so the walk stops there. Blocks inside the
+ * image overlapping bytes we can see being written are CFG_BLOCK_POKED,
+ * and if a write goes to an address we can't resolve the whole graph is
+ * marked CFG_SELF_MODIFYING.
+ */
+
+#define CODE_SIZE 0xffff
+
+#define M_VISITED 0x01
+#define M_LEADER  0x02
+#define M_CALLEE  0x04
+#define M_QUEUED  0x08
+
+static unsigned int wrap(unsigned int addr) {
+  return addr >= CODE_SIZE ? 0 : addr;
+}
+
+
+static int ends_block(unsigned char opcode) {
+  switch (opcode) {
+    case EXIT: case JUMP_TO: case JUMP_Z: case JUMP_NZ: case JUMP_LT: case JUMP_GT:
+    case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+    case JUMP_TO_REL: case JUMP_Z_REL: case JUMP_NZ_REL:
+    case STACK_CALL: case STACK_CALL_REL: case STACK_RET: case STRING_SWITCH: case JUMP_TABLE:
+      return 1;
+  }
+  return 0;
+}
+
+
+/* queue `addr` once, so the work list never holds more than CODE_SIZE */
+static void push(unsigned int *work, unsigned int *nwork, unsigned char *mark, unsigned int addr) {
+  if (mark[addr] & (M_VISITED | M_QUEUED)) return;
+  mark[addr] |= M_QUEUED;
+  work[(*nwork)++] = addr;
+}
+
+
+/**
+ * Find every reachable instruction, marking the ones that start a block.
+ */
+static void explore(const unsigned char *code, unsigned int size, unsigned char *mark) {
+  unsigned int *work = malloc(CODE_SIZE * sizeof(unsigned int));
+  unsigned int nwork = 0;
+
+  if (!work) return;
+
+  mark[0] |= M_LEADER;
+  push(work, &nwork, mark, 0);
+
+  while (nwork) {
+    unsigned int addr = work[--nwork];
+    mark[addr] |= M_VISITED;
+
+    if (addr >= size) {
+      mark[addr] |= M_LEADER;
+      continue;
+    }
+
+    if (!op_is_builtin(code[addr])) {
+      mark[addr] |= M_LEADER;
+      continue;
+    }
+
+    op_insn_t insn;
+    if (!op_decode(code, size, addr, &insn)) continue;
+
+    unsigned int next = wrap(addr + insn.length);
+    unsigned int target = wrap(insn.imm);
+
+    switch (insn.opcode) {
+      case EXIT: case STACK_RET: break;
+
+      case JUMP_TO: case JUMP_TO_REL:
+        mark[target] |= M_LEADER;
+        push(work, &nwork, mark, target);
+        break;
+
+      case STACK_CALL: case STACK_CALL_REL:
+        mark[target] |= M_CALLEE;
+        /* fallthrough */
+      case JUMP_Z: case JUMP_NZ: case JUMP_LT: case JUMP_GT:
+      case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+      case JUMP_Z_REL: case JUMP_NZ_REL:
+        mark[target] |= M_LEADER;
+        mark[next] |= M_LEADER;
+        push(work, &nwork, mark, target);
+        push(work, &nwork, mark, next);
+        break;
+
+      case STRING_SWITCH: case JUMP_TABLE:
+        for (unsigned int i = 0; i < op_table_size(&insn); i++) {
+          unsigned int to = wrap(op_table_target(&insn, i));
+          mark[to] |= M_LEADER;
+          push(work, &nwork, mark, to);
+        }
+        mark[next] |= M_LEADER;
+        push(work, &nwork, mark, next);
+        break;
+
+      default:
+        push(work, &nwork, mark, next);
+        break;
+    }
+  }
+
+  free(work);
+}
+
+
+static void mark_range(cfg_t *cfg, const unsigned char *known, const unsigned int *value,
+                       unsigned int dest, unsigned int len) {
+  if (!known[dest] || !known[len]) {
+    cfg->flags |= CFG_SELF_MODIFYING;
+    return;
+  }
+
+  for (unsigned int i = 0; i < value[len]; i++) {
+    unsigned int dt = (value[dest] + i) % CODE_SIZE;
+    if (dt < cfg->size) cfg->written[dt] = 1;
+  }
+}
+
+
+/**
+ * Mark the bytes a block's POKE/MEMCPY/RANDOM_FILL write to, tracking
+ * constants stored into registers within the block.
+ */
+static void find_writes(cfg_t *cfg, const unsigned char *code, cfg_block_t *b) {
+  unsigned int value[256];
+  unsigned char known[256];
+  memset(known, 0, sizeof(known));
+
+  for (unsigned int addr = b->start; addr < b->end; ) {
+    op_insn_t insn;
+    if (!op_decode(code, cfg->size, addr, &insn)) break;
+    addr += insn.length;
+
+    switch (insn.opcode) {
+      case INT_STORE:
+        known[insn.reg[0]] = 1;
+        value[insn.reg[0]] = insn.imm;
+        continue;
+
+      case STORE_REG:
+        known[insn.reg[0]] = known[insn.reg[1]];
+        value[insn.reg[0]] = value[insn.reg[1]];
+        continue;
+
+      case POKE:
+        if (!known[insn.reg[1]]) cfg->flags |= CFG_SELF_MODIFYING;
+        else if (value[insn.reg[1]] < cfg->size) cfg->written[value[insn.reg[1]]] = 1;
+        continue;
+
+      case MEMCPY:
+        mark_range(cfg, known, value, insn.reg[0], insn.reg[2]);
+        continue;
+
+      case RANDOM_FILL:
+        mark_range(cfg, known, value, insn.reg[0], insn.reg[1]);
+        continue;
+    }
+
+    /* anything else writing a register clobbers what we knew */
+    if (insn.nreg) known[insn.reg[0]] = 0;
+  }
+}
+
+
+cfg_t *cfg_build(const unsigned char *code, unsigned int size) {
+  if (!code || size > CODE_SIZE) return NULL;
+
+  cfg_t *cfg = calloc(1, sizeof(*cfg));
+  unsigned char *mark = calloc(CODE_SIZE, 1);
+  unsigned int *index = malloc(CODE_SIZE * sizeof(unsigned int));
+  if (!cfg || !mark || !index) goto fail;
+
+  cfg->size = size;
+  cfg->written = calloc(size ? size : 1, 1);
+  if (!cfg->written) goto fail;
+
+  explore(code, size, mark);
+
+  /* one block per leader, in address order */
+  for (unsigned int addr = 0; addr < CODE_SIZE; addr++)
+    if (mark[addr] & M_LEADER) cfg->nblocks++;
+
+  cfg->blocks = calloc(cfg->nblocks, sizeof(cfg_block_t));
+  if (!cfg->blocks) goto fail;
+
+  unsigned int n = 0;
+  for (unsigned int addr = 0; addr < CODE_SIZE; addr++) {
+    index[addr] = CFG_NONE;
+    if (!(mark[addr] & M_LEADER)) continue;
+
+    cfg_block_t *b = &cfg->blocks[n];
+    b->start = b->end = b->last = addr;
+    b->routine = CFG_NONE;
+    if (addr == 0) b->flags |= CFG_BLOCK_ENTRY;
+    if (mark[addr] & M_CALLEE) b->flags |= CFG_BLOCK_CALLEE;
+    index[addr] = n++;
+  }
+
+  /* decode the body of each block */
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+
+    if (b->start >= size || !op_is_builtin(code[b->start])) {
+      b->flags |= CFG_BLOCK_DYNAMIC;
+      continue;
+    }
+
+    for (unsigned int addr = b->start;;) {
+      op_insn_t insn;
+      if (!op_decode(code, size, addr, &insn)) {
+        b->flags |= CFG_BLOCK_TRUNCATED;
+        b->end = size;
+        break;
+      }
+
+      b->ninsn++;
+      b->last = addr;
+      b->end = addr + insn.length;
+
+      unsigned int next = wrap(b->end);
+      if (ends_block(insn.opcode) || (mark[next] & M_LEADER)) break;
+      addr = next;
+    }
+  }
+
+  /* control-flow edges */
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+    if (b->flags & (CFG_BLOCK_DYNAMIC | CFG_BLOCK_TRUNCATED)) continue;
+
+    op_insn_t insn;
+    op_decode(code, size, b->last, &insn);
+    unsigned int next = index[wrap(b->end)];
+    unsigned int target = index[wrap(insn.imm)];
+
+    b->succ = malloc((op_table_size(&insn) + 2) * sizeof(unsigned int));
+    if (!b->succ) goto fail;
+
+    switch (insn.opcode) {
+      case EXIT: b->flags |= CFG_BLOCK_EXIT; break;
+      case STACK_RET: b->flags |= CFG_BLOCK_RET; break;
+      case JUMP_TO: case JUMP_TO_REL: b->succ[b->nsucc++] = target; break;
+
+      case JUMP_Z: case JUMP_NZ: case JUMP_LT: case JUMP_GT:
+      case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+      case JUMP_Z_REL: case JUMP_NZ_REL:
+        b->succ[b->nsucc++] = target;
+        if (next != target) b->succ[b->nsucc++] = next;
+        break;
+
+      case STACK_CALL: case STACK_CALL_REL:
+        b->flags |= CFG_BLOCK_CALL;
+        cfg->ncalls++;
+        b->succ[b->nsucc++] = next;
+        break;
+
+      case STRING_SWITCH: case JUMP_TABLE:
+        for (unsigned int t = 0; t <= op_table_size(&insn); t++) {
+          unsigned int to = (t < op_table_size(&insn)) ?
+            index[wrap(op_table_target(&insn, t))] : next;
+
+          unsigned int s = 0;
+          while (s < b->nsucc && b->succ[s] != to) s++;
+          if (s == b->nsucc) b->succ[b->nsucc++] = to;
+        }
+        break;
+
+      default: b->succ[b->nsucc++] = next; break;
+    }
+
+    for (unsigned int s = 0; s < b->nsucc; s++)
+      cfg->blocks[b->succ[s]].npred++;
+  }
+
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+    b->pred = malloc((b->npred ? b->npred : 1) * sizeof(unsigned int));
+    if (!b->pred) goto fail;
+    b->npred = 0;
+  }
+
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+    for (unsigned int s = 0; s < b->nsucc; s++) {
+      cfg_block_t *to = &cfg->blocks[b->succ[s]];
+      to->pred[to->npred++] = i;
+    }
+  }
+
+  /* routines are the entry point plus every call target */
+  for (unsigned int i = 0; i < cfg->nblocks; i++)
+    if (cfg->blocks[i].flags & (CFG_BLOCK_ENTRY | CFG_BLOCK_CALLEE))
+      cfg->nroutines++;
+
+  cfg->routines = calloc(cfg->nroutines ? cfg->nroutines : 1, sizeof(cfg_routine_t));
+  cfg->calls = calloc(cfg->ncalls ? cfg->ncalls : 1, sizeof(cfg_call_t));
+  unsigned int *work = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(unsigned int));
+  if (!cfg->routines || !cfg->calls || !work) { free(work); goto fail; }
+
+  n = 0;
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    if (!(cfg->blocks[i].flags & (CFG_BLOCK_ENTRY | CFG_BLOCK_CALLEE))) continue;
+    cfg->routines[n].entry = i;
+
+    /* blocks shared between routines belong to the first that reaches them */
+    unsigned int nwork = 0;
+    if (cfg->blocks[i].routine == CFG_NONE) {
+      cfg->blocks[i].routine = n;
+      work[nwork++] = i;
+    }
+    while (nwork) {
+      cfg_block_t *b = &cfg->blocks[work[--nwork]];
+      for (unsigned int s = 0; s < b->nsucc; s++) {
+        cfg_block_t *to = &cfg->blocks[b->succ[s]];
+        if (to->routine != CFG_NONE) continue;
+        to->routine = n;
+        work[nwork++] = b->succ[s];
+      }
+    }
+    n++;
+  }
+  free(work);
+
+  /* call graph */
+  n = 0;
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+    if (!(b->flags & CFG_BLOCK_CALL)) continue;
+
+    op_insn_t insn;
+    op_decode(code, size, b->last, &insn);
+    cfg->calls[n].site = b->last;
+    cfg->calls[n].caller = b->routine;
+    cfg->calls[n].callee = cfg->blocks[index[wrap(insn.imm)]].routine;
+    n++;
+  }
+
+  /* code that gets rewritten at runtime */
+  for (unsigned int i = 0; i < cfg->nblocks; i++)
+    find_writes(cfg, code, &cfg->blocks[i]);
+
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+    for (unsigned int addr = b->start; addr < b->end && addr < size; addr++) {
+      if (cfg->written[addr]) {
+        b->flags |= CFG_BLOCK_POKED;
+        break;
+      }
+    }
+  }
+
+  free(mark); free(index);
+  return cfg;
+
+fail:
+  free(mark); free(index);
+  cfg_free(cfg);
+  return NULL;
+}
+
+
+void cfg_free(cfg_t *cfg) {
+  if (!cfg) return;
+  if (cfg->blocks)
+    for (unsigned int i = 0; i < cfg->nblocks; i++) {
+      free(cfg->blocks[i].pred);
+      free(cfg->blocks[i].succ);
+    }
+  free(cfg->blocks);
+  free(cfg->routines);
+  free(cfg->calls);
+  free(cfg->written);
+  free(cfg);
+}
+
+
+/**
+ * Index of the block containing `addr`, or CFG_NONE.
+ */
+unsigned int cfg_block_at(const cfg_t *cfg, unsigned int addr) {
+  unsigned int lo = 0, hi = cfg->nblocks;
+
+  /* last block starting at or before addr */
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    if (cfg->blocks[mid].start <= addr) lo = mid + 1;
+    else hi = mid;
+  }
+
+  if (lo == 0) return CFG_NONE;
+  const cfg_block_t *b = &cfg->blocks[lo - 1];
+  if (addr == b->start || addr < b->end) return lo - 1;
+  return CFG_NONE;
+}
+
+
+int cfg_is_written(const cfg_t *cfg, unsigned int addr) {
+  if (cfg->flags & CFG_SELF_MODIFYING) return 1;
+  return addr < cfg->size && cfg->written[addr];
+}
+
+
+void cfg_dump(const cfg_t *cfg, FILE *fp) {
+  static const char *names[] = {
+    "entry", "callee", "ret", "call", "exit", "poked", "dynamic", "truncated"
+  };
+
+  if (cfg->flags & CFG_SELF_MODIFYING) fprintf(fp, "self-modifying\n");
+
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    const cfg_block_t *b = &cfg->blocks[i];
+    fprintf(fp, "block %u [%04X-%04X) routine %u,", i, b->start, b->end, b->routine);
+    for (int f = 0; f < 8; f++)
+      if (b->flags & (1 << f)) fprintf(fp, " %s", names[f]);
+
+    fprintf(fp, "\n\t->");
+    for (unsigned int s = 0; s < b->nsucc; s++) fprintf(fp, " %u", b->succ[s]);
+    fprintf(fp, "\n");
+  }
+
+  for (unsigned int i = 0; i < cfg->ncalls; i++) {
+    const cfg_call_t *c = &cfg->calls[i];
+    fprintf(fp, "call %04X: routine %u -> routine %u\n", c->site, c->caller, c->callee);
+  }
+}
@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdio.h>
+
+#define CFG_NONE (~0u)
+
+/* block flags */
+#define CFG_BLOCK_ENTRY     0x01  /* program entry point */
+#define CFG_BLOCK_CALLEE    0x02  /* target of a `call` */
+#define CFG_BLOCK_RET       0x04  /* ends in `ret` */
+#define CFG_BLOCK_CALL      0x08  /* ends in `call` */
+#define CFG_BLOCK_EXIT      0x10  /* ends in `exit` */
+#define CFG_BLOCK_POKED     0x20  /* overlaps bytes the program writes */
+#define CFG_BLOCK_DYNAMIC   0x40  /* outside the image or a native opcode, not known until run */
+#define CFG_BLOCK_TRUNCATED 0x80  /* last instruction runs off the image */
+
+/* graph flags */
+#define CFG_SELF_MODIFYING  0x01  /* writes to an address we couldn't resolve */
+
+typedef struct cfg_t cfg_t;
+typedef struct cfg_block_t cfg_block_t;
+typedef struct cfg_routine_t cfg_routine_t;
+typedef struct cfg_call_t cfg_call_t;
+
+struct cfg_block_t {
+  unsigned int start, end;  /* [start, end) */
+  unsigned int last;        /* address of the final instruction */
+  unsigned int ninsn;
+  unsigned int flags;
+  unsigned int routine;
+
+  unsigned int *succ;       /* block indices, taken edges first */
+  unsigned int nsucc;
+  unsigned int *pred;
+  unsigned int npred;
+};
+
+struct cfg_routine_t {
+  unsigned int entry;       /* entry block */
+};
+
+struct cfg_call_t {
+  unsigned int site;        /* address of the `call` */
+  unsigned int caller;      /* routine indices */
+  unsigned int callee;
+};
+
+struct cfg_t {
+  cfg_block_t *blocks; unsigned int nblocks;
+  cfg_routine_t *routines; unsigned int nroutines;
+  cfg_call_t *calls; unsigned int ncalls;
+  unsigned int flags;
+
+  /* bitmap of bytes inside the image written by POKE/MEMCPY/RANDOM_FILL */
+  unsigned char *written;
+  unsigned int size;
+};
+
+cfg_t *cfg_build(const unsigned char *code, unsigned int size);
+void cfg_free(cfg_t *cfg);
+
+unsigned int cfg_block_at(const cfg_t *cfg, unsigned int addr);
+int cfg_is_written(const cfg_t *cfg, unsigned int addr);
+void cfg_dump(const cfg_t *cfg, FILE *fp);
+
+#endif
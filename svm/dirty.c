@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include "svm.h"
+
+/**
+ * Dirty blocks.
+ *
+ * Every write to memory sets the bit for the SVM_BLOCK_SIZE byte block it
+ * lands in: POKE, MEMCPY and RANDOM_FILL, svm_mem_write and patches. Code
+ * keeping something derived from memory, decoded instructions or a
+ * snapshot, asks which blocks changed since it last cleared the bits
+ * rather than going over all 64K again. The bits belong to the vm's
+ * thread, read them while it isn't running.
+ */
+
+
+void svm_dirty_range(svm_t *cpu, unsigned int addr, unsigned int len) {
+  if (!len || addr > 0xffff) return;
+  if (len > 0x10000 - addr) len = 0x10000 - addr;
+
+  unsigned int last = (addr + len - 1) >> SVM_BLOCK_SHIFT;
+  for (unsigned int b = addr >> SVM_BLOCK_SHIFT; b <= last; b++)
+    cpu->dirty[b / 64] |= 1ull << (b % 64);
+}
+
+
+/* whether the block holding `addr` was written */
+int svm_dirty(const svm_t *cpu, unsigned int addr) {
+  if (addr > 0xffff) return 0;
+  unsigned int b = addr >> SVM_BLOCK_SHIFT;
+  return (cpu->dirty[b / 64] >> (b % 64)) & 1;
+}
+
+
+/**
+ * The first dirty block from `block` on, SVM_BLOCKS if there are none.
+ * Walk them with:
+ *
+ *   for (b = svm_dirty_next(cpu, 0); b < SVM_BLOCKS; b = svm_dirty_next(cpu, b + 1))
+ */
+unsigned int svm_dirty_next(const svm_t *cpu, unsigned int block) {
+  while (block < SVM_BLOCKS) {
+    unsigned long long word = cpu->dirty[block / 64] >> (block % 64);
+    if (word) return block + __builtin_ctzll(word);
+    block = (block | 63) + 1;
+  }
+  return SVM_BLOCKS;
+}
+
+
+unsigned int svm_dirty_count(const svm_t *cpu) {
+  unsigned int n = 0;
+  for (unsigned int i = 0; i < SVM_BLOCKS / 64; i++)
+    n += __builtin_popcountll(cpu->dirty[i]);
+  return n;
+}
+
+
+void svm_dirty_clear(svm_t *cpu) {
+  memset(cpu->dirty, '\0', sizeof(cpu->dirty));
+}
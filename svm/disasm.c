@@ -0,0 +1,311 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "svm.h"
+#include "op.h"
+#include "disasm.h"
+
+/**
+ * Disassembly.
+ *
+ * Instructions are decoded with op_decode, so anything the vm learns to
+ * run the disassembler can read. A byte no opcode claims, or an
+ * instruction cut off by the end of the image, comes back as a one-byte
+ * instruction that svm_disasm_is_data owns up to and prints as a `data`
+ * line, the directive both assemblers take for raw bytes. So is an
+ * instruction with a string the assemblers' quotes can't hold.
+ *
+ * Lines are written in the syntax the compiler reads, with addresses as
+ * numbers rather than labels, so a listing assembles back to the image.
+ */
+
+#define DISASM_BUFFER 65536
+
+typedef struct {
+  char *p;
+  size_t room;   /* bytes left, less the terminator */
+  size_t len;    /* bytes wanted so far */
+} line_t;
+
+
+static void put(line_t *l, const char *s, size_t n) {
+  size_t k = (n < l->room) ? n : l->room;
+  memcpy(l->p, s, k);
+  l->p += k; l->room -= k;
+  l->len += n;
+}
+
+
+static void put_str(line_t *l, const char *s) {
+  put(l, s, strlen(s));
+}
+
+
+static void put_reg(line_t *l, unsigned int reg) {
+  char buf[16];
+  buf[0] = '#';
+  put(l, buf, 1 + svm_format_int(buf + 1, reg));
+}
+
+
+static void put_addr(line_t *l, unsigned int addr) {
+  char buf[16];
+  buf[0] = '0'; buf[1] = 'x';
+  put(l, buf, 2 + svm_format_hex(buf + 2, addr, 4));
+}
+
+
+static void put_int(line_t *l, int val) {
+  char buf[16];
+  put(l, buf, svm_format_int(buf, val));
+}
+
+
+/**
+ * Whether a string reads back the same between quotes: the assemblers
+ * have no escape for '"', and a backslash before n or t would turn into
+ * a newline or tab.
+ */
+static int quotable(const unsigned char *s, unsigned int len) {
+  for (unsigned int i = 0; i < len; i++) {
+    if (s[i] == '"') return 0;
+    if (s[i] == '\\' && i + 1 < len && (s[i + 1] == 'n' || s[i + 1] == 't')) return 0;
+  }
+  return 1;
+}
+
+
+/* whether every string operand of `insn` is quotable */
+static int strings_quotable(const op_insn_t *insn) {
+  if (insn->format == OPF_RS) return quotable(insn->str, insn->imm);
+  if (insn->format != OPF_SWITCH) return 1;
+
+  const unsigned char *pool = insn->str + insn->count * OP_SWITCH_ENTRY;
+  for (unsigned int i = 0; i < insn->count; i++) {
+    const unsigned char *e = insn->str + i * OP_SWITCH_ENTRY;
+    unsigned int len = e[4] + 256 * e[5];
+    unsigned int off = e[6] + 256 * e[7];
+
+    if (off > insn->imm) off = insn->imm;
+    if (len > insn->imm - off) len = insn->imm - off;
+    if (!quotable(pool + off, len)) return 0;
+  }
+  return 1;
+}
+
+
+/* a string operand, with newlines and tabs escaped the way they were written */
+static void put_quoted(line_t *l, const unsigned char *s, unsigned int len) {
+  unsigned int run = 0;
+
+  put(l, "\"", 1);
+  for (unsigned int i = 0; i < len; i++) {
+    if (s[i] != '\n' && s[i] != '\t') continue;
+    put(l, (const char *) s + run, i - run);
+    put(l, s[i] == '\n' ? "\\n" : "\\t", 2);
+    run = i + 1;
+  }
+  put(l, (const char *) s + run, len - run);
+  put(l, "\"", 1);
+}
+
+
+static void format_insn(line_t *l, const op_insn_t *insn) {
+  const unsigned char *r = insn->reg;
+
+  if (svm_disasm_is_data(insn)) {
+    put(l, "data ", 5);
+    put_int(l, insn->opcode);
+    return;
+  }
+
+  /* the whole instruction as bytes, from the opcode on */
+  if (!strings_quotable(insn)) {
+    const unsigned char *op = insn->str - (insn->format == OPF_SWITCH ? 6 : 4);
+    put(l, "data ", 5);
+    for (unsigned int i = 0; i < insn->length; i++) {
+      if (i) put(l, ", ", 2);
+      put_int(l, op[i]);
+    }
+    return;
+  }
+
+  put_str(l, op_mnemonic(insn->opcode));
+
+  switch (insn->format) {
+    case OPF_NONE: break;
+
+    case OPF_R: case OPF_RR: case OPF_RRR:
+      for (unsigned int i = 0; i < insn->nreg; i++) {
+        put(l, i ? ", " : " ", i ? 2 : 1);
+        put_reg(l, r[i]);
+      }
+      break;
+
+    case OPF_RI:
+      put(l, " ", 1); put_reg(l, r[0]);
+      put(l, ", ", 2); put_addr(l, insn->imm);
+      break;
+
+    case OPF_I: case OPF_REL:
+      put(l, " ", 1); put_addr(l, insn->imm);
+      break;
+
+    case OPF_RIA:
+      put(l, " ", 1); put_reg(l, r[0]);
+      put(l, ", ", 2); put_int(l, insn->arg);
+      put(l, ", ", 2); put_addr(l, insn->imm);
+      break;
+
+    case OPF_RS:
+      put(l, " ", 1); put_reg(l, r[0]);
+      put(l, ", ", 2); put_quoted(l, insn->str, insn->imm);
+      break;
+
+    case OPF_TABLE:
+      put(l, " ", 1); put_reg(l, r[0]);
+      for (unsigned int i = 0; i < insn->count; i++) {
+        put(l, ", ", 2);
+        put_addr(l, op_table_target(insn, i));
+      }
+      break;
+
+    case OPF_SWITCH: {
+      const unsigned char *pool = insn->str + insn->count * OP_SWITCH_ENTRY;
+
+      put(l, " ", 1); put_reg(l, r[0]);
+      for (unsigned int i = 0; i < insn->count; i++) {
+        const unsigned char *e = insn->str + i * OP_SWITCH_ENTRY;
+        unsigned int len = e[4] + 256 * e[5];
+        unsigned int off = e[6] + 256 * e[7];
+
+        /* keep a damaged entry inside the pool */
+        if (off > insn->imm) off = insn->imm;
+        if (len > insn->imm - off) len = insn->imm - off;
+
+        put(l, ", ", 2);
+        put_quoted(l, pool + off, len);
+        put(l, ": ", 2);
+        put_addr(l, op_table_target(insn, i));
+      }
+      break;
+    }
+  }
+}
+
+
+static void format_line(line_t *l, const op_insn_t *insn, int flags) {
+  if (flags & SVM_DISASM_ADDRESS) {
+    char buf[8];
+    put(l, buf, svm_format_hex(buf, insn->addr, 4));
+  }
+
+  put(l, "\t", 1);
+  format_insn(l, insn);
+  put(l, "\n", 1);
+}
+
+
+void svm_disasm_init(svm_disasm_t *d, const unsigned char *code, unsigned int size) {
+  d->code = code;
+  d->size = size;
+  d->addr = 0;
+}
+
+
+/**
+ * Decode the next instruction into `insn`, returns 0 once the image is
+ * used up.
+ */
+int svm_disasm_next(svm_disasm_t *d, op_insn_t *insn) {
+  if (d->addr >= d->size) return 0;
+
+  if (!op_decode(d->code, d->size, d->addr, insn))
+    op_decode_as(d->code, d->size, d->addr, OPF_NONE, insn);
+
+  d->addr += insn->length;
+  return 1;
+}
+
+
+int svm_disasm_is_data(const op_insn_t *insn) {
+  return !op_is_builtin(insn->opcode) || insn->format != op_format(insn->opcode);
+}
+
+
+size_t svm_disasm_format(const op_insn_t *insn, char *buf, size_t len) {
+  line_t l = { buf, len ? len - 1 : 0, 0 };
+
+  format_insn(&l, insn);
+  if (len) *l.p = '\0';
+  return l.len;
+}
+
+
+unsigned int svm_disasm(const unsigned char *code, unsigned int size,
+                        svm_disasm_fn_t fn, void *udata) {
+  svm_disasm_t d;
+  op_insn_t insn;
+  unsigned int n = 0;
+
+  svm_disasm_init(&d, code, size);
+  while (svm_disasm_next(&d, &insn)) {
+    fn(udata, &insn);
+    n++;
+  }
+
+  return n;
+}
+
+
+/**
+ * Write a listing of `code` to `fp`. Lines are gathered in a buffer and
+ * written in large blocks, a line too long for the buffer on its own is
+ * written by itself. Returns 0, or -1 if writing failed.
+ */
+int svm_disasm_write(FILE *fp, const unsigned char *code, unsigned int size, int flags) {
+  char *buf = malloc(DISASM_BUFFER);
+  size_t used = 0;
+  svm_disasm_t d;
+  op_insn_t insn;
+
+  if (!buf) return -1;
+
+  svm_disasm_init(&d, code, size);
+  while (svm_disasm_next(&d, &insn)) {
+    line_t l = { buf + used, DISASM_BUFFER - used, 0 };
+    format_line(&l, &insn, flags);
+    if (l.len < DISASM_BUFFER - used) { used += l.len; continue; }
+
+    /* didn't fit, flush and go again */
+    fwrite(buf, 1, used, fp);
+    used = 0;
+
+    if (l.len < DISASM_BUFFER) {
+      line_t again = { buf, DISASM_BUFFER, 0 };
+      format_line(&again, &insn, flags);
+      used = again.len;
+      continue;
+    }
+
+    char *big = malloc(l.len);
+    if (!big) { free(buf); return -1; }
+
+    line_t whole = { big, l.len, 0 };
+    format_line(&whole, &insn, flags);
+    fwrite(big, 1, whole.len, fp);
+    free(big);
+  }
+
+  fwrite(buf, 1, used, fp);
+  free(buf);
+  return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdio.h>
+#include "op.h"
+
+#define SVM_DISASM_ADDRESS 0x01  /* start each line with its address */
+
+typedef struct svm_disasm_t svm_disasm_t;
+typedef void (*svm_disasm_fn_t)(void *udata, const op_insn_t *insn);
+
+/* a position in a code image, walked one instruction at a time */
+struct svm_disasm_t {
+  const unsigned char *code;
+  unsigned int size;
+  unsigned int addr;
+};
+
+void svm_disasm_init(svm_disasm_t *d, const unsigned char *code, unsigned int size);
+int svm_disasm_next(svm_disasm_t *d, op_insn_t *insn);
+
+/* non-zero if `insn` is a byte no opcode claims */
+int svm_disasm_is_data(const op_insn_t *insn);
+
+/* the source line for `insn`, like snprintf: the full length comes back */
+size_t svm_disasm_format(const op_insn_t *insn, char *buf, size_t len);
+
+/* every instruction in `code`, returns how many there were */
+unsigned int svm_disasm(const unsigned char *code, unsigned int size,
+  svm_disasm_fn_t fn, void *udata);
+int svm_disasm_write(FILE *fp, const unsigned char *code, unsigned int size, int flags);
+
+#endif
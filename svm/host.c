@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "svm.h"
+#include "trace.h"
+
+/**
+ * Host calls.
+ *
+ * STRING_SYSTEM hands its string to the function in the SVM_HOST_SYSTEM
+ * slot rather than to system(). A host function either finishes the call
+ * and returns SVM_HOST_DONE, or returns SVM_HOST_PENDING, which stops the
+ * run loop after the current instruction. The host then calls
+ * svm_host_complete and svm_resume once whatever it was waiting on is done.
+ *
+ * The default spawns the command directly with posix_spawn, so no shell
+ * ever sees the string, and waits for it. svm_host_spawn_async starts the
+ * child and suspends instead; svm_poll reaps it, so a single thread can
+ * keep many vms going while their children run.
+ */
+
+extern char **environ;
+
+
+void svm_host_set(svm_t *cpu, int slot, svm_host_fn_t fn, void *udata) {
+  if (slot < 0 || slot >= SVM_HOST_MAX) svm_panic(cpu, "host call slot out of range");
+  cpu->host[slot].fn = fn;
+  cpu->host[slot].udata = udata;
+}
+
+
+void svm_host_complete(svm_t *cpu, int status) {
+  cpu->child = 0;
+  cpu->host_status = status;
+  if (cpu->trace) svm_trace_status(cpu, status);
+}
+
+
+/**
+ * Returns 1 when a suspended vm is ready for svm_resume, 0 while its host
+ * call is still running. Never blocks.
+ */
+int svm_poll(svm_t *cpu) {
+  if (!cpu->suspended) return 1;
+  if (!cpu->child) return 0;
+
+  int status;
+  pid_t pid = waitpid(cpu->child, &status, WNOHANG);
+
+  if (pid == 0) return 0;
+  if (pid < 0 && errno == EINTR) return 0;
+
+  svm_host_complete(cpu, (pid < 0) ? -1 : status);
+  return 1;
+}
+
+
+/**
+ * Kill and reap the child a suspended vm is waiting on, if there is one.
+ * svm_free does this, so a vm can be dropped mid-call.
+ */
+void svm_host_cancel(svm_t *cpu) {
+  if (!cpu->child) return;
+
+  kill(cpu->child, SIGKILL);
+  while (waitpid(cpu->child, NULL, 0) < 0 && errno == EINTR);
+  cpu->child = 0;
+  cpu->host_status = -1;
+}
+
+
+/**
+ * Split a command line into argv on blanks. Single and double quotes group
+ * words, nothing else is special. Both returned arrays come from one
+ * allocation; free the result.
+ */
+static char **split_args(const char *cmd) {
+  size_t len = strlen(cmd);
+  size_t max = len / 2 + 2;
+  char **argv = malloc(max * sizeof(char *) + len + 1);
+  if (!argv) return NULL;
+
+  char *out = (char *) (argv + max);
+  size_t argc = 0;
+  const char *p = cmd;
+
+  for (;;) {
+    while (*p == ' ' || *p == '\t' || *p == '\n') p++;
+    if (!*p) break;
+
+    argv[argc++] = out;
+    char quote = 0;
+
+    for (; *p; p++) {
+      if (quote) {
+        if (*p == quote) quote = 0;
+        else *out++ = *p;
+      } else if (*p == '"' || *p == '\'') {
+        quote = *p;
+      } else if (*p == ' ' || *p == '\t' || *p == '\n') {
+        break;
+      } else {
+        *out++ = *p;
+      }
+    }
+    *out++ = '\0';
+  }
+
+  argv[argc] = NULL;
+  return argv;
+}
+
+
+static pid_t spawn(const char *arg) {
+  char **argv = split_args(arg);
+  pid_t pid = 0;
+
+  if (!argv || !argv[0] || posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+    pid = 0;
+
+  free(argv);
+  return pid;
+}
+
+
+int svm_host_spawn(svm_t *cpu, const char *arg, void *udata) {
+  (void) udata;
+  pid_t pid = spawn(arg);
+  int status = -1;
+
+  if (pid) {
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+  }
+
+  cpu->host_status = status;
+  return SVM_HOST_DONE;
+}
+
+
+int svm_host_spawn_async(svm_t *cpu, const char *arg, void *udata) {
+  (void) udata;
+  pid_t pid = spawn(arg);
+
+  if (!pid) {
+    cpu->host_status = -1;
+    return SVM_HOST_DONE;
+  }
+
+  cpu->child = pid;
+  return SVM_HOST_PENDING;
+}
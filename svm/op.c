@@ -5,35 +5,51 @@
 * under the terms of the MIT license. See LICENSE for details.
 */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
 
 #include "op.h"
+#include "prog.h"
+#include "str.h"
+#include "trace.h"
 
 #define BOUNDS_TEST_REG(reg) if (reg >= REGISTER_COUNT ) svm_panic(svm, "reegister out of bounds");
 #define BYTES_TO_ADDR(one,two) (one + ( 256 * two ))
 
-#define MATH_OPERATION(function,operator)  void function(svm_t* svm) { \
+/**
+* Flags after `a op b` gave `res`: carry is the unsigned result not fitting
+* in 32 bits, overflow the signed one. Logic ops clear both.
+*/
+#define ARITH_FLAGS(op, a, b, res) set_flags(svm, res, \
+  (((unsigned long long) (unsigned int) (a) op (unsigned long long) (unsigned int) (b)) >> 32) != 0, \
+  ((long long) (a) op (long long) (b)) != (long long) (int) (res))
+#define LOGIC_FLAGS(op, a, b, res) set_flags(svm, res, 0, 0)
+
+/* signed orderings after a compare or math op */
+#define FLAGS_LT(f) ((f).s != (f).o)
+#define FLAGS_GT(f) (!(f).z && (f).s == (f).o)
+
+#define MATH_OPERATION(function,operator,flags,mask,ctype)  void function(svm_t* svm) { \
   /* get the destination register */ \
   unsigned int reg = next_byte(svm); \
   BOUNDS_TEST_REG(reg); \
   \
   /* get the source register */ \
   unsigned int src1 = next_byte(svm); \
-  BOUNDS_TEST_REG(reg); \
+  BOUNDS_TEST_REG(src1); \
   \
   /* get the source register */\
   unsigned int src2 = next_byte(svm);\
-  BOUNDS_TEST_REG(reg);\
+  BOUNDS_TEST_REG(src2);\
   \
   if (getenv("DEBUG") != NULL)\
     printf( #function "(register: %d = register:%d " #operator " register: %d)\n", reg, src1, src2); \
   \
   /* if the result-register stores a string .. free it */\
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))\
-    free(svm->registers[reg].value.string);\
+    svm_str_unref(svm->registers[reg].value.string);\
   \
   /* \
   * ensure both source registers have number values.\
@@ -44,34 +60,52 @@
   /** \
   * Store the result.\
   */\
-  svm->registers[reg].value.number = val1 operator val2; \
+  svm->registers[reg].value.number = (ctype) val1 operator ((unsigned int) val2 & mask); \
   svm->registers[reg].type = NUMBER; \
   \
   /**\
-  * Zero result? \
+  * Zero, sign, carry and overflow. \
   */\
-  if (svm->registers[reg].value.number == 0)\
-    svm->flags.z = 1;\
-  else\
-    svm->flags.z = 0;\
+  flags(operator, val1, val2, svm->registers[reg].value.number); \
   \
   /* handle the next instruction */ \
   svm->ip += 1; \
+} \
+\
+void function##_unchecked(svm_t* svm) { \
+  const unsigned char *op = svm->code + svm->ip; \
+  reg_t *dst = &svm->registers[op[1]]; \
+  int val1 = svm->registers[op[2]].value.number; \
+  int val2 = svm->registers[op[3]].value.number; \
+  \
+  if ((dst->type == STRING) && (dst->value.string)) \
+    svm_str_unref(dst->value.string); \
+  \
+  dst->value.number = (ctype) val1 operator ((unsigned int) val2 & mask); \
+  dst->type = NUMBER; \
+  flags(operator, val1, val2, dst->value.number); \
+  \
+  svm->ip += 4; \
 }
 
-char *strdup(const char *src) {
-  size_t len = strlen(src) + 1;
-  char *s = malloc(len);
-  if (s == NULL) return NULL;
-  return (char *)memcpy(s, src, len);
-}
-
-
 char *get_string_reg(svm_t* cpu, int reg);
 int get_int_reg(svm_t* cpu, int reg);
 char *string_from_stack(svm_t* svm);
 unsigned char next_byte(svm_t* svm);
 
+static inline void set_flags(svm_t *svm, unsigned int res, int carry, int overflow) {
+  svm->flags.z = (res == 0);
+  svm->flags.s = res >> 31;
+  svm->flags.c = carry;
+  svm->flags.o = overflow;
+}
+
+/* tests only say yes or no, in the z-flag */
+static inline void set_test(svm_t *svm, int z) {
+  svm->flags.z = (z != 0);
+  svm->flags.s = svm->flags.c = svm->flags.o = 0;
+}
+
 char *get_string_reg(svm_t * cpu, int reg) {
   if (cpu->registers[reg].type == STRING)
     return (cpu->registers[reg].value.string);
@@ -100,21 +134,11 @@ char *string_from_stack(svm_t* svm) {
   svm->ip += 1;
 
   /* allocate enough RAM to contain the string. */
-  char *tmp = (char *)malloc(len + 1);
+  if (svm->ip + len > 0xffff) svm_panic(svm, "string runs past the end of memory");
+  char *tmp = svm_str_new((char *) svm->code + svm->ip, len);
   if (tmp == NULL) svm_panic(svm, "RAM allocation failure.");
 
-  /**
-  * Zero the allocated memory, and copy the string-values over.
-  *
-  * The copy is inefficient - but copes with embedded NULL.
-  */
-  memset(tmp, '\0', len + 1);
-  for (int i = 0; i < (int) len; i++) {
-    tmp[i] = svm->code[svm->ip];
-    svm->ip++;
-  }
-
-  svm->ip--;
+  svm->ip += len - 1;
   return tmp;
 }
 
@@ -127,6 +151,21 @@ unsigned char next_byte(svm_t* svm) {
 }
 
 
+/**
+* Write the "0xHHHH -> D" form of a number to the vm output.
+*/
+static void print_int(svm_t *svm, int val) {
+  char buf[32], *p = buf;
+
+  *p++ = '0'; *p++ = 'x';
+  p += svm_format_hex(p, (unsigned int) val, 4);
+  memcpy(p, " -> ", 4); p += 4;
+  p += svm_format_int(p, val);
+
+  svm_write(svm, buf, p - buf);
+}
+
+
 /**
 ** Start implementation of virtual machine op_codes.
 **
@@ -135,7 +174,18 @@ unsigned char next_byte(svm_t* svm) {
 
 void op_unknown(svm_t * svm) {
   int instruction = svm->code[svm->ip];
-  printf("%04X - op_unknown(%02X)\n", svm->ip, instruction);
+  char buf[32], *p = buf;
+
+  if (svm->prog && svm->prog->natives[instruction].fn) {
+    svm_prog_call(svm);
+    return;
+  }
+
+  p += svm_format_hex(p, svm->ip, 4);
+  memcpy(p, " - op_unknown(", 14); p += 14;
+  p += svm_format_hex(p, instruction, 2);
+  *p++ = ')'; *p++ = '\n';
+  svm_write(svm, buf, p - buf);
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -173,18 +223,18 @@ void op_math_div(svm_t * svm) {
 
   /* get the source register */
   unsigned int src1 = next_byte(svm);
-  BOUNDS_TEST_REG(reg);
+  BOUNDS_TEST_REG(src1);
 
   /* get the source register */
   unsigned int src2 = next_byte(svm);
-  BOUNDS_TEST_REG(reg);
+  BOUNDS_TEST_REG(src2);
 
   if (getenv("DEBUG") != NULL)
     printf( "DIV (register:%d = Register:%d / Register:%d)\n", reg, src1, src2);
 
   /* if the result-register stores a string .. free it */
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
-    free(svm->registers[reg].value.string);
+    svm_str_unref(svm->registers[reg].value.string);
 
   /*
   * Ensure both source registers have number values.
@@ -198,16 +248,17 @@ void op_math_div(svm_t * svm) {
   }
 
   /**
-  * Store the result.
+  * Store the result. INT_MIN / -1 doesn't fit and would trap, it wraps
+  * like the other math ops and sets the overflow flag.
   */
-  svm->registers[reg].value.number = val1 / val2;
+  if (val2 == -1) svm->registers[reg].value.number = 0u - (unsigned int) val1;
+  else svm->registers[reg].value.number = val1 / val2;
   svm->registers[reg].type = NUMBER;
 
   /**
-  * Zero result?
+  * Zero, sign and overflow.
   */
-  if (svm->registers[reg].value.number == 0) svm->flags.z = 1;
-  else svm->flags.z = 0;
+  ARITH_FLAGS(/, val1, val2, svm->registers[reg].value.number);
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -231,15 +282,15 @@ void op_reg_store(svm_t *svm) {
   if (getenv("DEBUG") != NULL)
     printf("STORE (reg%02x will be set to values of Reg%02x)\n", dst, src);
 
-  /* Free the existing string, if present */
-  if ((svm->registers[dst].type == STRING) && (svm->registers[dst].value.string))
-    free(svm->registers[dst].value.string);
+  /* share the string - take our reference before dropping the old one */
+  if (svm->registers[src].type == STRING) svm_str_ref(svm->registers[src].value.string);
 
+  if ((svm->registers[dst].type == STRING) && (svm->registers[dst].value.string))
+    svm_str_unref(svm->registers[dst].value.string);
 
-  /* if storing a string - then use strdup */
   if (svm->registers[src].type == STRING) {
     svm->registers[dst].type = STRING;
-    svm->registers[dst].value.string = strdup(svm->registers[src].value.string);
+    svm->registers[dst].value.string = svm->registers[src].value.string;
   } else
   {
     svm->registers[dst].type = svm->registers[src].type;
@@ -270,7 +321,7 @@ void op_int_store(svm_t *svm) {
 
   /* if the register stores a string .. free it */
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
-    free(svm->registers[reg].value.string);
+    svm_str_unref(svm->registers[reg].value.string);
 
   svm->registers[reg].value.number = value;
   svm->registers[reg].type = NUMBER;
@@ -296,7 +347,7 @@ void op_int_print(svm_t *svm) {
 
   if (getenv("DEBUG") != NULL)
     printf("[STDOUT] Register R%02d => %d [Hex:%04x]\n", reg, val, val);
-  else printf("0x%04X -> %d", val, val);
+  else print_int(svm, val);
 
 
   /* handle the next instruction */
@@ -318,11 +369,9 @@ void op_int_tostring(svm_t *svm) {
 
   /* allocate a buffer. */
   svm->registers[reg].type = STRING;
-  svm->registers[reg].value.string = malloc(10);
-
-  /* store the string-value */
-  memset(svm->registers[reg].value.string, '\0', 10);
-  sprintf(svm->registers[reg].value.string, "%d", cur);
+  char buf[12];
+  svm->registers[reg].value.string = svm_str_new(buf, svm_format_int(buf, cur));
+  if (!svm->registers[reg].value.string) svm_panic(svm, "out of memory");
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -344,12 +393,12 @@ void op_int_random(svm_t *svm) {
   * If we already have a string in the register delete it.
   */
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string)) {
-    free(svm->registers[reg].value.string);
+    svm_str_unref(svm->registers[reg].value.string);
   }
 
   /* set the value. */
   svm->registers[reg].type = NUMBER;
-  svm->registers[reg].value.number = rand() % 0xFFFF;
+  svm->registers[reg].value.number = svm_random(svm) % 0xFFFF;
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -371,7 +420,7 @@ void op_string_store(svm_t *svm) {
   * If we already have a string in the register delete it.
   */
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string)) {
-    free(svm->registers[reg].value.string);
+    svm_str_unref(svm->registers[reg].value.string);
   }
 
   /**
@@ -404,7 +453,7 @@ void op_string_print(svm_t *svm) {
 
   /* print */
   if (getenv("DEBUG") != NULL) printf("[stdout] register R%02d => %s\n", reg, str);
-  else printf("%s", str);
+  else svm_write(svm, str, svm_str_len(str));
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -421,11 +470,11 @@ void op_string_concat(svm_t *svm) {
 
   /* get the source register */
   unsigned int src1 = next_byte(svm);
-  BOUNDS_TEST_REG(reg);
+  BOUNDS_TEST_REG(src1);
 
   /* get the source register */
   unsigned int src2 = next_byte(svm);
-  BOUNDS_TEST_REG(reg);
+  BOUNDS_TEST_REG(src2);
 
   if (getenv("DEBUG") != NULL)
     printf("STRING_CONCAT (register:%d = Register:%d + Register:%d)\n",
@@ -438,25 +487,35 @@ void op_string_concat(svm_t *svm) {
   char *str2 = get_string_reg(svm, src2);
 
   /**
-  * Allocate RAM for two strings.
+  * Appending to an accumulator we hold the only reference to grows it in
+  * place, anything else builds a fresh string.
   */
-  int len = strlen(str1) + strlen(str2) + 1;
+  if (reg == src1 && SVM_STR(str1)->refs == 1) {
+    char *tmp = svm_str_append(str1, str2, svm_str_len(str2));
+    if (tmp == NULL) svm_panic(svm, "RAM allocation failure.");
+
+    svm->registers[reg].value.string = tmp;
+    svm->ip += 1;
+    return;
+  }
 
   /**
-  * Zero.
+  * Allocate RAM for two strings.
   */
-  char *tmp = malloc(len);
-  memset(tmp, '\0', len);
+  size_t len1 = svm_str_len(str1), len2 = svm_str_len(str2);
+  char *tmp = svm_str_alloc(len1 + len2);
+  if (tmp == NULL) svm_panic(svm, "RAM allocation failure.");
 
   /**
   * Assign.
   */
-  sprintf(tmp, "%s%s", str1, str2);
+  memcpy(tmp, str1, len1);
+  memcpy(tmp + len1, str2, len2);
 
 
   /* if the destination-register currently contains a string .. free it */
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
-    free(svm->registers[reg].value.string);
+    svm_str_unref(svm->registers[reg].value.string);
 
   svm->registers[reg].value.string = tmp;
   svm->registers[reg].type = STRING;
@@ -467,7 +526,7 @@ void op_string_concat(svm_t *svm) {
 
 
 /**
-* Invoke the C system() function against a string register.
+* Hand a string register to the SVM_HOST_SYSTEM host call.
 */
 void op_string_system(svm_t *svm) {
   /* get the reg */
@@ -480,16 +539,27 @@ void op_string_system(svm_t *svm) {
   /* Get the value we're to execute */
   char *str = get_string_reg(svm, reg);
 
+  /* handle the next instruction - a suspended vm resumes there */
+  svm->ip += 1;
+
   if (getenv("FUZZ") != NULL) {
     printf("Fuzzing - skipping execution of: %s\n", str);
     return;
   }
 
-  int result __attribute__((unused));
-  result = system(str);
+  svm_host_t *host = &svm->host[SVM_HOST_SYSTEM];
+  if (!host->fn) return;
 
-  /* handle the next instruction */
-  svm->ip += 1;
+  /* replays hand back the recorded status instead */
+  if (svm->trace && svm_trace_system(svm, str)) return;
+
+  /* keep our output ahead of whatever the command prints */
+  svm_output_flush(svm);
+
+  if (host->fn(svm, str, host->udata) == SVM_HOST_PENDING)
+    svm->suspended = 1;
+  else if (svm->trace)
+    svm_trace_status(svm, svm->host_status);
 }
 
 /**
@@ -508,7 +578,7 @@ void op_string_toint(svm_t *svm) {
   int i = atoi(str);
 
   /* free the old version */
-  free(svm->registers[reg].value.string);
+  svm_str_unref(svm->registers[reg].value.string);
 
   /* set the int. */
   svm->registers[reg].type = NUMBER;
@@ -519,6 +589,175 @@ void op_string_toint(svm_t *svm) {
 }
 
 
+/**
+* Store the hash of a string register in a register.
+*/
+void op_string_hash(svm_t *svm) {
+  /* get the destination register */
+  unsigned int reg = next_byte(svm);
+  BOUNDS_TEST_REG(reg);
+
+  /* get the source register */
+  unsigned int src = next_byte(svm);
+  BOUNDS_TEST_REG(src);
+
+  if (getenv("DEBUG") != NULL)
+    printf("STRING_HASH (register:%d = hash of register:%d)\n", reg, src);
+
+  unsigned int hash = svm_str_hash(get_string_reg(svm, src));
+
+  if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
+    svm_str_unref(svm->registers[reg].value.string);
+
+  svm->registers[reg].type = NUMBER;
+  svm->registers[reg].value.number = hash;
+
+  /* handle the next instruction */
+  svm->ip += 1;
+}
+
+
+/**
+* Set the Z-flag if the first string register starts with the second.
+*/
+void op_string_prefix(svm_t *svm) {
+  /* get the string register */
+  unsigned int reg = next_byte(svm);
+  BOUNDS_TEST_REG(reg);
+
+  /* get the prefix register */
+  unsigned int src = next_byte(svm);
+  BOUNDS_TEST_REG(src);
+
+  if (getenv("DEBUG") != NULL)
+    printf("STRING_PREFIX (does register:%d start with register:%d)\n", reg, src);
+
+  char *str = get_string_reg(svm, reg);
+  char *pre = get_string_reg(svm, src);
+  size_t len = svm_str_len(pre);
+
+  set_test(svm, (svm_str_len(str) >= len) && (memcmp(str, pre, len) == 0));
+
+  /* handle the next instruction */
+  svm->ip += 1;
+}
+
+
+/**
+* Store the offset of the first match of one string in another, or -1,
+* setting the Z-flag if there was a match.
+*/
+void op_string_find(svm_t *svm) {
+  /* get the destination register */
+  unsigned int reg = next_byte(svm);
+  BOUNDS_TEST_REG(reg);
+
+  /* get the string to search */
+  unsigned int src1 = next_byte(svm);
+  BOUNDS_TEST_REG(src1);
+
+  /* get the string to look for */
+  unsigned int src2 = next_byte(svm);
+  BOUNDS_TEST_REG(src2);
+
+  if (getenv("DEBUG") != NULL)
+    printf("STRING_FIND (register:%d = register:%d in register:%d)\n", reg, src2, src1);
+
+  char *hay = get_string_reg(svm, src1);
+  char *needle = get_string_reg(svm, src2);
+
+  /* libc's memmem is already vectorised */
+  const char *at = memmem(hay, svm_str_len(hay), needle, svm_str_len(needle));
+  int offset = at ? (int) (at - hay) : -1;
+
+  if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
+    svm_str_unref(svm->registers[reg].value.string);
+
+  svm->registers[reg].type = NUMBER;
+  svm->registers[reg].value.number = offset;
+  set_test(svm, at != NULL);
+
+  /* handle the next instruction */
+  svm->ip += 1;
+}
+
+
+/**
+* Jump to the entry matching a string register, or fall through.
+*/
+void op_string_switch(svm_t *svm) {
+  op_insn_t insn;
+  if (!op_decode(svm->code, 0xffff, svm->ip, &insn))
+    svm_panic(svm, "switch table runs past the end of memory");
+
+  unsigned int reg = insn.reg[0];
+  BOUNDS_TEST_REG(reg);
+
+  if (getenv("DEBUG") != NULL)
+    printf("STRING_SWITCH (register %d, %u entries)\n", reg, insn.count);
+
+  char *str = get_string_reg(svm, reg);
+  unsigned int hash = svm_str_hash(str);
+  size_t len = svm_str_len(str);
+
+  const unsigned char *entries = insn.str;
+  const unsigned char *pool = entries + insn.count * OP_SWITCH_ENTRY;
+
+  /* find the first entry with our hash */
+  unsigned int lo = 0, hi = insn.count;
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+    const unsigned char *e = entries + mid * OP_SWITCH_ENTRY;
+    unsigned int h = e[0] | (e[1] << 8) | (e[2] << 16) | ((unsigned int) e[3] << 24);
+    if (h < hash) lo = mid + 1;
+    else hi = mid;
+  }
+
+  for (; lo < insn.count; lo++) {
+    const unsigned char *e = entries + lo * OP_SWITCH_ENTRY;
+    unsigned int h = e[0] | (e[1] << 8) | (e[2] << 16) | ((unsigned int) e[3] << 24);
+    if (h != hash) break;
+
+    unsigned int elen = BYTES_TO_ADDR(e[4], e[5]);
+    unsigned int off = BYTES_TO_ADDR(e[6], e[7]);
+
+    if (elen == len && off + elen <= insn.imm && memcmp(pool + off, str, len) == 0) {
+      svm->ip = BYTES_TO_ADDR(e[8], e[9]);
+      return;
+    }
+  }
+
+  /* handle the next instruction */
+  svm->ip += insn.length;
+}
+
+
+/**
+* Jump through the table after the instruction, indexed by a register.
+*/
+void op_jump_table(svm_t *svm) {
+  op_insn_t insn;
+  if (!op_decode(svm->code, 0xffff, svm->ip, &insn))
+    svm_panic(svm, "jump table runs past the end of memory");
+
+  unsigned int reg = insn.reg[0];
+  BOUNDS_TEST_REG(reg);
+
+  unsigned int index = get_int_reg(svm, reg);
+
+  if (getenv("DEBUG") != NULL)
+    printf("JUMP_TABLE(register %d, index %u of %u)\n", reg, index, insn.count);
+
+  if (index < insn.count) {
+    svm->ip = op_table_target(&insn, index);
+    return;
+  }
+
+  /* handle the next instruction */
+  svm->ip += insn.length;
+}
+
+
 /**
 * Unconditional jump
 */
@@ -595,14 +834,165 @@ void op_jump_nz(svm_t *svm) {
 }
 
 
-MATH_OPERATION(op_math_add, +)    // reg_result = reg1 + reg2 ;
-MATH_OPERATION(op_math_and, &)   // reg_result = reg1 & reg2 ;
-MATH_OPERATION(op_math_sub, -)   // reg_result = reg1 - reg2 ;
-MATH_OPERATION(op_math_mul, *)   // reg_result = reg1 * reg2 ;
-MATH_OPERATION(op_math_xor, ^)   // reg_result = reg1 ^ reg2 ;
-MATH_OPERATION(op_math_rgt, >>)   // reg_result = reg1 >> reg2 ;
-MATH_OPERATION(op_math_lft, <<)   // reg_result = reg1 << reg2 ;
-MATH_OPERATION(op_math_or, |)    // reg_result = reg1 | reg2 ;
+/**
+* The relative jumps: the offset counts from the instruction after this
+* one, so they work wherever the code is put.
+*/
+void op_jump_to_rel(svm_t *svm) {
+  unsigned int off1 = next_byte(svm);
+  unsigned int off2 = next_byte(svm);
+  int offset = OP_REL_TARGET(svm->ip + 1, BYTES_TO_ADDR(off1, off2));
+
+  if (getenv("DEBUG") != NULL)
+    printf("JUMP_TO_REL(Offset:%d [Hex:%04X]\n", offset, offset);
+
+  svm->ip = offset;
+}
+
+
+void op_jump_z_rel(svm_t *svm) {
+  unsigned int off1 = next_byte(svm);
+  unsigned int off2 = next_byte(svm);
+  int offset = OP_REL_TARGET(svm->ip + 1, BYTES_TO_ADDR(off1, off2));
+
+  if (getenv("DEBUG") != NULL)
+    printf("JUMP_Z_REL(Offset:%d [Hex:%04X]\n", offset, offset);
+
+  if (svm->flags.z) svm->ip = offset;
+  else svm->ip += 1;
+}
+
+
+void op_jump_nz_rel(svm_t *svm) {
+  unsigned int off1 = next_byte(svm);
+  unsigned int off2 = next_byte(svm);
+  int offset = OP_REL_TARGET(svm->ip + 1, BYTES_TO_ADDR(off1, off2));
+
+  if (getenv("DEBUG") != NULL)
+    printf("JUMP_NZ_REL(Offset:%d [Hex:%04X]\n", offset, offset);
+
+  if (!svm->flags.z) svm->ip = offset;
+  else svm->ip += 1;
+}
+
+
+/**
+* Jump to the given address if the last compare or math op came out less
+* than (signed).
+*/
+void op_jump_lt(svm_t *svm) {
+  unsigned int off1 = next_byte(svm);
+  unsigned int off2 = next_byte(svm);
+  int offset = BYTES_TO_ADDR(off1, off2);
+
+  if (getenv("DEBUG") != NULL)
+    printf("JUMP_LT(Offset:%d [Hex:%04X]\n", offset, offset);
+
+  if (FLAGS_LT(svm->flags)) svm->ip = offset;
+  else {
+    /* handle the next instruction */
+    svm->ip += 1;
+  }
+}
+
+
+/**
+* Jump to the given address if the last compare or math op came out
+* greater than (signed).
+*/
+void op_jump_gt(svm_t *svm) {
+  unsigned int off1 = next_byte(svm);
+  unsigned int off2 = next_byte(svm);
+  int offset = BYTES_TO_ADDR(off1, off2);
+
+  if (getenv("DEBUG") != NULL)
+    printf("JUMP_GT(Offset:%d [Hex:%04X]\n", offset, offset);
+
+  if (FLAGS_GT(svm->flags)) svm->ip = offset;
+  else {
+    /* handle the next instruction */
+    svm->ip += 1;
+  }
+}
+
+
+/**
+* Compare a number register with an immediate and jump on the result, in
+* one instruction. The flags are left alone.
+*/
+#define JUMP_COMPARE(function,operator) void function(svm_t *svm) { \
+  unsigned int reg = next_byte(svm); \
+  BOUNDS_TEST_REG(reg); \
+  \
+  unsigned int val1 = next_byte(svm); \
+  unsigned int val2 = next_byte(svm); \
+  int val = BYTES_TO_ADDR(val1, val2); \
+  \
+  unsigned int off1 = next_byte(svm); \
+  unsigned int off2 = next_byte(svm); \
+  int offset = BYTES_TO_ADDR(off1, off2); \
+  \
+  if (getenv("DEBUG") != NULL) \
+    printf(#function "(register:%d " #operator " %d, Offset:%d [Hex:%04X])\n", reg, val, offset, offset); \
+  \
+  if (get_int_reg(svm, reg) operator val) svm->ip = offset; \
+  else { \
+    /* handle the next instruction */ \
+    svm->ip += 1; \
+  } \
+} \
+\
+void function##_unchecked(svm_t *svm) { \
+  const unsigned char *op = svm->code + svm->ip; \
+  int cur = svm->registers[op[1]].value.number; \
+  \
+  if (cur operator BYTES_TO_ADDR(op[2], op[3])) svm->ip = BYTES_TO_ADDR(op[4], op[5]); \
+  else svm->ip += 6; \
+}
+
+JUMP_COMPARE(op_jump_eq_imm, ==)
+JUMP_COMPARE(op_jump_ne_imm, !=)
+JUMP_COMPARE(op_jump_lt_imm, <)
+JUMP_COMPARE(op_jump_gt_imm, >)
+
+
+/* shifts only look at the low five bits of the count */
+MATH_OPERATION(op_math_add, +, ARITH_FLAGS, ~0u, unsigned int)    // reg_result = reg1 + reg2 ;
+MATH_OPERATION(op_math_and, &, LOGIC_FLAGS, ~0u, unsigned int)   // reg_result = reg1 & reg2 ;
+MATH_OPERATION(op_math_sub, -, ARITH_FLAGS, ~0u, unsigned int)   // reg_result = reg1 - reg2 ;
+MATH_OPERATION(op_math_mul, *, ARITH_FLAGS, ~0u, unsigned int)   // reg_result = reg1 * reg2 ;
+MATH_OPERATION(op_math_xor, ^, LOGIC_FLAGS, ~0u, unsigned int)   // reg_result = reg1 ^ reg2 ;
+MATH_OPERATION(op_math_rgt, >>, LOGIC_FLAGS, 31u, int)   // reg_result = reg1 >> reg2, keeping the sign ;
+MATH_OPERATION(op_math_lft, <<, LOGIC_FLAGS, 31u, unsigned int)   // reg_result = reg1 << reg2 ;
+MATH_OPERATION(op_math_or, |, LOGIC_FLAGS, ~0u, unsigned int)    // reg_result = reg1 | reg2 ;
+
+
+/**
+* Store the bitwise complement of one (number) register in another.
+*/
+void op_math_not(svm_t *svm) {
+  unsigned int reg = next_byte(svm);
+  BOUNDS_TEST_REG(reg);
+
+  unsigned int src = next_byte(svm);
+  BOUNDS_TEST_REG(src);
+
+  if (getenv("DEBUG") != NULL)
+    printf("NOT_OP (register: %d = ~register: %d)\n", reg, src);
+
+  unsigned int val = get_int_reg(svm, src);
+
+  if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
+    svm_str_unref(svm->registers[reg].value.string);
+
+  svm->registers[reg].value.number = ~val;
+  svm->registers[reg].type = NUMBER;
+  LOGIC_FLAGS(~, val, 0, svm->registers[reg].value.number);
+
+  /* handle the next instruction */
+  svm->ip += 1;
+}
+
 /**
 * Increment the given (number) register.
 */
@@ -616,11 +1006,8 @@ void op_math_inc(svm_t *svm) {
 
   /* get, incr, set */
   int cur = get_int_reg(svm, reg);
-  cur += 1;
-  svm->registers[reg].value.number = cur;
-
-  if (svm->registers[reg].value.number == 0) svm->flags.z = 1;
-  else svm->flags.z = 0;
+  svm->registers[reg].value.number = cur + 1u;
+  ARITH_FLAGS(+, cur, 1, svm->registers[reg].value.number);
 
 
   /* handle the next instruction */
@@ -640,11 +1027,8 @@ void op_math_dec(svm_t *svm) {
 
   /* get, decr, set */
   int cur = get_int_reg(svm, reg);
-  cur -= 1;
-  svm->registers[reg].value.number = cur;
-
-  if (svm->registers[reg].value.number == 0) svm->flags.z = 1;
-  else svm->flags.z = 0;
+  svm->registers[reg].value.number = cur - 1u;
+  ARITH_FLAGS(-, cur, 1, svm->registers[reg].value.number);
 
 
   /* handle the next instruction */
@@ -667,23 +1051,23 @@ void op_cmp_reg(svm_t *svm) {
   if (getenv("DEBUG") != NULL)
       printf("CMP (register:%d vs Register:%d)\n", reg1, reg2);
 
-  svm->flags.z = 0;
+  set_test(svm, 0);
 
   if (svm->registers[reg1].type == svm->registers[reg2].type) {
     if (svm->registers[reg1].type == STRING) {
-      if (strcmp(svm->registers[reg1].value.string,
-          svm->registers[reg2].value.string) == 0)
-          svm->flags.z = 1;
-        } else {
-          if (svm->registers[reg1].value.number ==
-            svm->registers[reg2].value.number)
-            svm->flags.z = 1;
-          }
-        }
+      set_test(svm, svm_str_equal(svm->registers[reg1].value.string,
+                                  svm->registers[reg2].value.string));
+    } else {
+      /* numbers compare as a subtraction, for the ordered jumps */
+      int a = svm->registers[reg1].value.number;
+      int b = svm->registers[reg2].value.number;
+      ARITH_FLAGS(-, a, b, (unsigned int) a - b);
+    }
+  }
 
-        /* handle the next instruction */
-        svm->ip += 1;
-      }
+  /* handle the next instruction */
+  svm->ip += 1;
+}
 
 
 /**
@@ -702,12 +1086,8 @@ void op_cmp_immediate(svm_t *svm) {
   if (getenv("DEBUG") != NULL)
     printf("CMP_IMMEDIATE (register:%d vs %d [Hex:%04X])\n", reg, val, val);
 
-  svm->flags.z = 0;
-
   int cur = (int) get_int_reg(svm, reg);
-
-  if (cur == val)
-    svm->flags.z = 1;
+  ARITH_FLAGS(-, cur, val, (unsigned int) cur - val);
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -722,21 +1102,25 @@ void op_cmp_string(svm_t *svm) {
   unsigned int reg = next_byte(svm);
   BOUNDS_TEST_REG(reg);
 
-  /* Now we get the string to compare against from the stack */
-  char *str = string_from_stack(svm);
+  /* the string to compare against follows its length */
+  unsigned int len1 = next_byte(svm);
+  unsigned int len2 = next_byte(svm);
+  unsigned int len = BYTES_TO_ADDR(len1, len2);
+
+  if (svm->ip + 1 + len > 0xffff) svm_panic(svm, "string runs past the end of memory");
+  const char *str = (const char *) svm->code + svm->ip + 1;
 
   /* get the string value from the register */
   char *cur = get_string_reg(svm, reg);
 
   if (getenv("DEBUG") != NULL)
-    printf("Comparing register-%d ('%s') - with string '%s'\n", reg, cur, str);
+    printf("Comparing register-%d ('%s') - with string '%.*s'\n", reg, cur, (int) len, str);
 
-  /* compare */
-  if (strcmp(cur, str) == 0) svm->flags.z = 1;
-  else svm->flags.z = 0;
+  /* compare, the length usually settles it */
+  set_test(svm, svm_str_len(cur) == len && memcmp(cur, str, len) == 0);
 
   /* handle the next instruction */
-  svm->ip += 1;
+  svm->ip += 1 + len;
 }
 
 
@@ -750,8 +1134,7 @@ void op_is_string(svm_t *svm) {
 
   if (getenv("DEBUG") != NULL) printf("is register %02X a string?\n", reg);
 
-  if (svm->registers[reg].type == STRING) svm->flags.z = 1;
-  else svm->flags.z = 0;
+  set_test(svm, svm->registers[reg].type == STRING);
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -769,8 +1152,7 @@ void op_is_number(svm_t *svm) {
   if (getenv("DEBUG") != NULL)
     printf("is register %02X an number?\n", reg);
 
-  if (svm->registers[reg].type == NUMBER) svm->flags.z = 1;
-  else svm->flags.z = 0;
+  set_test(svm, svm->registers[reg].type == NUMBER);
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -802,7 +1184,7 @@ void op_peek(svm_t *svm) {
 
   /* if the destination currently contains a string .. free it */
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
-    free(svm->registers[reg].value.string);
+    svm_str_unref(svm->registers[reg].value.string);
 
   svm->registers[reg].value.number = val;
   svm->registers[reg].type = NUMBER;
@@ -835,9 +1217,12 @@ void op_poke(svm_t *svm) {
 
   if (adr < 0 || adr > 0xffff)
     svm_panic(svm, "Writing outside RAM");
+  if ((unsigned int) adr < svm->data)
+    svm_panic(svm, "Writing to the code segment");
 
   /* do the necessary */
   svm->code[adr] = val;
+  SVM_DIRTY(svm, adr);
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -898,38 +1283,76 @@ void op_memcpy(svm_t *svm) {
       printf("\tCopying from: %04x Copying-to %04X\n", sc, dt);
     }
 
+    if ((unsigned int) dt < svm->data)
+      svm_panic(svm, "Writing to the code segment");
+
     svm->code[dt] = svm->code[sc];
+    SVM_DIRTY(svm, dt);
   }
 
   /* handle the next instruction */
   svm->ip += 1;
 }
 
+
 /**
-* Push the values of a given register onto the stack.
+* Fill memory with random bytes, a word from the generator at a time.
+*/
+void op_random_fill(svm_t *svm) {
+  /* get the register with the address */
+  unsigned int dest_reg = next_byte(svm);
+  BOUNDS_TEST_REG(dest_reg);
+
+  /* get the register with the size */
+  unsigned int size_reg = next_byte(svm);
+  BOUNDS_TEST_REG(size_reg);
+
+  int dest = get_int_reg(svm, dest_reg);
+  int size = get_int_reg(svm, size_reg);
+
+  if (dest < 0) svm_panic(svm, "cannot fill from a negative address");
+
+  if (getenv("DEBUG") != NULL)
+    printf("Filling %4x bytes from %04x with random bytes\n", size, dest);
+
+  /* wraps around like MEMCPY */
+  unsigned int dt = dest % 0xFFFF;
+  for (int i = 0; i < size; i += 4) {
+    unsigned int word = svm_random(svm);
+    for (int b = 0; b < 4 && i + b < size; b++) {
+      if (dt < svm->data) svm_panic(svm, "Writing to the code segment");
+      svm->code[dt] = word >> (8 * b);
+      SVM_DIRTY(svm, dt);
+      if (++dt == 0xFFFF) dt = 0;
+    }
+  }
+
+  /* handle the next instruction */
+  svm->ip += 1;
+}
+
+/**
+* Push the values of a given register onto the stack. Strings are shared
+* with the register rather than copied.
 */
 void op_stack_push(svm_t *svm) {
   /* get the register to push */
   unsigned int reg = next_byte(svm);
   BOUNDS_TEST_REG(reg);
 
-  /* Get the value we're to store. */
-  int val = get_int_reg(svm, reg);
+  reg_t *src = &svm->registers[reg];
 
-  if (getenv("DEBUG") != NULL)
-    printf("PUSH (register %d [=%04x])\n", reg, val);
+  if (getenv("DEBUG") != NULL) {
+    if (src->type == STRING) printf("PUSH (register %d [='%s'])\n", reg, src->value.string);
+    else printf("PUSH (register %d [=%04x])\n", reg, src->value.number);
+  }
 
-  /* store it */
+  /* store it - running into the guard page past the limit panics */
   svm->sp += 1;
-  svm->stack[svm->sp] = val;
-
-  /**
-  * Ensure the stack hasn't overflown.
-  */
-  int sp_size = sizeof(svm->stack) / sizeof(svm->stack[0]);
-  if (svm->sp >= sp_size)
-    svm_panic(svm, "stack overflow - stack is full");
-
+  reg_t *slot = &svm->stack.base[svm->sp];
+  slot->type = src->type;
+  slot->value = src->value;
+  if (src->type == STRING) svm_str_ref(src->value.string);
 
   /* handle the next instruction */
   svm->ip += 1;
@@ -948,20 +1371,22 @@ void op_stack_pop(svm_t *svm) {
   if (svm->sp <= 0)
     svm_panic(svm, "stack overflow - stack is empty");
 
-  /* Get the value from the stack. */
-  int val = svm->stack[svm->sp];
+  /* Get the value from the stack, its reference moves to the register. */
+  reg_t *slot = &svm->stack.base[svm->sp];
   svm->sp -= 1;
 
-  if (getenv("DEBUG") != NULL)
-    printf("POP (register %d) => %04x\n", reg, val);
+  if (getenv("DEBUG") != NULL) {
+    if (slot->type == STRING) printf("POP (register %d) => '%s'\n", reg, slot->value.string);
+    else printf("POP (register %d) => %04x\n", reg, slot->value.number);
+  }
 
 
   /* if the register stores a string .. free it */
   if ((svm->registers[reg].type == STRING) && (svm->registers[reg].value.string))
-    free(svm->registers[reg].value.string);
+    svm_str_unref(svm->registers[reg].value.string);
 
-  svm->registers[reg].value.number = val;
-  svm->registers[reg].type = NUMBER;
+  svm->registers[reg].value = slot->value;
+  svm->registers[reg].type = slot->type;
 
 
   /* handle the next instruction */
@@ -979,9 +1404,19 @@ void op_stack_ret(svm_t *svm) {
     svm_panic(svm, "stack overflow - stack is empty");
 
   /* Get the value from the stack. */
-  int val = svm->stack[svm->sp];
+  reg_t *slot = &svm->stack.base[svm->sp];
   svm->sp -= 1;
 
+  if (slot->type != NUMBER) {
+    svm_str_unref(slot->value.string);
+    svm_panic(svm, "return address is not a number");
+    return;
+  }
+
+  int val = slot->value.number;
+
+  if (svm->stack.record) svm_frame_pop(svm);
+
   if (getenv("DEBUG") != NULL)
     printf("RET() => %04x\n", val);
 
@@ -995,7 +1430,34 @@ void op_stack_ret(svm_t *svm) {
 /**
 * Call a routine - push the return address onto the stack.
 */
+/**
+* Push the return address, the instruction after the call at `site`, and
+* go to `offset`.
+*/
+static void call_to(svm_t *svm, unsigned int site, int offset) {
+  /**
+  * Now we've got to save the address past this instruction
+  * on the stack so that the "ret(urn)" instruction will go
+  * to the correct place.
+  */
+  svm->sp += 1;
+
+
+  svm->stack.base[svm->sp].type = NUMBER;
+  svm->stack.base[svm->sp].value.number = svm->ip + 1;
+
+  if (svm->stack.record) svm_frame_push(svm, site, offset);
+
+  /**
+  * Now we've saved the return-address we can update the IP
+  */
+  svm->ip = offset;
+}
+
+
 void op_stack_call(svm_t *svm) {
+  unsigned int site = svm->ip;
+
   /**
   * Read the two bytes which will build up the destination
   */
@@ -1007,26 +1469,19 @@ void op_stack_call(svm_t *svm) {
   */
   int offset = BYTES_TO_ADDR(off1, off2);
 
+  call_to(svm, site, offset);
+}
 
-  int sp_size = sizeof(svm->stack) / sizeof(svm->stack[0]);
-  if (svm->sp >= sp_size)
-    svm_panic(svm, "stack overflow - stack is full!");
-
-  /**
-  * Now we've got to save the address past this instruction
-  * on the stack so that the "ret(urn)" instruction will go
-  * to the correct place.
-  */
-  svm->sp += 1;
-
-
-  svm->stack[svm->sp] = svm->ip + 1;
 
-  /**
-  * Now we've saved the return-address we can update the IP
-  */
-  svm->ip = offset;
+/**
+* Call a routine relative to the instruction after the call.
+*/
+void op_stack_call_rel(svm_t *svm) {
+  unsigned int site = svm->ip;
+  unsigned int off1 = next_byte(svm);
+  unsigned int off2 = next_byte(svm);
 
+  call_to(svm, site, OP_REL_TARGET(svm->ip + 1, BYTES_TO_ADDR(off1, off2)));
 }
 
 /**
@@ -1035,71 +1490,390 @@ void op_stack_call(svm_t *svm) {
 **/
 
 
+/**
+** Unchecked variants of the hot op_codes.
+**
+** These are only installed by the verifier (see verify.c) once it has proven
+** that every register operand is in bounds, every register holds the type
+** the op_code expects and that the code can't be modified while running.
+** They read their operands straight out of the code and skip the tracing.
+**/
+
+
+void op_int_store_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  reg_t *dst = &svm->registers[op[1]];
+
+  if ((dst->type == STRING) && (dst->value.string))
+    svm_str_unref(dst->value.string);
+
+  dst->value.number = BYTES_TO_ADDR(op[2], op[3]);
+  dst->type = NUMBER;
+
+  svm->ip += 4;
+}
+
+
+void op_int_print_unchecked(svm_t *svm) {
+  print_int(svm, svm->registers[svm->code[svm->ip + 1]].value.number);
+
+  svm->ip += 2;
+}
+
+
+void op_jump_to_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  svm->ip = BYTES_TO_ADDR(op[1], op[2]);
+}
+
+
+void op_jump_z_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  if (svm->flags.z) svm->ip = BYTES_TO_ADDR(op[1], op[2]);
+  else svm->ip += 3;
+}
+
+
+void op_jump_nz_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  if (!svm->flags.z) svm->ip = BYTES_TO_ADDR(op[1], op[2]);
+  else svm->ip += 3;
+}
+
+
+void op_jump_to_rel_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  svm->ip = OP_REL_TARGET(svm->ip + 3, BYTES_TO_ADDR(op[1], op[2]));
+}
+
+
+void op_jump_z_rel_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  if (svm->flags.z) svm->ip = OP_REL_TARGET(svm->ip + 3, BYTES_TO_ADDR(op[1], op[2]));
+  else svm->ip += 3;
+}
+
+
+void op_jump_nz_rel_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  if (!svm->flags.z) svm->ip = OP_REL_TARGET(svm->ip + 3, BYTES_TO_ADDR(op[1], op[2]));
+  else svm->ip += 3;
+}
+
+
+void op_jump_lt_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  if (FLAGS_LT(svm->flags)) svm->ip = BYTES_TO_ADDR(op[1], op[2]);
+  else svm->ip += 3;
+}
+
+
+void op_jump_gt_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  if (FLAGS_GT(svm->flags)) svm->ip = BYTES_TO_ADDR(op[1], op[2]);
+  else svm->ip += 3;
+}
+
+
+void op_math_inc_unchecked(svm_t *svm) {
+  reg_t *reg = &svm->registers[svm->code[svm->ip + 1]];
+  int cur = reg->value.number;
+  reg->value.number += 1;
+  ARITH_FLAGS(+, cur, 1, reg->value.number);
+
+  svm->ip += 2;
+}
+
+
+void op_math_dec_unchecked(svm_t *svm) {
+  reg_t *reg = &svm->registers[svm->code[svm->ip + 1]];
+  int cur = reg->value.number;
+  reg->value.number -= 1;
+  ARITH_FLAGS(-, cur, 1, reg->value.number);
+
+  svm->ip += 2;
+}
+
+
+void op_math_not_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  reg_t *dst = &svm->registers[op[1]];
+  unsigned int val = svm->registers[op[2]].value.number;
+
+  if ((dst->type == STRING) && (dst->value.string))
+    svm_str_unref(dst->value.string);
+
+  dst->value.number = ~val;
+  dst->type = NUMBER;
+  LOGIC_FLAGS(~, val, 0, dst->value.number);
+
+  svm->ip += 3;
+}
+
+
+void op_string_store_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  reg_t *dst = &svm->registers[op[1]];
+  int len = BYTES_TO_ADDR(op[2], op[3]);
+
+  char *str = svm_str_new((const char *) op + 4, len);
+  if (str == NULL) svm_panic(svm, "RAM allocation failure.");
+
+  if ((dst->type == STRING) && (dst->value.string))
+    svm_str_unref(dst->value.string);
+
+  dst->type = STRING;
+  dst->value.string = str;
+
+  svm->ip += 4 + len;
+}
+
+
+void op_string_print_unchecked(svm_t *svm) {
+  const char *str = svm->registers[svm->code[svm->ip + 1]].value.string;
+  svm_write(svm, str, svm_str_len(str));
+
+  svm->ip += 2;
+}
+
+
+void op_cmp_reg_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  reg_t *reg1 = &svm->registers[op[1]];
+  reg_t *reg2 = &svm->registers[op[2]];
+
+  set_test(svm, 0);
+
+  if (reg1->type == reg2->type) {
+    if (reg1->type == STRING) {
+      set_test(svm, svm_str_equal(reg1->value.string, reg2->value.string));
+    } else {
+      int a = reg1->value.number, b = reg2->value.number;
+      ARITH_FLAGS(-, a, b, (unsigned int) a - b);
+    }
+  }
+
+  svm->ip += 3;
+}
+
+
+void op_cmp_immediate_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  int cur = svm->registers[op[1]].value.number;
+  int val = BYTES_TO_ADDR(op[2], op[3]);
+
+  ARITH_FLAGS(-, cur, val, (unsigned int) cur - val);
+
+  svm->ip += 4;
+}
+
+
+void op_reg_store_unchecked(svm_t *svm) {
+  const unsigned char *op = svm->code + svm->ip;
+  reg_t *dst = &svm->registers[op[1]];
+  reg_t *src = &svm->registers[op[2]];
+
+  if (dst != src) {
+    if ((dst->type == STRING) && (dst->value.string))
+      svm_str_unref(dst->value.string);
+
+    dst->type = src->type;
+    if (src->type == STRING) dst->value.string = svm_str_ref(src->value.string);
+    else dst->value.number = src->value.number;
+  }
+
+  svm->ip += 3;
+}
+
 
 /**
-* Map the op_codes to the handlers.
+* Operand layout of every op_code the interpreter knows about, anything
+* not listed here is handled by op_unknown and is a single byte.
 */
-void op_code_init(svm_t * svm) {
-  /**
-  * Initialize the random seed for the rendom opcode (INT_RANDOM)
-  */
-  srand(time(NULL));
+static const op_format_t op_formats[256] = {
+#define OP(name, value, format, handler, unchecked, mnemonic) [name] = format,
+#include "op_list.h"
+#undef OP
+};
 
-  /**
-  * All instructions will default to unknown.
-  */
-  for (int i = 0; i <= 255; i++)
-  svm->op_codes[i] = op_unknown;
-
-  /* early op_codes */
-  svm->op_codes[EXIT] = op_exit;
-  svm->op_codes[INT_STORE] = op_int_store;
-  svm->op_codes[INT_PRINT] = op_int_print;
-  svm->op_codes[INT_TOSTRING] = op_int_tostring;
-  svm->op_codes[INT_RANDOM] = op_int_random;
-
-  /* jumps */
-  svm->op_codes[JUMP_TO] = op_jump_to;
-  svm->op_codes[JUMP_NZ] = op_jump_nz;
-  svm->op_codes[JUMP_Z] = op_jump_z;
-
-  /* math */
-  svm->op_codes[MATH_ADD] = op_math_add;
-  svm->op_codes[MATH_AND] = op_math_and;
-  svm->op_codes[MATH_SUB] = op_math_sub;
-  svm->op_codes[MATH_MUL] = op_math_mul;
-  svm->op_codes[MATH_DIV] = op_math_div;
-  svm->op_codes[MATH_XOR] = op_math_xor;
-  svm->op_codes[MATH_OR]  = op_math_or;
-  svm->op_codes[MATH_INC] = op_math_inc;
-  svm->op_codes[MATH_DEC] = op_math_dec;
-
-  /* strings */
-  svm->op_codes[STRING_STORE] = op_string_store;
-  svm->op_codes[STRING_PRINT] = op_string_print;
-  svm->op_codes[STRING_CONCAT] = op_string_concat;
-  svm->op_codes[STRING_SYSTEM] = op_string_system;
-  svm->op_codes[STRING_TOINT] = op_string_toint;
-
-  /* comparisons/tests */
-  svm->op_codes[CMP_REG] = op_cmp_reg;
-  svm->op_codes[CMP_IMMEDIATE] = op_cmp_immediate;
-  svm->op_codes[CMP_STRING] = op_cmp_string;
-  svm->op_codes[IS_STRING] = op_is_string;
-  svm->op_codes[IS_NUMBER] = op_is_number;
-
-  /* misc */
-  svm->op_codes[NOP] = op_nop;
-  svm->op_codes[STORE_REG] = op_reg_store;
-
-  /* PEEK/POKE */
-  svm->op_codes[PEEK] = op_peek;
-  svm->op_codes[POKE] = op_poke;
-  svm->op_codes[MEMCPY] = op_memcpy;
-
-  /* stack */
-  svm->op_codes[STACK_PUSH] = op_stack_push;
-  svm->op_codes[STACK_POP] = op_stack_pop;
-  svm->op_codes[STACK_RET] = op_stack_ret;
-  svm->op_codes[STACK_CALL] = op_stack_call;
+
+/**
+* The dispatch tables, shared by every vm. Gaps are NULL and run
+* op_unknown.
+*/
+static const op_code_t op_checked[256] = {
+#define OP(name, value, format, handler, unchecked, mnemonic) [name] = handler,
+#include "op_list.h"
+#undef OP
+};
+
+static const op_code_t op_verified[256] = {
+#define OP(name, value, format, handler, unchecked, mnemonic) [name] = unchecked,
+#include "op_list.h"
+#undef OP
+};
+
+
+op_format_t op_format(unsigned char opcode) {
+  return op_formats[opcode];
+}
+
+
+const char *op_mnemonic(unsigned char opcode) {
+  static const char *mnemonics[256] = {
+#define OP(name, value, format, handler, unchecked, mnemonic) [name] = mnemonic,
+#include "op_list.h"
+#undef OP
+  };
+
+  return mnemonics[opcode];
+}
+
+
+int op_is_builtin(unsigned char opcode) {
+  return op_checked[opcode] != NULL;
+}
+
+
+/**
+ * A hash of every opcode's name, value, layout and mnemonic. Anything
+ * built against one opcode table and stored, like a cached image, is
+ * only good while this stays the same.
+ */
+unsigned int op_table_version(void) {
+  static const char table[] =
+#define OP(name, value, format, handler, unchecked, mnemonic) \
+  #name " " #value " " #format " " mnemonic "\n"
+#include "op_list.h"
+#undef OP
+  ;
+
+  return svm_hash_bytes(table, sizeof(table) - 1);
+}
+
+
+int op_decode(const unsigned char *code, unsigned int size, unsigned int addr, op_insn_t *insn) {
+  if (addr >= size) return 0;
+  return op_decode_as(code, size, addr, op_formats[code[addr]], insn);
+}
+
+
+int op_decode_as(const unsigned char *code, unsigned int size, unsigned int addr,
+                 op_format_t format, op_insn_t *insn) {
+  static const unsigned int lengths[] = {
+    [OPF_NONE] = 1, [OPF_R] = 2, [OPF_RR] = 3, [OPF_RRR] = 4,
+    [OPF_RI] = 4, [OPF_I] = 3, [OPF_RS] = 4, [OPF_SWITCH] = 6,
+    [OPF_TABLE] = 4, [OPF_RIA] = 6, [OPF_REL] = 3
+  };
+
+  if (addr >= size) return 0;
+
+  memset(insn, '\0', sizeof(*insn));
+  insn->addr = addr;
+  insn->opcode = code[addr];
+  insn->format = format;
+  insn->length = lengths[insn->format];
+
+  if (addr + insn->length > size) return 0;
+  const unsigned char *op = code + addr;
+
+  switch (insn->format) {
+    case OPF_RRR: insn->reg[2] = op[3]; insn->nreg++; /* fallthrough */
+    case OPF_RR: insn->reg[1] = op[2]; insn->nreg++; /* fallthrough */
+    case OPF_R: insn->reg[0] = op[1]; insn->nreg++; break;
+
+    case OPF_RI:
+      insn->reg[0] = op[1]; insn->nreg = 1;
+      insn->imm = BYTES_TO_ADDR(op[2], op[3]);
+      break;
+
+    case OPF_I:
+      insn->imm = BYTES_TO_ADDR(op[1], op[2]);
+      break;
+
+    case OPF_REL:
+      insn->imm = OP_REL_TARGET(addr + 3, BYTES_TO_ADDR(op[1], op[2]));
+      break;
+
+    case OPF_RIA:
+      insn->reg[0] = op[1]; insn->nreg = 1;
+      insn->arg = BYTES_TO_ADDR(op[2], op[3]);
+      insn->imm = BYTES_TO_ADDR(op[4], op[5]);
+      break;
+
+    case OPF_RS:
+      insn->reg[0] = op[1]; insn->nreg = 1;
+      insn->imm = BYTES_TO_ADDR(op[2], op[3]);
+      insn->str = op + 4;
+      insn->length += insn->imm;
+      if (addr + insn->length > size) return 0;
+      break;
+
+    case OPF_SWITCH:
+      insn->reg[0] = op[1]; insn->nreg = 1;
+      insn->count = BYTES_TO_ADDR(op[2], op[3]);
+      insn->imm = BYTES_TO_ADDR(op[4], op[5]);
+      insn->str = op + 6;
+      insn->length += insn->count * OP_SWITCH_ENTRY + insn->imm;
+      if (addr + insn->length > size) return 0;
+      break;
+
+    case OPF_TABLE:
+      insn->reg[0] = op[1]; insn->nreg = 1;
+      insn->count = BYTES_TO_ADDR(op[2], op[3]);
+      insn->str = op + 4;
+      insn->length += insn->count * OP_TABLE_ENTRY;
+      if (addr + insn->length > size) return 0;
+      break;
+
+    case OPF_NONE: break;
+  }
+
+  return 1;
+}
+
+
+unsigned int op_table_size(const op_insn_t *insn) {
+  switch (insn->format) {
+    case OPF_SWITCH: case OPF_TABLE: return insn->count;
+    default: return 0;
+  }
+}
+
+
+/* the i-th target's addr16, from the end of the fixed operands */
+static unsigned int table_entry(const op_insn_t *insn, unsigned int i) {
+  if (insn->format == OPF_TABLE) return i * OP_TABLE_ENTRY;
+  return i * OP_SWITCH_ENTRY + 8;
+}
+
+
+/* the same, from the start of the instruction */
+unsigned int op_table_offset(const op_insn_t *insn, unsigned int i) {
+  return (insn->format == OPF_TABLE ? 4 : 6) + table_entry(insn, i);
+}
+
+
+unsigned int op_table_target(const op_insn_t *insn, unsigned int i) {
+  const unsigned char *a = insn->str + table_entry(insn, i);
+  return BYTES_TO_ADDR(a[0], a[1]);
+}
+
+
+
+
+/**
+* Run the checked handlers.
+*/
+void op_code_init(svm_t *svm) {
+  svm->op_codes = op_checked;
+}
+
+
+/**
+* Swap the checked handlers for their unchecked variants, only safe once
+* the program has been verified.
+*/
+void op_code_unchecked(svm_t *svm) {
+  svm->op_codes = op_verified;
 }
@@ -11,122 +11,95 @@
 #include "svm.h"
 
 enum op_code_values {
-  /* early opcodes */
-  EXIT = 0x00,
-
-  INT_STORE,
-  INT_PRINT,
-  INT_TOSTRING,
-  INT_RANDOM,
-
-  /* jump operations */
-  JUMP_TO = 0x10,
-  JUMP_Z,
-  JUMP_NZ,
-
-  /* math operations */
-  MATH_XOR = 0x20,
-  MATH_ADD,
-  MATH_SUB,
-  MATH_MUL,
-  MATH_DIV,
-  MATH_INC,
-  MATH_DEC,
-  MATH_AND,
-  MATH_OR,
-  MATH_LFT,
-  MATH_RGT,
-  MATH_NOT,
-
-  /* tring operations */
-  STRING_STORE = 0x30,
-  STRING_PRINT,
-  STRING_CONCAT,
-  STRING_SYSTEM,
-  STRING_TOINT,
-
-  /* comparison/test operations */
-  CMP_REG = 0x40,
-  CMP_IMMEDIATE,
-  CMP_STRING,
-  IS_STRING,
-  IS_NUMBER,
-
-  /* misc */
-  NOP = 0x50,
-  STORE_REG,
-
-  /* peek/poke operations */
-  PEEK = 0x60,
-  POKE,
-  MEMCPY,
-
-  /* stack operations */
-  STACK_PUSH = 0x70,
-  STACK_POP,
-  STACK_RET,
-  STACK_CALL
+#define OP(name, value, format, handler, unchecked, mnemonic) name = value,
+#include "op_list.h"
+#undef OP
 };
 
-/* 0x00 - 0x0F */
-void op_exit(svm_t *in);
-void op_int_store(svm_t *in);
-void op_int_print(svm_t *in);
-void op_int_tostring(svm_t *in);
-void op_int_random(svm_t *in);
-
-/* 0x10 - 0x1F */
-void op_jump_to(svm_t *in);
-void op_jump_z(svm_t *in);
-void op_jump_nz(svm_t *in);
-
-/* 0x20 - 0x2F */
-void op_math_xor(svm_t *in);
-void op_math_rgt(svm_t *in);
-void op_math_lft(svm_t *in);
-void op_math_or(svm_t *in);
-void op_math_add(svm_t *in);
-void op_math_and(svm_t *in);
-void op_math_sub(svm_t *in);
-void op_math_mul(svm_t *in);
-void op_math_div(svm_t *in);
-void op_math_inc(svm_t *in);
-void op_math_dec(svm_t *in);
-
-/* 0x30 - 0x3F */
-void op_string_store(svm_t *in);
-void op_string_print(svm_t *in);
-void op_string_concat(svm_t *in);
-void op_string_system(svm_t *in);
-void op_string_toint(svm_t *in);
-
-/* 0x40 - 0x4F */
-void op_cmp_reg(svm_t *in);
-void op_cmp_immediate(svm_t *in);
-void op_cmp_string(svm_t *in);
-void op_is_string(svm_t *in);
-void op_is_integer(svm_t *in);
-
-/* 0x50 - 0x5F */
-void op_nop(svm_t *in);
-void op_reg_store(svm_t *in);
-
-
-/* 0x60 - 0x6F */
-void op_peek(svm_t *in);
-void op_poke(svm_t *in);
-void op_memcpy(svm_t *in);
-
-
-/* 0x70 - 0x7F */
-void op_stack_push(svm_t *in);
-void op_stack_pop(svm_t *in);
-void op_stack_ret(svm_t *in);
-void op_stack_call(svm_t *in);
-
-
-
-/* initialization function */
+/* operand layouts following the opcode byte */
+typedef enum {
+  OPF_NONE,   /* op */
+  OPF_R,      /* op reg */
+  OPF_RR,     /* op reg reg */
+  OPF_RRR,    /* op reg reg reg */
+  OPF_RI,     /* op reg imm16 */
+  OPF_I,      /* op addr16 */
+  OPF_RS,     /* op reg len16 bytes[len] */
+  OPF_SWITCH, /* op reg count16 pool16 entry[count] bytes[pool] */
+  OPF_TABLE,  /* op reg count16 addr16[count] */
+  OPF_RIA,    /* op reg imm16 addr16 */
+  OPF_REL     /* op rel16 */
+} op_format_t;
+
+typedef struct op_insn_t op_insn_t;
+
+/* a single decoded instruction */
+struct op_insn_t {
+  unsigned int addr;
+  unsigned int length;
+  unsigned char opcode;
+  op_format_t format;
+  unsigned char reg[3];
+  unsigned int nreg;
+  unsigned int imm;         /* the target, for anything that jumps, relative or not */
+  unsigned int arg;         /* OPF_RIA immediate */
+  const unsigned char *str;
+  unsigned int count;       /* OPF_SWITCH/OPF_TABLE entries */
+};
+
+/**
+ * A rel16 counts from the end of its instruction, modulo 64K, so the
+ * code holding it can be placed anywhere without changing it.
+ */
+#define OP_REL_TARGET(next, rel) (((next) + (rel)) & 0xffff)
+#define OP_REL_OFFSET(next, target) (((target) - (next)) & 0xffff)
+
+/**
+ * STRING_SWITCH entries are {hash32 len16 offset16 addr16}, sorted by hash,
+ * with each string at `offset` in the pool that follows them. No match
+ * falls through to the next instruction.
+ */
+#define OP_SWITCH_ENTRY 10
+
+/**
+ * JUMP_TABLE jumps to the address at the index held in its register. An
+ * index past the end of the table falls through to the next instruction.
+ */
+#define OP_TABLE_ENTRY 2
+
+/* the handlers, checked and (for verified programs) unchecked */
+#define OP(name, value, format, handler, unchecked, mnemonic) \
+  void handler(svm_t *in); void unchecked(svm_t *in);
+#include "op_list.h"
+#undef OP
+
+/* opcodes with no handler, or a native one */
+void op_unknown(svm_t *in);
+
+/* decode the instruction at `addr`, returns 0 if it runs past `size` */
+int op_decode(const unsigned char *code, unsigned int size, unsigned int addr, op_insn_t *insn);
+int op_decode_as(const unsigned char *code, unsigned int size, unsigned int addr,
+                 op_format_t format, op_insn_t *insn);
+
+/* the branch targets of a multiway instruction, besides falling through */
+unsigned int op_table_size(const op_insn_t *insn);
+unsigned int op_table_target(const op_insn_t *insn, unsigned int i);
+unsigned int op_table_offset(const op_insn_t *insn, unsigned int i);
+
+/* the operand layout of a built-in opcode */
+op_format_t op_format(unsigned char opcode);
+
+/* the assembler name of a built-in opcode, NULL for any other */
+const char *op_mnemonic(unsigned char opcode);
+
+/* non-zero if the opcode has a built-in handler */
+int op_is_builtin(unsigned char opcode);
+
+/* changes whenever the opcode table does */
+unsigned int op_table_version(void);
+
+/* point the vm at the shared checked or unchecked dispatch table */
 void op_code_init(svm_t *cpu);
+void op_code_unchecked(svm_t *cpu);
 
 #endif
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+/**
+ * Every opcode the vm knows, one per line:
+ *
+ *   OP(name, value, operand layout, handler, unchecked handler, mnemonic)
+ *
+ * Define OP and include this file to get at them. The opcode enum and
+ * handler prototypes (op.h), the dispatch tables and operand layouts
+ * (op.c), the tokens (token.h), the lexer keywords and the compiler and
+ * decompiler all come from here. Opcodes without an unchecked variant
+ * name their checked handler twice. Where several opcodes share a
+ * mnemonic the operands tell them apart, the first is the lexer's.
+ *
+ * The Perl scripts read this file too, so keep to one entry per line.
+ */
+
+/* early opcodes */
+OP(EXIT,          0x00, OPF_NONE,   op_exit,          op_exit,                    "exit")
+OP(INT_STORE,     0x01, OPF_RI,     op_int_store,     op_int_store_unchecked,     "store")
+OP(INT_PRINT,     0x02, OPF_R,      op_int_print,     op_int_print_unchecked,     "print_int")
+OP(INT_TOSTRING,  0x03, OPF_R,      op_int_tostring,  op_int_tostring,            "int2string")
+OP(INT_RANDOM,    0x04, OPF_R,      op_int_random,    op_int_random,              "random")
+
+/* jump operations */
+OP(JUMP_TO,       0x10, OPF_I,      op_jump_to,       op_jump_to_unchecked,       "goto")
+OP(JUMP_Z,        0x11, OPF_I,      op_jump_z,        op_jump_z_unchecked,        "jmpz")
+OP(JUMP_NZ,       0x12, OPF_I,      op_jump_nz,       op_jump_nz_unchecked,       "jmpnz")
+OP(JUMP_TABLE,    0x13, OPF_TABLE,  op_jump_table,    op_jump_table,              "jmptab")
+OP(JUMP_LT,       0x14, OPF_I,      op_jump_lt,       op_jump_lt_unchecked,       "jmplt")
+OP(JUMP_GT,       0x15, OPF_I,      op_jump_gt,       op_jump_gt_unchecked,       "jmpgt")
+OP(JUMP_EQ_IMM,   0x16, OPF_RIA,    op_jump_eq_imm,   op_jump_eq_imm_unchecked,   "jmpeq")
+OP(JUMP_NE_IMM,   0x17, OPF_RIA,    op_jump_ne_imm,   op_jump_ne_imm_unchecked,   "jmpne")
+OP(JUMP_LT_IMM,   0x18, OPF_RIA,    op_jump_lt_imm,   op_jump_lt_imm_unchecked,   "jmplt")
+OP(JUMP_GT_IMM,   0x19, OPF_RIA,    op_jump_gt_imm,   op_jump_gt_imm_unchecked,   "jmpgt")
+OP(JUMP_TO_REL,   0x1A, OPF_REL,    op_jump_to_rel,   op_jump_to_rel_unchecked,   "rgoto")
+OP(JUMP_Z_REL,    0x1B, OPF_REL,    op_jump_z_rel,    op_jump_z_rel_unchecked,    "rjmpz")
+OP(JUMP_NZ_REL,   0x1C, OPF_REL,    op_jump_nz_rel,   op_jump_nz_rel_unchecked,   "rjmpnz")
+
+/* math operations */
+OP(MATH_XOR,      0x20, OPF_RRR,    op_math_xor,      op_math_xor_unchecked,      "xor")
+OP(MATH_ADD,      0x21, OPF_RRR,    op_math_add,      op_math_add_unchecked,      "add")
+OP(MATH_SUB,      0x22, OPF_RRR,    op_math_sub,      op_math_sub_unchecked,      "sub")
+OP(MATH_MUL,      0x23, OPF_RRR,    op_math_mul,      op_math_mul_unchecked,      "mul")
+OP(MATH_DIV,      0x24, OPF_RRR,    op_math_div,      op_math_div,                "div")
+OP(MATH_INC,      0x25, OPF_R,      op_math_inc,      op_math_inc_unchecked,      "inc")
+OP(MATH_DEC,      0x26, OPF_R,      op_math_dec,      op_math_dec_unchecked,      "dec")
+OP(MATH_AND,      0x27, OPF_RRR,    op_math_and,      op_math_and_unchecked,      "and")
+OP(MATH_OR,       0x28, OPF_RRR,    op_math_or,       op_math_or_unchecked,       "or")
+OP(MATH_LFT,      0x29, OPF_RRR,    op_math_lft,      op_math_lft_unchecked,      "lft")
+OP(MATH_RGT,      0x2A, OPF_RRR,    op_math_rgt,      op_math_rgt_unchecked,      "rgt")
+OP(MATH_NOT,      0x2B, OPF_RR,     op_math_not,      op_math_not_unchecked,      "not")
+
+/* string operations */
+OP(STRING_STORE,  0x30, OPF_RS,     op_string_store,  op_string_store_unchecked,  "store")
+OP(STRING_PRINT,  0x31, OPF_R,      op_string_print,  op_string_print_unchecked,  "print_str")
+OP(STRING_CONCAT, 0x32, OPF_RRR,    op_string_concat, op_string_concat,           "concat")
+OP(STRING_SYSTEM, 0x33, OPF_R,      op_string_system, op_string_system,           "system")
+OP(STRING_TOINT,  0x34, OPF_R,      op_string_toint,  op_string_toint,            "string2int")
+OP(STRING_HASH,   0x35, OPF_RR,     op_string_hash,   op_string_hash,             "hash")
+OP(STRING_PREFIX, 0x36, OPF_RR,     op_string_prefix, op_string_prefix,           "prefix")
+OP(STRING_FIND,   0x37, OPF_RRR,    op_string_find,   op_string_find,             "find")
+OP(STRING_SWITCH, 0x38, OPF_SWITCH, op_string_switch, op_string_switch,           "switch")
+
+/* comparison/test operations */
+OP(CMP_REG,       0x40, OPF_RR,     op_cmp_reg,       op_cmp_reg_unchecked,       "cmp")
+OP(CMP_IMMEDIATE, 0x41, OPF_RI,     op_cmp_immediate, op_cmp_immediate_unchecked, "cmp")
+OP(CMP_STRING,    0x42, OPF_RS,     op_cmp_string,    op_cmp_string,              "cmp")
+OP(IS_STRING,     0x43, OPF_R,      op_is_string,     op_is_string,               "is_string")
+OP(IS_NUMBER,     0x44, OPF_R,      op_is_number,     op_is_number,               "is_integer")
+
+/* misc */
+OP(NOP,           0x50, OPF_NONE,   op_nop,           op_nop,                     "nop")
+OP(STORE_REG,     0x51, OPF_RR,     op_reg_store,     op_reg_store_unchecked,     "store")
+
+/* peek/poke operations */
+OP(PEEK,          0x60, OPF_RR,     op_peek,          op_peek,                    "peek")
+OP(POKE,          0x61, OPF_RR,     op_poke,          op_poke,                    "poke")
+OP(MEMCPY,        0x62, OPF_RRR,    op_memcpy,        op_memcpy,                  "memcpy")
+OP(RANDOM_FILL,   0x63, OPF_RR,     op_random_fill,   op_random_fill,             "random_fill")
+
+/* stack operations */
+OP(STACK_PUSH,    0x70, OPF_R,      op_stack_push,    op_stack_push,              "push")
+OP(STACK_POP,     0x71, OPF_R,      op_stack_pop,     op_stack_pop,               "pop")
+OP(STACK_RET,     0x72, OPF_NONE,   op_stack_ret,     op_stack_ret,               "ret")
+OP(STACK_CALL,    0x73, OPF_I,      op_stack_call,    op_stack_call,              "call")
+OP(STACK_CALL_REL,0x74, OPF_REL,    op_stack_call_rel, op_stack_call_rel,         "rcall")
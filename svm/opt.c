@@ -0,0 +1,921 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "opt.h"
+#include "cfg.h"
+#include "op.h"
+
+/**
+ * Bytecode-to-bytecode optimizer.
+ *
+ * Each pass decodes the reachable instructions of the image, rewrites,
+ * deletes or moves some of them and emits a new image, relocating every
+ * jump and call target. Passes are repeated until nothing changes.
+ *
+ * Relocation is only safe if no address can be observed by the program,
+ * so anything that PEEKs, POKEs or MEMCPYs (and so may be reading or
+ * rewriting its own code), or that can `ret` to a value it pushed, is
+ * left untouched.
+ */
+
+#define CODE_SIZE 0xffff
+#define ALL_REGS ((1u << REGISTER_COUNT) - 1)
+#define MAX_ROUNDS 8
+
+typedef struct {
+  op_insn_t insn;
+  int deleted, moved;
+  unsigned int hoist;   /* first entry emitted in front of this one */
+  unsigned int next;    /* next entry in a hoist chain */
+  unsigned int post;    /* new address jumps to this entry land on */
+
+  /* constant folding candidates */
+  int fold, fold_cmp;
+  unsigned int value;
+} opt_insn_t;
+
+typedef struct {
+  const unsigned char *code;
+  unsigned int size;
+  cfg_t *cfg;
+
+  opt_insn_t *insns;
+  unsigned int ninsn;
+  unsigned int *first;  /* first entry of each block */
+  unsigned int *at;     /* old address -> entry */
+  int changed;
+} opt_t;
+
+
+static unsigned int bit(unsigned int reg) {
+  return 1u << reg;
+}
+
+
+/* what a relative jump or call does, as its absolute opcode */
+static unsigned char absolute(unsigned char opcode) {
+  switch (opcode) {
+    case JUMP_TO_REL: return JUMP_TO;
+    case JUMP_Z_REL: return JUMP_Z;
+    case JUMP_NZ_REL: return JUMP_NZ;
+    case STACK_CALL_REL: return STACK_CALL;
+  }
+  return opcode;
+}
+
+
+static int is_jump(unsigned char opcode) {
+  switch (absolute(opcode)) {
+    case JUMP_TO: case JUMP_Z: case JUMP_NZ: case JUMP_LT: case JUMP_GT:
+    case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+      return 1;
+  }
+  return 0;
+}
+
+
+static int is_call(unsigned char opcode) {
+  return absolute(opcode) == STACK_CALL;
+}
+
+
+/* jumps on the flags */
+static int is_branch(unsigned char opcode) {
+  opcode = absolute(opcode);
+  return opcode == JUMP_Z || opcode == JUMP_NZ || opcode == JUMP_LT || opcode == JUMP_GT;
+}
+
+
+/* if `a` was taken `b` won't be, on the same flags */
+static int excludes(unsigned char a, unsigned char b) {
+  a = absolute(a);
+  b = absolute(b);
+  return (a == JUMP_Z && b == JUMP_NZ) || (a == JUMP_NZ && b == JUMP_Z) ||
+    (a == JUMP_LT && b == JUMP_GT) || (a == JUMP_GT && b == JUMP_LT) ||
+    (a == JUMP_Z && b == JUMP_GT);
+}
+
+
+/* the condition of a compare-and-jump, on a known register */
+static int compare_imm(unsigned char opcode, int value, int imm) {
+  switch (opcode) {
+    case JUMP_EQ_IMM: return value == imm;
+    case JUMP_NE_IMM: return value != imm;
+    case JUMP_LT_IMM: return value < imm;
+    default: return value > imm;
+  }
+}
+
+
+static int is_math(unsigned char opcode) {
+  switch (opcode) {
+    case MATH_XOR: case MATH_ADD: case MATH_SUB: case MATH_MUL:
+    case MATH_DIV: case MATH_AND: case MATH_OR: case MATH_LFT: case MATH_RGT:
+      return 1;
+  }
+  return 0;
+}
+
+
+static int reads_flags(unsigned char opcode) {
+  switch (absolute(opcode)) {
+    case JUMP_Z: case JUMP_NZ: case JUMP_LT: case JUMP_GT:
+    case STACK_CALL: case STACK_RET:
+      return 1;
+  }
+  return 0;
+}
+
+
+static int writes_flags(unsigned char opcode) {
+  switch (opcode) {
+    case MATH_INC: case MATH_DEC: case MATH_NOT:
+    case CMP_REG: case CMP_IMMEDIATE: case CMP_STRING:
+    case IS_STRING: case IS_NUMBER: case STRING_PREFIX: case STRING_FIND:
+      return 1;
+  }
+  return is_math(opcode);
+}
+
+
+/**
+ * Registers read and written by an instruction. Calls and returns hand
+ * every register to code we aren't looking at.
+ */
+static void effects(const op_insn_t *insn, unsigned int *reads, unsigned int *writes) {
+  const unsigned char *r = insn->reg;
+  *reads = *writes = 0;
+
+  switch (insn->opcode) {
+    case INT_STORE: case INT_RANDOM: case STRING_STORE: case STACK_POP:
+      *writes = bit(r[0]);
+      break;
+
+    case INT_TOSTRING: case MATH_INC: case MATH_DEC: case STRING_TOINT:
+      *reads = *writes = bit(r[0]);
+      break;
+
+    case INT_PRINT: case STRING_PRINT: case STRING_SYSTEM:
+    case CMP_IMMEDIATE: case CMP_STRING: case IS_STRING: case IS_NUMBER:
+    case STACK_PUSH: case STRING_SWITCH: case JUMP_TABLE:
+    case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+      *reads = bit(r[0]);
+      break;
+
+    case STRING_PREFIX: *reads = bit(r[0]) | bit(r[1]); break;
+
+    case STRING_HASH:
+      *reads = bit(r[1]);
+      *writes = bit(r[0]);
+      break;
+
+    case STRING_CONCAT: case STRING_FIND:
+      *reads = bit(r[1]) | bit(r[2]);
+      *writes = bit(r[0]);
+      break;
+
+    case CMP_REG: *reads = bit(r[0]) | bit(r[1]); break;
+
+    case STORE_REG: case PEEK: case MATH_NOT:
+      *reads = bit(r[1]);
+      *writes = bit(r[0]);
+      break;
+
+    case POKE: *reads = bit(r[0]) | bit(r[1]); break;
+    case MEMCPY: *reads = bit(r[0]) | bit(r[1]) | bit(r[2]); break;
+    case RANDOM_FILL: *reads = bit(r[0]) | bit(r[1]); break;
+
+    case STACK_CALL: case STACK_CALL_REL: case STACK_RET:
+      *reads = *writes = ALL_REGS;
+      break;
+
+    default:
+      if (is_math(insn->opcode)) {
+        *reads = bit(r[1]) | bit(r[2]);
+        *writes = bit(r[0]);
+      }
+      break;
+  }
+}
+
+
+static void opt_free(opt_t *o) {
+  cfg_free(o->cfg);
+  free(o->insns);
+  free(o->first);
+  free(o->at);
+}
+
+
+/**
+ * Decode the reachable instructions of the image, returns 0 if the
+ * program can't be safely relocated.
+ */
+static int opt_load(opt_t *o, const unsigned char *code, unsigned int size) {
+  memset(o, '\0', sizeof(*o));
+  o->code = code;
+  o->size = size;
+
+  o->cfg = cfg_build(code, size);
+  if (!o->cfg || (o->cfg->flags & CFG_SELF_MODIFYING)) return 0;
+
+  cfg_t *cfg = o->cfg;
+  o->first = malloc((cfg->nblocks + 1) * sizeof(unsigned int));
+  o->at = malloc(CODE_SIZE * sizeof(unsigned int));
+  if (!o->first || !o->at) return 0;
+
+  unsigned int end = 0;
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+    if (b->flags & (CFG_BLOCK_POKED | CFG_BLOCK_TRUNCATED)) return 0;
+
+    /* natives read and write what they like */
+    if ((b->flags & CFG_BLOCK_DYNAMIC) && b->start < size) return 0;
+
+    /* blocks sharing bytes can't be moved independently */
+    if (b->start < end) return 0;
+    end = b->end;
+    o->ninsn += b->ninsn;
+  }
+
+  o->insns = calloc(o->ninsn ? o->ninsn : 1, sizeof(opt_insn_t));
+  if (!o->insns) return 0;
+
+  for (unsigned int i = 0; i < CODE_SIZE; i++) o->at[i] = CFG_NONE;
+
+  int has_push = 0, has_ret = 0;
+  unsigned int n = 0;
+
+  for (unsigned int i = 0; i < cfg->nblocks; i++) {
+    cfg_block_t *b = &cfg->blocks[i];
+    o->first[i] = n;
+
+    for (unsigned int addr = b->start, k = 0; k < b->ninsn; k++) {
+      opt_insn_t *e = &o->insns[n];
+      op_decode(code, size, addr, &e->insn);
+      e->hoist = e->next = CFG_NONE;
+      o->at[addr] = n++;
+      addr += e->insn.length;
+
+      for (unsigned int r = 0; r < e->insn.nreg; r++)
+        if (e->insn.reg[r] >= REGISTER_COUNT) return 0;
+
+      switch (e->insn.opcode) {
+        case PEEK: case POKE: case MEMCPY: case RANDOM_FILL: return 0;
+        case STACK_PUSH: has_push = 1; break;
+        case STACK_RET: has_ret = 1; break;
+      }
+    }
+  }
+  o->first[cfg->nblocks] = n;
+
+  return !(has_push && has_ret);
+}
+
+
+static void emit_entry(unsigned char *out, unsigned int *n, const opt_t *o, const opt_insn_t *e) {
+  const op_insn_t *insn = &e->insn;
+  unsigned char *p = out + *n;
+  unsigned int imm = insn->imm;
+
+  /* jumps into the image follow the code they pointed at */
+  if (is_jump(insn->opcode) || is_call(insn->opcode))
+    if (imm < o->size && o->at[imm] != CFG_NONE) imm = o->insns[o->at[imm]].post;
+
+  *p++ = insn->opcode;
+  switch (insn->format) {
+    case OPF_NONE: break;
+    case OPF_R: *p++ = insn->reg[0]; break;
+    case OPF_RR: *p++ = insn->reg[0]; *p++ = insn->reg[1]; break;
+    case OPF_RRR: *p++ = insn->reg[0]; *p++ = insn->reg[1]; *p++ = insn->reg[2]; break;
+
+    case OPF_RI: case OPF_RS:
+      *p++ = insn->reg[0];
+      /* fallthrough */
+    case OPF_I:
+      *p++ = imm & 0xff;
+      *p++ = (imm >> 8) & 0xff;
+      break;
+
+    case OPF_REL:
+      imm = OP_REL_OFFSET(*n + insn->length, imm);
+      *p++ = imm & 0xff;
+      *p++ = (imm >> 8) & 0xff;
+      break;
+
+    case OPF_RIA:
+      *p++ = insn->reg[0];
+      *p++ = insn->arg & 0xff;
+      *p++ = (insn->arg >> 8) & 0xff;
+      *p++ = imm & 0xff;
+      *p++ = (imm >> 8) & 0xff;
+      break;
+
+    case OPF_SWITCH: case OPF_TABLE: break;
+  }
+
+  if (insn->format == OPF_RS) {
+    memcpy(p, insn->str, insn->imm);
+    p += insn->imm;
+  }
+
+  /* tables keep their layout, only the targets move */
+  if (insn->format == OPF_SWITCH || insn->format == OPF_TABLE) {
+    memcpy(out + *n, o->code + insn->addr, insn->length);
+    p = out + *n + insn->length;
+
+    for (unsigned int i = 0; i < op_table_size(insn); i++) {
+      unsigned int to = op_table_target(insn, i);
+      if (to < o->size && o->at[to] != CFG_NONE) to = o->insns[o->at[to]].post;
+
+      unsigned char *e = out + *n + op_table_offset(insn, i);
+      e[0] = to & 0xff;
+      e[1] = (to >> 8) & 0xff;
+    }
+  }
+
+  *n = p - out;
+}
+
+
+static unsigned int hoisted_length(const opt_t *o, const opt_insn_t *e) {
+  unsigned int len = 0;
+  for (unsigned int h = e->hoist; h != CFG_NONE; h = o->insns[h].next)
+    len += o->insns[h].insn.length;
+  return len;
+}
+
+
+/**
+ * Lay out the surviving instructions and write the new image.
+ */
+static unsigned char *opt_emit(opt_t *o, unsigned int *out_size) {
+  unsigned int addr = 0;
+
+  for (unsigned int i = 0; i < o->ninsn; i++) {
+    opt_insn_t *e = &o->insns[i];
+    addr += hoisted_length(o, e);
+    e->post = addr;
+    if (!e->deleted && !e->moved) addr += e->insn.length;
+  }
+
+  unsigned char *out = malloc(addr ? addr : 1);
+  if (!out) return NULL;
+
+  unsigned int n = 0;
+  for (unsigned int i = 0; i < o->ninsn; i++) {
+    opt_insn_t *e = &o->insns[i];
+    for (unsigned int h = e->hoist; h != CFG_NONE; h = o->insns[h].next)
+      emit_entry(out, &n, o, &o->insns[h]);
+    if (!e->deleted && !e->moved) emit_entry(out, &n, o, e);
+  }
+
+  *out_size = n;
+  return out;
+}
+
+
+/**
+ * Jump threading: jumps to jumps go straight to the final destination,
+ * and jumps to the next instruction are dropped.
+ */
+static void pass_thread(opt_t *o) {
+  for (unsigned int i = 0; i < o->ninsn; i++) {
+    opt_insn_t *e = &o->insns[i];
+    unsigned char opcode = e->insn.opcode;
+    if (!is_jump(opcode) && !is_call(opcode)) continue;
+
+    unsigned int target = e->insn.imm;
+    for (int hops = 0; hops < 16 && target < o->size; hops++) {
+      if (o->at[target] == CFG_NONE || target == e->insn.addr) break;
+      const op_insn_t *to = &o->insns[o->at[target]].insn;
+
+      if (absolute(to->opcode) == JUMP_TO) target = to->imm;
+      /* the flags don't change between the two jumps */
+      else if (is_branch(opcode) && absolute(to->opcode) == absolute(opcode)) target = to->imm;
+      else if (is_branch(opcode) && excludes(opcode, to->opcode)) target = to->addr + to->length;
+      else break;
+    }
+
+    if (target != e->insn.imm) {
+      e->insn.imm = target;
+      o->changed = 1;
+    }
+
+    if (is_jump(opcode) && target == e->insn.addr + e->insn.length) {
+      e->deleted = 1;
+      o->changed = 1;
+    }
+  }
+}
+
+
+typedef struct {
+  unsigned int known;
+  unsigned int value[REGISTER_COUNT];
+} cstate_t;
+
+
+static void meet(cstate_t *a, const cstate_t *b) {
+  for (unsigned int r = 0; r < REGISTER_COUNT; r++)
+    if (!(b->known & bit(r)) || b->value[r] != a->value[r]) a->known &= ~bit(r);
+}
+
+
+/**
+ * Evaluate a math op the way the interpreter does, returns 0 if it would
+ * panic or overflow.
+ */
+static int evaluate(unsigned char opcode, unsigned int a, unsigned int b, unsigned int *res) {
+  switch (opcode) {
+    case MATH_XOR: *res = a ^ b; return 1;
+    case MATH_ADD: *res = a + b; return 1;
+    case MATH_SUB: *res = a - b; return 1;
+    case MATH_MUL: *res = a * b; return 1;
+    case MATH_AND: *res = a & b; return 1;
+    case MATH_OR: *res = a | b; return 1;
+    case MATH_LFT: *res = a << (b & 31); return 1;
+    case MATH_RGT: *res = (unsigned int) ((int) a >> (b & 31)); return 1;
+
+    case MATH_DIV:
+      if (b == 0 || (a == 0x80000000u && b == 0xffffffffu)) return 0;
+      *res = (unsigned int) ((int) a / (int) b);
+      return 1;
+  }
+  return 0;
+}
+
+
+static void transfer_const(cstate_t *s, const op_insn_t *insn) {
+  const unsigned char *r = insn->reg;
+  unsigned int reads, writes, res;
+
+  switch (insn->opcode) {
+    case INT_STORE:
+      s->known |= bit(r[0]);
+      s->value[r[0]] = insn->imm;
+      return;
+
+    case STORE_REG:
+      if (s->known & bit(r[1])) {
+        s->known |= bit(r[0]);
+        s->value[r[0]] = s->value[r[1]];
+        return;
+      }
+      break;
+
+    case MATH_INC: case MATH_DEC:
+      if (s->known & bit(r[0])) {
+        s->value[r[0]] += (insn->opcode == MATH_INC) ? 1 : -1;
+        return;
+      }
+      break;
+
+    case MATH_NOT:
+      if (s->known & bit(r[1])) {
+        s->known |= bit(r[0]);
+        s->value[r[0]] = ~s->value[r[1]];
+        return;
+      }
+      break;
+
+    default:
+      if (is_math(insn->opcode) && (s->known & bit(r[1])) && (s->known & bit(r[2])) &&
+          evaluate(insn->opcode, s->value[r[1]], s->value[r[2]], &res)) {
+        s->known |= bit(r[0]);
+        s->value[r[0]] = res;
+        return;
+      }
+      break;
+  }
+
+  effects(insn, &reads, &writes);
+  s->known &= ~writes;
+}
+
+
+static void block_out(const opt_t *o, unsigned int b, const cstate_t *in, cstate_t *out) {
+  *out = *in;
+  for (unsigned int i = o->first[b]; i < o->first[b + 1]; i++)
+    if (!o->insns[i].deleted) transfer_const(out, &o->insns[i].insn);
+}
+
+
+/**
+ * Liveness of the z-flag at the end of each block.
+ */
+static void flags_live_out(const opt_t *o, int *live_out) {
+  cfg_t *cfg = o->cfg;
+  int *live_in = calloc(cfg->nblocks ? cfg->nblocks : 1, sizeof(int));
+  if (!live_in) {
+    for (unsigned int b = 0; b < cfg->nblocks; b++) live_out[b] = 1;
+    return;
+  }
+
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (unsigned int b = cfg->nblocks; b-- > 0;) {
+      int live = 0;
+      for (unsigned int s = 0; s < cfg->blocks[b].nsucc; s++)
+        live |= live_in[cfg->blocks[b].succ[s]];
+      live_out[b] = live;
+
+      for (unsigned int i = o->first[b + 1]; i-- > o->first[b];) {
+        const opt_insn_t *e = &o->insns[i];
+        if (e->deleted) continue;
+        if (reads_flags(e->insn.opcode)) live = 1;
+        else if (writes_flags(e->insn.opcode)) live = 0;
+      }
+
+      if (live != live_in[b]) {
+        live_in[b] = live;
+        changed = 1;
+      }
+    }
+  }
+
+  free(live_in);
+}
+
+
+/**
+ * Constant propagation through registers. Conditional jumps on a known
+ * z-flag become `goto`s or disappear, math on constants becomes a store,
+ * and compares whose result is known and unused are dropped.
+ */
+static void pass_fold(opt_t *o) {
+  cfg_t *cfg = o->cfg;
+  cstate_t *in = calloc(cfg->nblocks ? cfg->nblocks : 1, sizeof(cstate_t));
+  int *seen = calloc(cfg->nblocks ? cfg->nblocks : 1, sizeof(int));
+  int *live = calloc(cfg->nblocks ? cfg->nblocks : 1, sizeof(int));
+  if (!in || !seen || !live) goto done;
+
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (unsigned int b = 0; b < cfg->nblocks; b++) {
+      const cfg_block_t *blk = &cfg->blocks[b];
+      cstate_t s;
+
+      /* registers start as zero, called code could be handed anything */
+      memset(&s, '\0', sizeof(s));
+      int have = 0;
+      if (blk->flags & CFG_BLOCK_ENTRY) { s.known = ALL_REGS; have = 1; }
+      if (blk->flags & CFG_BLOCK_CALLEE) { s.known = 0; have = 1; }
+
+      for (unsigned int p = 0; p < blk->npred; p++) {
+        unsigned int pb = blk->pred[p];
+        if (!seen[pb]) continue;
+
+        cstate_t out;
+        block_out(o, pb, &in[pb], &out);
+        if (cfg->blocks[pb].flags & CFG_BLOCK_CALL) out.known = 0;
+
+        if (!have) { s = out; have = 1; }
+        else meet(&s, &out);
+      }
+
+      if (!have) continue;
+      if (!seen[b] || memcmp(&s, &in[b], sizeof(s))) {
+        in[b] = s;
+        seen[b] = 1;
+        changed = 1;
+      }
+    }
+  }
+
+  /* fold the jumps first, they decide which flags are still live */
+  for (unsigned int b = 0; b < cfg->nblocks; b++) {
+    if (!seen[b]) continue;
+    cstate_t s = in[b];
+    int z = -1;
+
+    for (unsigned int i = o->first[b]; i < o->first[b + 1]; i++) {
+      opt_insn_t *e = &o->insns[i];
+      const op_insn_t *insn = &e->insn;
+      const unsigned char *r = insn->reg;
+      unsigned int res;
+
+      if (e->deleted) continue;
+
+      switch (insn->opcode) {
+        case JUMP_Z: case JUMP_NZ: case JUMP_Z_REL: case JUMP_NZ_REL:
+          if (z < 0) break;
+          if ((absolute(insn->opcode) == JUMP_Z) == z)
+            e->insn.opcode = (insn->format == OPF_REL) ? JUMP_TO_REL : JUMP_TO;
+          else e->deleted = 1;
+          o->changed = 1;
+          break;
+
+        case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+          if (!(s.known & bit(r[0]))) break;
+          if (compare_imm(insn->opcode, s.value[r[0]], insn->arg)) {
+            e->insn.opcode = JUMP_TO;
+            e->insn.format = OPF_I;
+            e->insn.nreg = 0;
+            e->insn.length = 3;
+          } else {
+            e->deleted = 1;
+          }
+          o->changed = 1;
+          break;
+
+        case CMP_IMMEDIATE:
+          z = -1;
+          if (s.known & bit(r[0])) {
+            z = (s.value[r[0]] == insn->imm);
+            e->fold_cmp = 1;
+          }
+          break;
+
+        case CMP_REG:
+          z = -1;
+          if ((s.known & bit(r[0])) && (s.known & bit(r[1]))) {
+            z = (s.value[r[0]] == s.value[r[1]]);
+            e->fold_cmp = 1;
+          }
+          break;
+
+        case MATH_INC: case MATH_DEC:
+          z = -1;
+          if (s.known & bit(r[0]))
+            z = (s.value[r[0]] + ((insn->opcode == MATH_INC) ? 1 : -1) == 0);
+          break;
+
+        default:
+          if (is_math(insn->opcode)) {
+            z = -1;
+            if ((s.known & bit(r[1])) && (s.known & bit(r[2])) &&
+                evaluate(insn->opcode, s.value[r[1]], s.value[r[2]], &res)) {
+              z = (res == 0);
+              e->fold = (res <= 0xffff);
+              e->value = res;
+            }
+          } else if (writes_flags(insn->opcode) || reads_flags(insn->opcode)) {
+            z = -1;
+          }
+          break;
+      }
+
+      transfer_const(&s, insn);
+    }
+  }
+
+  flags_live_out(o, live);
+
+  for (unsigned int b = 0; b < cfg->nblocks; b++) {
+    int flags = live[b];
+
+    for (unsigned int i = o->first[b + 1]; i-- > o->first[b];) {
+      opt_insn_t *e = &o->insns[i];
+      if (e->deleted) continue;
+
+      if (!flags && e->fold_cmp) {
+        e->deleted = 1;
+        o->changed = 1;
+        continue;
+      }
+
+      if (!flags && e->fold) {
+        e->insn.opcode = INT_STORE;
+        e->insn.format = OPF_RI;
+        e->insn.nreg = 1;
+        e->insn.imm = e->value;
+        o->changed = 1;
+      }
+
+      if (reads_flags(e->insn.opcode)) flags = 1;
+      else if (writes_flags(e->insn.opcode)) flags = 0;
+    }
+  }
+
+done:
+  free(in); free(seen); free(live);
+}
+
+
+/**
+ * Collect the natural loop with header `h` into `body`, returns 0 unless
+ * every block in it is only entered through the header.
+ */
+static int loop_body(const cfg_t *cfg, unsigned int h, unsigned char *body, unsigned int *work) {
+  unsigned int nwork = 0, latches = 0;
+
+  memset(body, 0, cfg->nblocks);
+  body[h] = 1;
+
+  for (unsigned int p = 0; p < cfg->blocks[h].npred; p++) {
+    unsigned int pb = cfg->blocks[h].pred[p];
+    if (cfg->blocks[pb].start < cfg->blocks[h].start) continue;
+    latches++;
+    if (body[pb]) continue;
+    body[pb] = 1;
+    work[nwork++] = pb;
+  }
+
+  if (!latches) return 0;
+
+  while (nwork) {
+    const cfg_block_t *b = &cfg->blocks[work[--nwork]];
+    for (unsigned int p = 0; p < b->npred; p++) {
+      if (body[b->pred[p]]) continue;
+      body[b->pred[p]] = 1;
+      work[nwork++] = b->pred[p];
+    }
+  }
+
+  /* no way in other than the header, and nothing leaves for a routine */
+  for (unsigned int b = 0; b < cfg->nblocks; b++) {
+    if (!body[b]) continue;
+    const cfg_block_t *blk = &cfg->blocks[b];
+    if (blk->flags & (CFG_BLOCK_CALL | CFG_BLOCK_RET | CFG_BLOCK_CALLEE)) return 0;
+    if (b == h) continue;
+    if (blk->flags & CFG_BLOCK_ENTRY) return 0;
+    for (unsigned int p = 0; p < blk->npred; p++)
+      if (!body[blk->pred[p]]) return 0;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Loop-invariant hoisting of constant stores.
+ *
+ * A store of a constant in the loop header is moved in front of the loop
+ * if it is the only write to its register in the loop and nothing in the
+ * header reads the register before it. The header runs first on every
+ * iteration, so every read in the loop and every exit still sees the
+ * constant. Only loops entered by falling into the header qualify, the
+ * hoisted store sits right before it and jumps to the header skip it.
+ */
+static void pass_hoist(opt_t *o) {
+  cfg_t *cfg = o->cfg;
+  unsigned char *body = malloc(cfg->nblocks ? cfg->nblocks : 1);
+  unsigned int *work = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(unsigned int));
+  if (!body || !work) goto done;
+
+  for (unsigned int h = 0; h < cfg->nblocks; h++) {
+    const cfg_block_t *hb = &cfg->blocks[h];
+    if (o->first[h] == o->first[h + 1]) continue;
+    if (!loop_body(cfg, h, body, work)) continue;
+
+    /* the only entry from outside is falling into the header */
+    int ok = 1;
+    for (unsigned int p = 0; p < hb->npred && ok; p++) {
+      const cfg_block_t *pb = &cfg->blocks[hb->pred[p]];
+      if (body[hb->pred[p]]) continue;
+      const op_insn_t *last = &o->insns[o->first[hb->pred[p] + 1] - 1].insn;
+      if (pb->end != hb->start || (is_jump(last->opcode) && last->imm == hb->start)) ok = 0;
+    }
+    if (!ok) continue;
+
+    /* registers written anywhere in the loop, and how often */
+    unsigned int count[REGISTER_COUNT];
+    memset(count, 0, sizeof(count));
+    for (unsigned int b = 0; b < cfg->nblocks; b++) {
+      if (!body[b]) continue;
+      for (unsigned int i = o->first[b]; i < o->first[b + 1]; i++) {
+        unsigned int reads, writes;
+        if (o->insns[i].deleted || o->insns[i].moved) continue;
+        effects(&o->insns[i].insn, &reads, &writes);
+        for (unsigned int r = 0; r < REGISTER_COUNT; r++)
+          if (writes & bit(r)) count[r]++;
+      }
+    }
+
+    unsigned int read = 0, *tail = &o->insns[o->first[h]].hoist;
+    while (*tail != CFG_NONE) tail = &o->insns[*tail].next;
+
+    for (unsigned int i = o->first[h]; i < o->first[h + 1]; i++) {
+      opt_insn_t *e = &o->insns[i];
+      unsigned int reads, writes;
+      if (e->deleted || e->moved) continue;
+
+      effects(&e->insn, &reads, &writes);
+      unsigned char opcode = e->insn.opcode;
+
+      if ((opcode == STRING_STORE || opcode == INT_STORE) &&
+          count[e->insn.reg[0]] == 1 && !(read & bit(e->insn.reg[0]))) {
+        e->moved = 1;
+        *tail = i;
+        tail = &e->next;
+        o->changed = 1;
+      }
+
+      read |= reads;
+    }
+  }
+
+done:
+  free(body); free(work);
+}
+
+
+/**
+ * Dead-store elimination: stores to registers that are overwritten or
+ * never read again are dropped.
+ */
+static void pass_dse(opt_t *o) {
+  cfg_t *cfg = o->cfg;
+  unsigned int *live_in = calloc(cfg->nblocks ? cfg->nblocks : 1, sizeof(unsigned int));
+  if (!live_in) return;
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int changed = 1; changed;) {
+      changed = 0;
+      for (unsigned int b = cfg->nblocks; b-- > 0;) {
+        unsigned int live = 0;
+        for (unsigned int s = 0; s < cfg->blocks[b].nsucc; s++)
+          live |= live_in[cfg->blocks[b].succ[s]];
+
+        for (unsigned int i = o->first[b + 1]; i-- > o->first[b];) {
+          opt_insn_t *e = &o->insns[i];
+          unsigned int reads, writes;
+          if (e->deleted || e->moved) continue;
+
+          unsigned char opcode = e->insn.opcode;
+          int store = (opcode == INT_STORE || opcode == STRING_STORE || opcode == STORE_REG);
+
+          effects(&e->insn, &reads, &writes);
+          if (pass && store && !(live & writes)) {
+            e->deleted = 1;
+            o->changed = 1;
+            continue;
+          }
+
+          live = (live & ~writes) | reads;
+        }
+
+        if (live != live_in[b]) {
+          live_in[b] = live;
+          changed = 1;
+        }
+      }
+      if (pass) break;
+    }
+  }
+
+  free(live_in);
+}
+
+
+/**
+ * Optimize a bytecode image, returning a newly allocated image or NULL if
+ * the program was left untouched.
+ */
+unsigned char *svm_optimize(const unsigned char *code, unsigned int size,
+  unsigned int *out_size, int passes) {
+  static void (*const pass_fns[])(opt_t *) = {
+    pass_thread, pass_fold, pass_hoist, pass_dse
+  };
+
+  if (!code || !size || size > CODE_SIZE) return NULL;
+
+  unsigned char *buf = malloc(size);
+  if (!buf) return NULL;
+  memcpy(buf, code, size);
+
+  int touched = 0;
+  for (int round = 0, changed = 1; changed && round < MAX_ROUNDS; round++) {
+    changed = 0;
+
+    for (int p = 0; p < 4; p++) {
+      if (!(passes & (1 << p))) continue;
+
+      opt_t o;
+      if (!opt_load(&o, buf, size)) {
+        opt_free(&o);
+        if (!touched) { free(buf); return NULL; }
+        goto done;
+      }
+
+      pass_fns[p](&o);
+      if (o.changed) {
+        unsigned int n;
+        unsigned char *out = opt_emit(&o, &n);
+        if (out) {
+          free(buf);
+          buf = out; size = n;
+          touched = changed = 1;
+        }
+      }
+      opt_free(&o);
+    }
+  }
+
+done:
+  if (!touched) {
+    free(buf);
+    return NULL;
+  }
+
+  *out_size = size;
+  return buf;
+}
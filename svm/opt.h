@@ -0,0 +1,20 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef OPT_H
+#define OPT_H
+
+#define OPT_THREAD 0x01  /* jump threading */
+#define OPT_FOLD   0x02  /* constant propagation and folding */
+#define OPT_HOIST  0x04  /* hoist constant stores out of loops */
+#define OPT_DSE    0x08  /* dead-store elimination */
+#define OPT_ALL    0x0f
+
+unsigned char *svm_optimize(const unsigned char *code, unsigned int size,
+  unsigned int *out_size, int passes);
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "svm.h"
+
+/**
+ * Buffered program output.
+ *
+ * print_int/print_str append to a per-vm buffer which is handed to a sink
+ * according to the flush policy, so printing in a loop costs a memcpy
+ * rather than a trip through stdio. Sinks receive an iovec so a write
+ * that doesn't fit can go out together with the buffer without copying.
+ */
+
+
+static void deliver(svm_output_t *out, const struct iovec *iov, int iovcnt) {
+  if (out->sink) out->sink(out->udata, iov, iovcnt);
+  else svm_sink_stdout(NULL, iov, iovcnt);
+}
+
+
+void svm_output_set(svm_t *cpu, svm_sink_t sink, void *udata, int policy) {
+  svm_output_flush(cpu);
+  cpu->out.sink = sink;
+  cpu->out.udata = udata;
+  cpu->out.policy = policy;
+}
+
+
+void svm_output_flush(svm_t *cpu) {
+  svm_output_t *out = &cpu->out;
+  if (!out->len) return;
+
+  struct iovec iov = { out->buf, out->len };
+  out->len = 0;
+  deliver(out, &iov, 1);
+}
+
+
+void svm_write(svm_t *cpu, const char *data, size_t len) {
+  svm_output_t *out = &cpu->out;
+
+  if (out->len + len > SVM_OUTPUT_SIZE) {
+    struct iovec iov[2] = { { out->buf, out->len }, { (void *) data, len } };
+    out->len = 0;
+    deliver(out, iov, 2);
+    return;
+  }
+
+  memcpy(out->buf + out->len, data, len);
+  out->len += len;
+
+  if (out->policy == SVM_FLUSH_NONE ||
+     (out->policy == SVM_FLUSH_LINE && memchr(data, '\n', len)))
+    svm_output_flush(cpu);
+}
+
+
+/**
+ * Write to stdout through stdio, so output stays in order with anything
+ * else printed there.
+ */
+void svm_sink_stdout(void *udata, const struct iovec *iov, int iovcnt) {
+  (void) udata;
+  for (int i = 0; i < iovcnt; i++)
+    fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+  fflush(stdout);
+}
+
+
+/**
+ * Write straight to the file descriptor stored in `udata`, a few iovecs
+ * at a time so short writes can be picked up from a copy.
+ */
+void svm_sink_fd(void *udata, const struct iovec *iov, int iovcnt) {
+  int fd = (int) (intptr_t) udata;
+  struct iovec vec[8];
+
+  while (iovcnt > 0) {
+    int left = iovcnt < 8 ? iovcnt : 8;
+    memcpy(vec, iov, left * sizeof(*iov));
+    iov += left; iovcnt -= left;
+    struct iovec *v = vec;
+
+    while (left > 0) {
+      ssize_t n = writev(fd, v, left);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+
+      /* skip whatever made it out */
+      while (left > 0 && (size_t) n >= v->iov_len) {
+        n -= v->iov_len;
+        v++; left--;
+      }
+      if (left > 0) {
+        v->iov_base = (char *) v->iov_base + n;
+        v->iov_len -= n;
+      }
+    }
+  }
+}
+
+
+/**
+ * Append to the svm_capture_t in `udata`.
+ */
+void svm_sink_capture(void *udata, const struct iovec *iov, int iovcnt) {
+  svm_capture_t *cap = udata;
+
+  for (int i = 0; i < iovcnt; i++) {
+    size_t need = cap->len + iov[i].iov_len + 1;
+    if (need > cap->cap) {
+      size_t size = cap->cap ? cap->cap : 256;
+      while (size < need) size *= 2;
+      char *data = realloc(cap->data, size);
+      if (!data) return;
+      cap->data = data;
+      cap->cap = size;
+    }
+
+    memcpy(cap->data + cap->len, iov[i].iov_base, iov[i].iov_len);
+    cap->len += iov[i].iov_len;
+    cap->data[cap->len] = '\0';
+  }
+}
+
+
+/**
+ * Format `val` in decimal, returns the number of characters written.
+ * `buf` needs room for 11.
+ */
+size_t svm_format_int(char *buf, int val) {
+  char tmp[12], *p = tmp + sizeof(tmp);
+  unsigned int u = (val < 0) ? 0u - (unsigned int) val : (unsigned int) val;
+
+  do {
+    *--p = '0' + (u % 10);
+    u /= 10;
+  } while (u);
+
+  if (val < 0) *--p = '-';
+
+  size_t len = tmp + sizeof(tmp) - p;
+  memcpy(buf, p, len);
+  return len;
+}
+
+
+/**
+ * Format `val` in upper-case hex, zero padded to `width` digits.
+ */
+size_t svm_format_hex(char *buf, unsigned int val, int width) {
+  static const char digits[] = "0123456789ABCDEF";
+  char tmp[8], *p = tmp + sizeof(tmp);
+
+  do {
+    *--p = digits[val & 0xf];
+    val >>= 4;
+  } while (val);
+
+  while (tmp + sizeof(tmp) - p < width && p > tmp) *--p = '0';
+
+  size_t len = tmp + sizeof(tmp) - p;
+  memcpy(buf, p, len);
+  return len;
+}
@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "svm.h"
+#include "op.h"
+#include "prog.h"
+#include "verify.h"
+
+/**
+ * Live code patches.
+ *
+ * svm_patch hands a vm a new code image and a map of where the old
+ * image's code went. The vm swaps it in between two instructions, once
+ * everything that points into the code can be moved:
+ *
+ *  - the ip must be in code that didn't change, or at the start of a
+ *    region that did (a label, for assembled programs);
+ *  - with frame records on, every return address must be too, and they
+ *    are moved with the ip. Without them nothing tells return addresses
+ *    apart from other numbers on the stack, so the vm waits for an empty
+ *    stack.
+ *
+ * Until then the patch stays queued. Addresses held in registers are the
+ * program's business. The queue is a single slot swapped atomically, so
+ * svm_patch may be called from another thread, a newer patch replacing
+ * one not yet applied.
+ */
+
+
+/* where `addr` is in the new image, -1 if it is inside changed code */
+static long remap(const svm_patch_t *p, unsigned int addr) {
+  if (p->keep) return addr;
+
+  for (unsigned int i = 0; i < p->nmap; i++) {
+    const svm_remap_t *m = &p->map[i];
+    if (addr < m->from || addr - m->from >= m->len) continue;
+    if (m->same) return m->to + (addr - m->from);
+    return (addr == m->from) ? (long) m->to : -1;
+  }
+
+  return -1;
+}
+
+
+static int safe(svm_t *cpu, const svm_patch_t *p) {
+  if (remap(p, cpu->ip) < 0) return 0;
+  if (!cpu->stack.record) return cpu->sp == 0;
+
+  for (unsigned int i = 0; i < cpu->stack.nframes; i++) {
+    const svm_frame_t *f = &cpu->stack.frames[i];
+    if (remap(p, cpu->stack.base[f->sp].value.number) < 0) return 0;
+  }
+
+  return 1;
+}
+
+
+static void apply(svm_t *cpu, const svm_patch_t *p) {
+  for (unsigned int i = 0; i < cpu->stack.nframes; i++) {
+    svm_frame_t *f = &cpu->stack.frames[i];
+    reg_t *ret = &cpu->stack.base[f->sp];
+    long site = remap(p, f->site), callee = remap(p, f->callee);
+
+    ret->value.number = remap(p, ret->value.number);
+    if (site >= 0) f->site = site;
+    if (callee >= 0) f->callee = callee;
+  }
+
+  cpu->ip = remap(p, cpu->ip);
+
+  if (p->size < cpu->size) memset(cpu->code + p->size, '\0', cpu->size - p->size);
+  memcpy(cpu->code, p->code, p->size);
+  svm_dirty_range(cpu, 0, p->size > cpu->size ? p->size : cpu->size);
+  cpu->size = p->size;
+
+  /* the old proof is about the old code */
+  op_code_init(cpu);
+  cpu->verified = 0;
+  if (getenv("DEBUG") == NULL && !(cpu->prog && cpu->prog->nnatives)) svm_verify(cpu);
+}
+
+
+static void patch_free(svm_patch_t *p) {
+  if (!p) return;
+  free(p->code);
+  free(p->map);
+  free(p);
+}
+
+
+/**
+ * Queue `code` to replace the vm's program, with `map` saying where the
+ * old code went. A NULL map means nothing moved, an address a map leaves
+ * out is never safe. Returns -1 if the image is too large, or doesn't fit
+ * the code segment, or the vm is being traced, a trace only has room for
+ * one program.
+ */
+int svm_patch(svm_t *cpu, const unsigned char *code, unsigned int size,
+              const svm_remap_t *map, unsigned int nmap) {
+  if (!cpu || !code || !size || size > 0xffff || cpu->trace) return -1;
+  if (cpu->data && size > cpu->data) return -1;
+
+  svm_patch_t *p = calloc(1, sizeof(*p));
+  if (!p) return -1;
+
+  p->code = malloc(size);
+  p->map = (map && nmap) ? malloc(nmap * sizeof(*map)) : NULL;
+  if (!p->code || (map && nmap && !p->map)) {
+    patch_free(p);
+    return -1;
+  }
+
+  memcpy(p->code, code, size);
+  if (p->map) memcpy(p->map, map, nmap * sizeof(*map));
+  p->size = size;
+  p->nmap = nmap;
+  p->keep = (map == NULL);
+
+  patch_free(__atomic_exchange_n(&cpu->patch, p, __ATOMIC_ACQ_REL));
+  return 0;
+}
+
+
+/**
+ * Apply the queued patch if the vm is at a safe point, returns 1 if it
+ * was. The interpreter calls this between instructions while a patch is
+ * waiting; a host may call it on a vm that isn't running.
+ */
+int svm_patch_apply(svm_t *cpu) {
+  svm_patch_t *p = __atomic_exchange_n(&cpu->patch, NULL, __ATOMIC_ACQ_REL);
+  if (!p) return 0;
+
+  if (!safe(cpu, p)) {
+    /* put it back, unless a newer one arrived meanwhile */
+    svm_patch_t *none = NULL;
+    if (!__atomic_compare_exchange_n(&cpu->patch, &none, p, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      patch_free(p);
+    return 0;
+  }
+
+  apply(cpu, p);
+  patch_free(p);
+  return 1;
+}
+
+
+int svm_patch_pending(svm_t *cpu) {
+  return __atomic_load_n(&cpu->patch, __ATOMIC_ACQUIRE) != NULL;
+}
+
+
+void svm_patch_discard(svm_t *cpu) {
+  patch_free(__atomic_exchange_n(&cpu->patch, NULL, __ATOMIC_ACQ_REL));
+}
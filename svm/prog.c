@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "prog.h"
+#include "str.h"
+
+/**
+ * Native opcodes.
+ *
+ * Opcodes without a built-in handler can be bound to C functions on a
+ * svm_prog_t. op_unknown looks the opcode up on the vm's program, decodes
+ * the operands in the registered format and calls the handler. The program
+ * is shared, so registering a handler costs nothing per vm; it must outlive
+ * every vm attached to it.
+ */
+
+
+svm_prog_t *svm_prog_new(void) {
+  svm_prog_t *prog = calloc(1, sizeof(*prog));
+  if (!prog) svm_panic(NULL, "out of memory");
+  return prog;
+}
+
+
+void svm_prog_free(svm_prog_t *prog) {
+  free(prog);
+}
+
+
+/**
+ * Bind opcodes `first` through `last` to `fn`. Returns 0, registering
+ * nothing, if the range overlaps a built-in opcode, or once a verified
+ * vm is attached: it runs unchecked handlers proven with no natives.
+ */
+int svm_prog_native(svm_prog_t *prog, unsigned char first, unsigned char last,
+                    op_format_t format, svm_native_t fn, void *udata) {
+  if (first > last || prog->sealed) return 0;
+
+  for (unsigned int op = first; op <= last; op++)
+    if (op_is_builtin(op)) return 0;
+
+  for (unsigned int op = first; op <= last; op++) {
+    if (!prog->natives[op].fn) prog->nnatives++;
+    prog->natives[op].fn = fn;
+    prog->natives[op].format = format;
+    prog->natives[op].udata = udata;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Set the stack size vms running the program get, and whether they keep
+ * frame records.
+ */
+void svm_prog_stack(svm_prog_t *prog, unsigned int limit, int frame_records) {
+  prog->stack_limit = limit;
+  prog->frame_records = frame_records;
+}
+
+
+/**
+ * Give vms running the program a read-only code segment, see svm_segments.
+ */
+void svm_prog_segments(svm_prog_t *prog, int on) {
+  prog->segments = on;
+}
+
+
+/**
+ * Attach before running. The verifier knows nothing about what native
+ * handlers do to registers, so a vm running a program with natives keeps
+ * the checked handlers.
+ */
+void svm_prog_attach(svm_t *cpu, svm_prog_t *prog) {
+  cpu->prog = prog;
+  if (!prog) return;
+
+  if (prog->nnatives && cpu->verified) {
+    op_code_init(cpu);
+    cpu->verified = 0;
+  }
+
+  unsigned int limit = prog->stack_limit ? prog->stack_limit : SVM_STACK_DEFAULT;
+  if (limit != cpu->stack.limit) svm_stack_init(cpu, limit);
+  cpu->stack.record = prog->frame_records;
+  if (prog->segments) svm_segments(cpu, 1);
+  if (cpu->verified) prog->sealed = 1;
+}
+
+
+void svm_prog_call(svm_t *cpu) {
+  svm_native_entry_t *native = &cpu->prog->natives[cpu->code[cpu->ip]];
+  op_insn_t insn;
+
+  if (!op_decode_as(cpu->code, 0xffff, cpu->ip, native->format, &insn))
+    svm_panic(cpu, "native opcode runs past the end of memory");
+
+  for (unsigned int i = 0; i < insn.nreg; i++)
+    if (insn.reg[i] >= REGISTER_COUNT) svm_panic(cpu, "register out of bounds");
+
+  cpu->ip += insn.length;
+
+  if (native->fn(cpu, &insn, native->udata) != 0)
+    svm_panic(cpu, "native opcode failed");
+}
+
+
+int svm_reg_int(svm_t *cpu, unsigned int reg) {
+  if (reg >= REGISTER_COUNT) svm_panic(cpu, "register out of bounds");
+  if (cpu->registers[reg].type != NUMBER)
+    svm_panic(cpu, "The register doesn't contain an number");
+  return cpu->registers[reg].value.number;
+}
+
+
+const char *svm_reg_string(svm_t *cpu, unsigned int reg) {
+  if (reg >= REGISTER_COUNT) svm_panic(cpu, "register out of bounds");
+  if (cpu->registers[reg].type != STRING)
+    svm_panic(cpu, "the register doesn't contain a string");
+  return cpu->registers[reg].value.string;
+}
+
+
+int svm_reg_is_string(svm_t *cpu, unsigned int reg) {
+  if (reg >= REGISTER_COUNT) svm_panic(cpu, "register out of bounds");
+  return cpu->registers[reg].type == STRING;
+}
+
+
+void svm_reg_set_int(svm_t *cpu, unsigned int reg, int value) {
+  if (reg >= REGISTER_COUNT) svm_panic(cpu, "register out of bounds");
+  reg_t *r = &cpu->registers[reg];
+
+  if (r->type == STRING) svm_str_unref(r->value.string);
+  r->type = NUMBER;
+  r->value.number = value;
+}
+
+
+/**
+ * Store a copy of `len` bytes of `str`.
+ */
+void svm_reg_set_string(svm_t *cpu, unsigned int reg, const char *str, size_t len) {
+  if (reg >= REGISTER_COUNT) svm_panic(cpu, "register out of bounds");
+
+  char *copy = svm_str_new(str, len);
+  if (!copy) svm_panic(cpu, "RAM allocation failure.");
+
+  reg_t *r = &cpu->registers[reg];
+  if (r->type == STRING) svm_str_unref(r->value.string);
+  r->type = STRING;
+  r->value.string = copy;
+}
+
+
+void svm_mem_read(svm_t *cpu, unsigned int addr, void *buf, size_t len) {
+  if (addr > 0xffff || len > 0xffff - addr) svm_panic(cpu, "memory access out of bounds");
+  memcpy(buf, cpu->code + addr, len);
+}
+
+
+void svm_mem_write(svm_t *cpu, unsigned int addr, const void *buf, size_t len) {
+  if (addr > 0xffff || len > 0xffff - addr) svm_panic(cpu, "memory access out of bounds");
+  if (len && addr < cpu->data) svm_panic(cpu, "writing to the code segment");
+  memcpy(cpu->code + addr, buf, len);
+  svm_dirty_range(cpu, addr, len);
+}
@@ -0,0 +1,58 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef PROG_H
+#define PROG_H
+
+#include "svm.h"
+#include "op.h"
+
+/**
+ * A native handler gets the instruction decoded with the format it was
+ * registered with. ip already points past the instruction, so a handler
+ * that jumps just sets it. Return non-zero to panic the vm.
+ */
+typedef int (*svm_native_t)(svm_t *cpu, const op_insn_t *insn, void *udata);
+
+typedef struct svm_native_entry_t svm_native_entry_t;
+
+struct svm_native_entry_t {
+  svm_native_t fn;
+  op_format_t format;
+  void *udata;
+};
+
+/* state shared by every vm running the same program */
+struct svm_prog_t {
+  svm_native_entry_t natives[256];
+  unsigned int nnatives;
+
+  unsigned int stack_limit;   /* stack slots, 0 for SVM_STACK_DEFAULT */
+  int frame_records;          /* record calls for svm_backtrace */
+  int segments;               /* separate code and data, see svm_segments */
+  int sealed;                 /* a verified vm is attached, no more natives */
+};
+
+svm_prog_t *svm_prog_new(void);
+void svm_prog_free(svm_prog_t *prog);
+int svm_prog_native(svm_prog_t *prog, unsigned char first, unsigned char last,
+                    op_format_t format, svm_native_t fn, void *udata);
+void svm_prog_stack(svm_prog_t *prog, unsigned int limit, int frame_records);
+void svm_prog_segments(svm_prog_t *prog, int on);
+void svm_prog_attach(svm_t *cpu, svm_prog_t *prog);
+void svm_prog_call(svm_t *cpu);
+
+/* register and memory access for native handlers */
+int svm_reg_int(svm_t *cpu, unsigned int reg);
+const char *svm_reg_string(svm_t *cpu, unsigned int reg);
+int svm_reg_is_string(svm_t *cpu, unsigned int reg);
+void svm_reg_set_int(svm_t *cpu, unsigned int reg, int value);
+void svm_reg_set_string(svm_t *cpu, unsigned int reg, const char *str, size_t len);
+void svm_mem_read(svm_t *cpu, unsigned int addr, void *buf, size_t len);
+void svm_mem_write(svm_t *cpu, unsigned int addr, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "svm.h"
+#include "trace.h"
+
+/**
+ * Random numbers.
+ *
+ * Each vm has its own xoshiro128** generator, so vms on different threads
+ * never share state and a vm seeded with svm_seed (or SEED=n in the
+ * environment) produces the same numbers every run. Unseeded vms start
+ * from the clock and their own address.
+ */
+
+
+static unsigned long long splitmix64(unsigned long long *x) {
+  unsigned long long z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+
+static unsigned int rotl(unsigned int x, int k) {
+  return (x << k) | (x >> (32 - k));
+}
+
+
+void svm_seed(svm_t *cpu, unsigned long long seed) {
+  unsigned long long a = splitmix64(&seed);
+  unsigned long long b = splitmix64(&seed);
+
+  cpu->rng.s[0] = (unsigned int) a;
+  cpu->rng.s[1] = (unsigned int) (a >> 32);
+  cpu->rng.s[2] = (unsigned int) b;
+  cpu->rng.s[3] = (unsigned int) (b >> 32);
+
+  if (cpu->trace) svm_trace_seed(cpu);
+}
+
+
+/* the seed a vm starts with */
+unsigned long long svm_seed_default(svm_t *cpu) {
+  const char *env = getenv("SEED");
+  if (env != NULL) return strtoull(env, NULL, 0);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec) ^ (uintptr_t) cpu;
+}
+
+
+unsigned int svm_random(svm_t *cpu) {
+  unsigned int *s = cpu->rng.s;
+  unsigned int result = rotl(s[1] * 5, 7) * 9;
+  unsigned int t = s[1] << 9;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 11);
+
+  return result;
+}
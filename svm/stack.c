@@ -0,0 +1,218 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "svm.h"
+#include "stack.h"
+#include "str.h"
+
+/**
+ * The vm stack.
+ *
+ * svm_stack_init reserves room for `limit` slots plus a guard page, all
+ * inaccessible, and commits the first page. A push onto an uncommitted
+ * page faults; the SIGSEGV handler commits more and lets the write retry.
+ * A push onto the guard page is an overflow, and the handler jumps back
+ * to svm_stack_run which panics, as it does if committing fails. Faults
+ * anywhere else go to whatever handler was installed before us.
+ *
+ * The handler is process-wide: the first vm installs it over SIGSEGV for
+ * good. A host that wants its own handler should install it before
+ * creating a vm, so it is chained to, rather than after.
+ */
+
+static __thread svm_run_ctx_t *current;
+static struct sigaction previous;
+static int installed;
+static size_t page;
+
+
+static size_t round_page(size_t n) {
+  return (n + page - 1) & ~(page - 1);
+}
+
+
+static void on_segv(int sig, siginfo_t *info, void *uctx) {
+  svm_run_ctx_t *ctx = current;
+
+  if (ctx) {
+    svm_stack_t *s = &ctx->cpu->stack;
+    char *addr = info->si_addr;
+    char *guard = s->map + s->map_size - page;
+
+    if (addr >= s->map + s->committed && addr < guard) {
+      /* commit at least double what we had, up to the guard */
+      size_t want = round_page(addr - s->map + 1);
+      if (want < s->committed * 2) want = s->committed * 2;
+      if (want > s->map_size - page) want = s->map_size - page;
+
+      if (mprotect(s->map + s->committed, want - s->committed, PROT_READ | PROT_WRITE) == 0) {
+        s->committed = want;
+        return;
+      }
+      siglongjmp(ctx->env, 2);
+    }
+
+    if (addr >= guard && addr < s->map + s->map_size)
+      siglongjmp(ctx->env, 1);
+  }
+
+  /* not ours, hand it on and stay installed for the next vm fault */
+  if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction) {
+    previous.sa_sigaction(sig, info, uctx);
+  } else if (previous.sa_handler == SIG_IGN && info->si_code <= 0) {
+    return;     /* sent, not a fault, and ignored */
+  } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+    previous.sa_handler(sig);
+  } else {
+    /* the process was going to die of it, let it */
+    signal(SIGSEGV, SIG_DFL);
+    raise(SIGSEGV);
+  }
+}
+
+
+static void install(void) {
+  if (__atomic_exchange_n(&installed, 1, __ATOMIC_SEQ_CST)) return;
+
+  struct sigaction sa;
+  memset(&sa, '\0', sizeof(sa));
+  sa.sa_sigaction = on_segv;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, &previous);
+}
+
+
+void svm_stack_init(svm_t *cpu, unsigned int limit) {
+  if (!page) page = sysconf(_SC_PAGESIZE);
+  install();
+  svm_stack_free(cpu);
+
+  svm_stack_t *s = &cpu->stack;
+  size_t bytes = ((size_t) limit + 1) * sizeof(reg_t);
+  size_t size = round_page(bytes) + page;
+
+  char *map = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) svm_panic(cpu, "out of memory");
+
+  s->map = map;
+  s->map_size = size;
+  s->limit = limit;
+
+  /* end the last slot flush against the guard page */
+  s->base = (reg_t *) (map + round_page(bytes) - bytes);
+
+  s->committed = page;
+  if (mprotect(map, page, PROT_READ | PROT_WRITE) != 0)
+    svm_panic(cpu, "out of memory");
+
+  cpu->sp = 0;
+}
+
+
+void svm_stack_free(svm_t *cpu) {
+  svm_stack_t *s = &cpu->stack;
+
+  if (s->map) {
+    for (int i = 1; i <= cpu->sp; i++)
+      if (s->base[i].type == STRING) svm_str_unref(s->base[i].value.string);
+    munmap(s->map, s->map_size);
+  }
+  free(s->frames);
+
+  int record = s->record;
+  memset(s, '\0', sizeof(*s));
+  s->record = record;
+}
+
+
+/**
+ * Run `fn` with overflow detection for `cpu`. Returns 0 if the stack
+ * overflowed or couldn't grow, after panicking.
+ */
+int svm_stack_run(svm_t *cpu, void (*fn)(svm_t *, int), int max) {
+  svm_run_ctx_t ctx, *outer = current;
+  ctx.cpu = cpu;
+
+  int why = sigsetjmp(ctx.env, 1);
+  if (why) {
+    svm_stack_t *s = &cpu->stack;
+    current = outer;
+    cpu->running = 0;
+
+    if (why == 2) {
+      /* only slots in committed pages can have been written */
+      int top = (s->map + s->committed - (char *) s->base) / sizeof(reg_t) - 1;
+      if (cpu->sp > top) cpu->sp = top;
+      svm_panic(cpu, "out of memory - the stack can't grow");
+    } else {
+      cpu->sp = s->limit;
+      svm_panic(cpu, "stack overflow - stack is full");
+    }
+    return 0;
+  }
+
+  current = &ctx;
+  fn(cpu, max);
+  current = outer;
+  return 1;
+}
+
+
+void svm_frame_push(svm_t *cpu, unsigned int site, unsigned int callee) {
+  svm_stack_t *s = &cpu->stack;
+
+  if (s->nframes == s->frames_cap) {
+    unsigned int cap = s->frames_cap ? s->frames_cap * 2 : 64;
+    svm_frame_t *frames = realloc(s->frames, cap * sizeof(*frames));
+    if (!frames) svm_panic(cpu, "out of memory");
+    s->frames = frames;
+    s->frames_cap = cap;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  svm_frame_t *f = &s->frames[s->nframes++];
+  f->site = site;
+  f->callee = callee;
+  f->sp = cpu->sp;
+  f->entry_ns = (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void svm_frame_pop(svm_t *cpu) {
+  if (cpu->stack.nframes) cpu->stack.nframes--;
+}
+
+
+/**
+ * Print the frame records, innermost first.
+ */
+void svm_backtrace(svm_t *cpu, FILE *fp) {
+  svm_stack_t *s = &cpu->stack;
+  unsigned int ip = cpu->ip;
+
+  fprintf(fp, "backtrace:\n");
+
+  for (unsigned int i = s->nframes, n = 0; i > 0; i--, n++) {
+    svm_frame_t *f = &s->frames[i - 1];
+    fprintf(fp, "\t#%u %04X in %04X\n", n, ip, f->callee);
+    ip = f->site;
+  }
+
+  fprintf(fp, "\t#%u %04X in %04X\n", s->nframes, ip, 0);
+}
@@ -0,0 +1,24 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef STACK_H
+#define STACK_H
+
+#include <setjmp.h>
+
+#include "svm.h"
+
+typedef struct svm_run_ctx_t svm_run_ctx_t;
+
+struct svm_run_ctx_t {
+  svm_t *cpu;
+  sigjmp_buf env;
+};
+
+int svm_stack_run(svm_t *cpu, void (*fn)(svm_t *, int), int max);
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "str.h"
+
+
+/**
+ * Allocate a string of `len` characters with one reference. The contents
+ * are left for the caller to fill in, apart from the terminator.
+ */
+char *svm_str_alloc(size_t len) {
+  svm_str_t *str = malloc(sizeof(*str) + len + 1);
+  if (!str) return NULL;
+
+  str->refs = 1;
+  str->hash = str->hashed = 0;
+  str->len = str->cap = len;
+
+  char *s = (char *) (str + 1);
+  s[len] = '\0';
+  return s;
+}
+
+
+char *svm_str_new(const char *data, size_t len) {
+  char *s = svm_str_alloc(len);
+  if (s) memcpy(s, data, len);
+  return s;
+}
+
+
+char *svm_str_ref(char *s) {
+  if (s) SVM_STR(s)->refs++;
+  return s;
+}
+
+
+void svm_str_unref(char *s) {
+  if (s && --SVM_STR(s)->refs == 0) free(SVM_STR(s));
+}
+
+
+/**
+ * Append `len` bytes to `s`, which must hold the only reference. Spare
+ * capacity grows geometrically, so building a string up one piece at a
+ * time is amortized O(1) per append. `data` may point into `s` itself.
+ * Returns the string, which may have moved, or NULL leaving `s` intact.
+ */
+char *svm_str_append(char *s, const char *data, size_t len) {
+  svm_str_t *str = SVM_STR(s);
+  size_t need = str->len + len;
+
+  if (need > str->cap) {
+    size_t cap = str->cap * 2;
+    if (cap < need) cap = need;
+    if (cap < 16) cap = 16;
+
+    size_t offset = (data >= s && data <= s + str->len) ? (size_t) (data - s) : (size_t) -1;
+
+    str = realloc(str, sizeof(*str) + cap + 1);
+    if (!str) return NULL;
+    str->cap = cap;
+    s = (char *) (str + 1);
+
+    if (offset != (size_t) -1) data = s + offset;
+  }
+
+  memmove(s + str->len, data, len);
+  str->len = need;
+  str->hashed = 0;
+  s[need] = '\0';
+  return s;
+}
+
+
+unsigned int svm_hash_bytes(const void *data, size_t len) {
+  const unsigned char *p = data;
+  unsigned int hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+
+unsigned int svm_str_hash(char *s) {
+  svm_str_t *str = SVM_STR(s);
+
+  if (!str->hashed) {
+    str->hash = svm_hash_bytes(s, str->len);
+    str->hashed = 1;
+  }
+
+  return str->hash;
+}
+
+
+/**
+ * Lengths, and hashes when both are already known, settle most unequal
+ * pairs without looking at the contents.
+ */
+int svm_str_equal(char *a, char *b) {
+  svm_str_t *sa = SVM_STR(a), *sb = SVM_STR(b);
+
+  if (a == b) return 1;
+  if (sa->len != sb->len) return 0;
+  if (sa->hashed && sb->hashed && sa->hash != sb->hash) return 0;
+
+  return memcmp(a, b, sa->len) == 0;
+}
@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef STR_H
+#define STR_H
+
+#include <stddef.h>
+
+/**
+ * Register and stack strings are refcounted. The header sits in front of
+ * the characters, which stay NUL terminated, so a string is still passed
+ * around as a plain char *. Strings are never modified once they have
+ * more than one reference; with only one they can be appended to in
+ * place, see svm_str_append.
+ */
+typedef struct svm_str_t svm_str_t;
+
+struct svm_str_t {
+  unsigned int refs;
+  unsigned int hash, hashed;   /* FNV-1a of the contents, once asked for */
+  size_t len, cap;
+};
+
+#define SVM_STR(s) ((svm_str_t *) (s) - 1)
+
+char *svm_str_alloc(size_t len);
+char *svm_str_new(const char *data, size_t len);
+char *svm_str_ref(char *s);
+void svm_str_unref(char *s);
+char *svm_str_append(char *s, const char *data, size_t len);
+unsigned int svm_str_hash(char *s);
+int svm_str_equal(char *a, char *b);
+unsigned int svm_hash_bytes(const void *data, size_t len);
+
+static inline size_t svm_str_len(const char *s) {
+  return SVM_STR(s)->len;
+}
+
+#endif
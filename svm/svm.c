@@ -11,13 +11,23 @@
 
 #include "svm.h"
 #include "op.h"
+#include "prog.h"
+#include "verify.h"
+#include "stack.h"
+#include "str.h"
+#include "trace.h"
 
 void svm_panic(svm_t * cpu, char *msg) {
+	if (cpu) svm_output_flush(cpu);
+	if (cpu && cpu->trace && !cpu->trace->replay && cpu->trace->path)
+		svm_trace_save(cpu->trace, cpu->trace->path);
 	if (cpu && cpu->panic) {
 		(*cpu->panic)(msg);
 		return;
 	}
-	fprintf(stderr, "\x1b[31mpanic\x1b[0m: %s\n", msg); exit(1);
+	fprintf(stderr, "\x1b[31mpanic\x1b[0m: %s\n", msg);
+	if (cpu && cpu->stack.nframes) svm_backtrace(cpu, stderr);
+	exit(1);
 }
 
 
@@ -68,9 +78,19 @@ svm_t *svm_new(unsigned char *code, unsigned int size) {
   }
 
   cpu->flags.z = 0;
-  cpu->sp = 0;
+  svm_stack_init(cpu, SVM_STACK_DEFAULT);
 
+  svm_seed(cpu, svm_seed_default(cpu));
   op_code_init(cpu);
+  svm_host_set(cpu, SVM_HOST_SYSTEM, svm_host_spawn, NULL);
+
+  if (getenv("SEGMENTS") != NULL) cpu->data = size;
+
+  /* verified programs can skip the runtime checks, but not the tracing */
+  if (getenv("DEBUG") == NULL) svm_verify(cpu);
+
+  if (getenv("TRACE") != NULL) svm_trace_start(cpu, getenv("TRACE"), SVM_TRACE_DEFAULT);
+
   return cpu;
 }
 
@@ -80,6 +100,24 @@ void svm_panic_set(svm_t *cpu, void (*panic)(char *msg)) {
 }
 
 
+/**
+ * Split memory in two. The loaded image becomes a read-only code segment
+ * and the rest a data segment: writes below it and running past its end
+ * panic, reaching the end exits. Since the code can no longer change,
+ * programs that write memory can be verified too. Off by default, quines
+ * need the two as one.
+ */
+void svm_segments(svm_t *cpu, int on) {
+	unsigned int data = on ? cpu->size : 0;
+	if (data == cpu->data) return;
+
+	cpu->data = data;
+	op_code_init(cpu);
+	cpu->verified = 0;
+	if (getenv("DEBUG") == NULL && !(cpu->prog && cpu->prog->nnatives)) svm_verify(cpu);
+}
+
+
 void svm_reg_dump(svm_t * cpu) {
 	printf("register dump\n");
 
@@ -105,11 +143,22 @@ void svm_reg_dump(svm_t * cpu) {
 
 	if (cpu->flags.z) printf("\tz-flag: true\n");
 	else printf("\tz=z-flag: false\n");
+	printf("\ts-flag: %u, c-flag: %u, o-flag: %u\n", cpu->flags.s, cpu->flags.c, cpu->flags.o);
 }
 
 
 void svm_free(svm_t *cpu) {
 	if (!cpu) return;
+	svm_output_flush(cpu);
+	if (cpu->trace) {
+		if (!cpu->trace->replay && cpu->trace->path) svm_trace_save(cpu->trace, cpu->trace->path);
+		svm_trace_free(cpu->trace);
+	}
+	svm_host_cancel(cpu);
+	svm_patch_discard(cpu);
+	svm_stack_free(cpu);
+	for (int i = 0; i < REGISTER_COUNT; i++)
+		if (cpu->registers[i].type == STRING) svm_str_unref(cpu->registers[i].value.string);
 	if (cpu->code) {
 		free(cpu->code);
 		cpu->code = NULL;
@@ -118,24 +167,33 @@ void svm_free(svm_t *cpu) {
 }
 
 
-void svm_run(svm_t *cpu) {
-	svm_run_n_max(cpu, 0);
-}
-
-
-void svm_run_n_max(svm_t *cpu, int max) {
-	if (!cpu) return;
-	cpu->ip = 0; int count = 0;
+static void dispatch(svm_t *cpu, int max) {
+	int count = 0, iterations;
+	int debug = getenv("DEBUG") != NULL;
 
-	for (int iterations = 0; cpu->running; iterations++) {
+	for (iterations = 0; cpu->running && !cpu->suspended; iterations++) {
+		if (__atomic_load_n(&cpu->patch, __ATOMIC_RELAXED)) svm_patch_apply(cpu);
+		if (cpu->data && cpu->ip >= cpu->data) {
+			/* running off the end stops, like the zeros past the image would */
+			if (cpu->ip > cpu->data) svm_panic(cpu, "Running outside the code segment");
+			cpu->running = 0;
+			break;
+		}
 		if (cpu->ip >= 0xffff) cpu->ip = 0;
 		int opcode = cpu->code[cpu->ip];
 
-		if (getenv("DEBUG") != NULL) {
+		if (debug) {
 			printf("%04x - parsing op_code hex:%02X\n", cpu->ip, opcode);
 		}
 
-		if (cpu->op_codes[opcode] != NULL) cpu->op_codes[opcode](cpu);
+		if (cpu->trace) {
+			svm_trace_step(cpu);
+			if (!cpu->running) break;
+		}
+
+		op_code_t handler = cpu->op_codes[opcode];
+		if (handler != NULL) handler(cpu);
+		else op_unknown(cpu);
 		iterations++;
 
 		if(max && iterations >= max) {
@@ -145,7 +203,46 @@ void svm_run_n_max(svm_t *cpu, int max) {
         count++;
 	}
 
-	if (getenv("DEBUG") != NULL) {
+	/* a host call stopped us short, svm_resume carries on with the rest,
+	   or not at all if that was the last of it */
+	cpu->budget = 0;
+	if (max && cpu->suspended) cpu->budget = (iterations < max) ? max - iterations : -1;
+
+	if (debug) {
 			printf("executed %u instructions\n", count);
 	}
 }
+
+
+static void run_loop(svm_t *cpu, int max) {
+	svm_stack_run(cpu, dispatch, max);
+	svm_output_flush(cpu);
+}
+
+
+void svm_run(svm_t *cpu) {
+	svm_run_n_max(cpu, 0);
+}
+
+
+void svm_run_n_max(svm_t *cpu, int max) {
+	if (!cpu) return;
+	cpu->ip = 0;
+	run_loop(cpu, max);
+}
+
+
+/**
+ * Carry on from where a host call suspended the vm, with what was left
+ * of the instruction limit. Call once svm_poll says the call has
+ * finished.
+ */
+void svm_resume(svm_t *cpu) {
+	if (!cpu || cpu->child) return;
+	cpu->suspended = 0;
+	if (cpu->budget < 0) {
+		cpu->running = 0;
+		return;
+	}
+	run_loop(cpu, cpu->budget);
+}
@@ -8,18 +8,56 @@
 #ifndef SVM_H
 #define SVM_H
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define REGISTER_COUNT 16
+#define SVM_OUTPUT_SIZE 4096
+#define SVM_STACK_DEFAULT 1024
+
+/* output flush policies */
+#define SVM_FLUSH_FULL 0  /* when the buffer fills, or the vm stops */
+#define SVM_FLUSH_LINE 1  /* after every newline */
+#define SVM_FLUSH_NONE 2  /* after every write */
+
+/* host call slots */
+#define SVM_HOST_SYSTEM 0
+#define SVM_HOST_MAX 16
+
+/* memory is tracked for writes in blocks of this many bytes, see dirty.c */
+#define SVM_BLOCK_SHIFT 8
+#define SVM_BLOCK_SIZE (1 << SVM_BLOCK_SHIFT)
+#define SVM_BLOCKS (0x10000 >> SVM_BLOCK_SHIFT)
+
+/* host call results */
+#define SVM_HOST_DONE 0
+#define SVM_HOST_PENDING 1  /* suspend the vm until svm_host_complete */
 
 typedef struct svm_t svm_t;
 typedef struct reg_t reg_t;
 typedef struct flag_t flag_t;
+typedef struct svm_output_t svm_output_t;
+typedef struct svm_capture_t svm_capture_t;
+typedef struct svm_host_t svm_host_t;
+typedef struct svm_prog_t svm_prog_t;
+typedef struct svm_stack_t svm_stack_t;
+typedef struct svm_frame_t svm_frame_t;
+typedef struct svm_trace_t svm_trace_t;
+typedef struct svm_rng_t svm_rng_t;
+typedef struct svm_remap_t svm_remap_t;
+typedef struct svm_patch_t svm_patch_t;
 
 typedef void (*op_code_t)(svm_t *vm);
+typedef void (*svm_sink_t)(void *udata, const struct iovec *iov, int iovcnt);
+typedef int (*svm_host_fn_t)(svm_t *cpu, const char *arg, void *udata);
 
 struct flag_t {
 	unsigned int z;
+	unsigned int s;  /* result was negative */
+	unsigned int c;  /* unsigned carry or borrow */
+	unsigned int o;  /* signed overflow */
 };
 
 struct reg_t {
@@ -31,6 +69,74 @@ struct reg_t {
   enum { NUMBER, STRING } type;
 };
 
+struct svm_output_t {
+  char buf[SVM_OUTPUT_SIZE];
+  size_t len;
+  int policy;
+  svm_sink_t sink;
+  void *udata;
+};
+
+/* in-memory output, for use with svm_sink_capture */
+struct svm_capture_t {
+  char *data;
+  size_t len, cap;
+};
+
+struct svm_host_t {
+  svm_host_fn_t fn;
+  void *udata;
+};
+
+/* xoshiro128** state */
+struct svm_rng_t {
+  unsigned int s[4];
+};
+
+/**
+ * [from, from + len) of the old code is at `to` in a patch. With `same`
+ * set the bytes didn't change and every address inside moves with them,
+ * otherwise only `from` does.
+ */
+struct svm_remap_t {
+  unsigned int from, len, to;
+  int same;
+};
+
+/* a code image waiting to replace the running one */
+struct svm_patch_t {
+  unsigned char *code;
+  unsigned int size;
+  svm_remap_t *map;
+  unsigned int nmap;
+  int keep;          /* no map, every address stays put */
+};
+
+/* one call, kept while frame records are on */
+struct svm_frame_t {
+  unsigned int site;             /* address of the call instruction */
+  unsigned int callee;
+  int sp;                        /* sp after the return address went on */
+  unsigned long long entry_ns;   /* monotonic clock at the call */
+};
+
+/**
+ * The stack lives in its own mapping. Slots are typed like registers.
+ * Pages are committed as pushes reach them and the page past `limit`
+ * slots is a guard, so overflow is caught by the fault rather than by a
+ * compare on every push.
+ */
+struct svm_stack_t {
+  reg_t *base;          /* slot 0 is never used, sp counts from 1 */
+  unsigned int limit;
+  char *map;
+  size_t map_size, committed;
+
+  int record;
+  svm_frame_t *frames;
+  unsigned int nframes, frames_cap;
+};
+
 struct svm_t {
   reg_t registers[REGISTER_COUNT];
   flag_t flags;
@@ -39,23 +145,86 @@ struct svm_t {
 
   unsigned char *code;
   unsigned int size;
+  unsigned int data;   /* where the data segment starts, 0 while code and data are one */
+  unsigned long long dirty[SVM_BLOCKS / 64];  /* blocks written since svm_dirty_clear */
 
   void (*panic)(char *msg);
   int running;
+  int verified;
   
-  op_code_t op_codes[256];
-  int stack[1024]; int sp;
+  const op_code_t *op_codes;   /* one of the shared tables in op.c */
+  svm_stack_t stack; int sp;
+
+  svm_output_t out;
+
+  svm_host_t host[SVM_HOST_MAX];
+  int suspended;     /* waiting on a host call */
+  pid_t child;       /* process an async host call is waiting on */
+  int host_status;   /* result of the last host call */
+  int budget;        /* left of svm_run_n_max's limit when suspended, 0 for no limit, -1 if used up */
+
+  svm_prog_t *prog;  /* shared by every vm running the program, not owned */
+  svm_trace_t *trace;
+  svm_rng_t rng;
+  svm_patch_t *patch;  /* waiting for a safe point */
 };
 
+/* note a write to the byte at `addr` */
+#define SVM_DIRTY(cpu, addr) \
+  ((cpu)->dirty[(addr) >> (SVM_BLOCK_SHIFT + 6)] |= 1ull << (((addr) >> SVM_BLOCK_SHIFT) & 63))
+
 svm_t *svm_new(unsigned char *code, unsigned int size);
 void svm_run_n_max(svm_t * cpu, int max);
 void svm_run(svm_t *cpu);
+void svm_resume(svm_t *cpu);
 void svm_free(svm_t *cpu);
 
 void svm_panic(svm_t * cpu, char *msg);
 void svm_panic_set(svm_t *cpu, void (*panic)(char *msg));
+void svm_segments(svm_t *cpu, int on);
 void svm_reg_dump(svm_t * cpu);
 
+void svm_stack_init(svm_t *cpu, unsigned int limit);
+void svm_stack_free(svm_t *cpu);
+void svm_frame_push(svm_t *cpu, unsigned int site, unsigned int callee);
+void svm_frame_pop(svm_t *cpu);
+void svm_backtrace(svm_t *cpu, FILE *fp);
+
+void svm_output_set(svm_t *cpu, svm_sink_t sink, void *udata, int policy);
+void svm_output_flush(svm_t *cpu);
+void svm_write(svm_t *cpu, const char *data, size_t len);
+
+void svm_sink_stdout(void *udata, const struct iovec *iov, int iovcnt);
+void svm_sink_fd(void *udata, const struct iovec *iov, int iovcnt);
+void svm_sink_capture(void *udata, const struct iovec *iov, int iovcnt);
+
+void svm_host_set(svm_t *cpu, int slot, svm_host_fn_t fn, void *udata);
+void svm_host_complete(svm_t *cpu, int status);
+int svm_poll(svm_t *cpu);
+void svm_host_cancel(svm_t *cpu);
+
+int svm_host_spawn(svm_t *cpu, const char *arg, void *udata);
+int svm_host_spawn_async(svm_t *cpu, const char *arg, void *udata);
+
+void svm_seed(svm_t *cpu, unsigned long long seed);
+unsigned long long svm_seed_default(svm_t *cpu);
+unsigned int svm_random(svm_t *cpu);
+
+int svm_patch(svm_t *cpu, const unsigned char *code, unsigned int size,
+  const svm_remap_t *map, unsigned int nmap);
+int svm_patch_apply(svm_t *cpu);
+int svm_patch_pending(svm_t *cpu);
+void svm_patch_discard(svm_t *cpu);
+
+void svm_dirty_range(svm_t *cpu, unsigned int addr, unsigned int len);
+int svm_dirty(const svm_t *cpu, unsigned int addr);
+unsigned int svm_dirty_next(const svm_t *cpu, unsigned int block);
+unsigned int svm_dirty_count(const svm_t *cpu);
+void svm_dirty_clear(svm_t *cpu);
+
+size_t svm_format_int(char *buf, int val);
+size_t svm_format_hex(char *buf, unsigned int val, int width);
+
 
 
 #endif
\ No newline at end of file
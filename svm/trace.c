@@ -0,0 +1,388 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "svm.h"
+#include "op.h"
+#include "str.h"
+#include "trace.h"
+
+/**
+ * Execution traces.
+ *
+ * Every instruction leaves a 12 byte record in a ring: where it was, the
+ * flags going in and the values of its first two register operands. The
+ * generator state and the system calls the run saw are kept as events,
+ * which is all a replay needs to take the same path again; the records
+ * are how it checks that it did.
+ *
+ * On disk, all little-endian:
+ *
+ *   "SVMT" version32 size32 code[size] count64
+ *   n32 record[n]                      ip16 opcode8 flags8 value32 value32
+ *   nevents32 event[nevents]           seq64 kind8 value32 len32 data[len]
+ *
+ * with the records oldest first.
+ */
+
+#define TRACE_MAGIC "SVMT"
+#define TRACE_VERSION 2
+
+/* which operand bytes name registers, by format */
+static unsigned char operand_regs(unsigned char opcode) {
+  switch (op_format(opcode)) {
+    case OPF_RR: case OPF_RRR: return 2;
+    case OPF_R: case OPF_RI: case OPF_RS: case OPF_RIA:
+    case OPF_SWITCH: case OPF_TABLE: return 1;
+    default: return 0;
+  }
+}
+
+
+static svm_trace_t *trace_new(void) {
+  svm_trace_t *t = calloc(1, sizeof(*t));
+  if (!t) svm_panic(NULL, "out of memory");
+  return t;
+}
+
+
+static void trace_attach(svm_t *cpu, svm_trace_t *t) {
+  if (cpu->trace && cpu->trace != t) svm_trace_free(cpu->trace);
+  cpu->trace = t;
+}
+
+
+/**
+ * Record the vm from here on, saving to `path` when it is freed or
+ * panics.
+ */
+void svm_trace_start(svm_t *cpu, const char *path, unsigned int records) {
+  svm_trace_t *t = trace_new();
+
+  t->cap = records ? records : SVM_TRACE_DEFAULT;
+  t->ring = malloc(t->cap * sizeof(svm_trace_rec_t));
+  t->code = malloc(cpu->size);
+  t->path = path ? strdup(path) : NULL;
+  if (!t->ring || !t->code || (path && !t->path)) svm_panic(cpu, "out of memory");
+
+  memcpy(t->code, cpu->code, cpu->size);
+  t->size = cpu->size;
+
+  trace_attach(cpu, t);
+  svm_trace_seed(cpu);
+}
+
+
+unsigned int svm_trace_records(const svm_trace_t *t) {
+  unsigned long long end = t->replay ? t->total : t->count;
+  return (end < t->cap) ? (unsigned int) end : t->cap;
+}
+
+
+const svm_trace_rec_t *svm_trace_record(const svm_trace_t *t, unsigned int i) {
+  unsigned long long end = t->replay ? t->total : t->count;
+  return &t->ring[(end - svm_trace_records(t) + i) % t->cap];
+}
+
+
+static void fill(const svm_t *cpu, svm_trace_rec_t *r) {
+  const unsigned char *op = cpu->code + cpu->ip;
+  unsigned int nregs = operand_regs(op[0]);
+
+  r->ip = cpu->ip;
+  r->opcode = op[0];
+  r->flags = (cpu->flags.z ? SVM_TF_Z : 0) | (cpu->flags.s ? SVM_TF_S : 0) |
+             (cpu->flags.c ? SVM_TF_C : 0) | (cpu->flags.o ? SVM_TF_O : 0);
+  r->value[0] = r->value[1] = 0;
+
+  for (unsigned int i = 0; i < nregs && cpu->ip + 1 + i < 0xffff; i++) {
+    unsigned int reg = op[1 + i];
+    if (reg >= REGISTER_COUNT) break;
+
+    const reg_t *v = &cpu->registers[reg];
+    if (v->type == STRING) {
+      r->flags |= (i ? SVM_TF_STR1 : SVM_TF_STR0);
+      r->value[i] = v->value.string ? (unsigned int) svm_str_len(v->value.string) : 0;
+    } else {
+      r->value[i] = v->value.number;
+    }
+  }
+}
+
+
+/**
+ * Called before each instruction. Replaying, checks the instruction
+ * against the recording once the run reaches the part the ring kept, and
+ * stops where the recording did.
+ */
+void svm_trace_step(svm_t *cpu) {
+  svm_trace_t *t = cpu->trace;
+
+  if (!t->replay) {
+    fill(cpu, &t->ring[t->count++ % t->cap]);
+    return;
+  }
+
+  if (t->count >= t->total) {
+    cpu->running = 0;
+    return;
+  }
+
+  /* put the generator back where the recording had it */
+  while (t->next < t->nevents && t->events[t->next].kind == SVM_EV_SEED &&
+         t->events[t->next].seq == t->count) {
+    const unsigned char *d = (const unsigned char *) t->events[t->next++].data;
+    for (unsigned int i = 0; i < 4; i++)
+      cpu->rng.s[i] = d[4 * i] | (d[4 * i + 1] << 8) | (d[4 * i + 2] << 16) | ((unsigned int) d[4 * i + 3] << 24);
+  }
+
+  unsigned int n = svm_trace_records(t);
+  unsigned long long base = t->total - n;
+
+  if (t->count >= base) {
+    svm_trace_rec_t now;
+    fill(cpu, &now);
+    if (memcmp(&now, svm_trace_record(t, t->count - base), sizeof(now)) != 0) {
+      char msg[64];
+      snprintf(msg, sizeof(msg), "replay diverged at instruction %llu", t->count + 1);
+      svm_panic(cpu, msg);
+    }
+  }
+
+  t->count++;
+}
+
+
+static svm_trace_event_t *add_event(svm_t *cpu, unsigned char kind, unsigned int value) {
+  svm_trace_t *t = cpu->trace;
+
+  if (t->nevents == t->events_cap) {
+    unsigned int cap = t->events_cap ? t->events_cap * 2 : 64;
+    svm_trace_event_t *events = realloc(t->events, cap * sizeof(*events));
+    if (!events) svm_panic(cpu, "out of memory");
+    t->events = events;
+    t->events_cap = cap;
+  }
+
+  svm_trace_event_t *e = &t->events[t->nevents++];
+  memset(e, '\0', sizeof(*e));
+  e->seq = t->count;
+  e->kind = kind;
+  e->value = value;
+  return e;
+}
+
+
+static svm_trace_event_t *next_event(svm_t *cpu, unsigned char kind) {
+  svm_trace_t *t = cpu->trace;
+
+  if (t->next >= t->nevents || t->events[t->next].kind != kind ||
+      t->events[t->next].seq != t->count) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "replay diverged at instruction %llu", t->count);
+    svm_panic(cpu, msg);
+  }
+
+  return &t->events[t->next++];
+}
+
+
+/* note the generator state, which is all a replay needs for the numbers */
+void svm_trace_seed(svm_t *cpu) {
+  if (cpu->trace->replay) return;
+
+  svm_trace_event_t *e = add_event(cpu, SVM_EV_SEED, 0);
+  e->len = 16;
+  e->data = malloc(e->len);
+  if (!e->data) svm_panic(cpu, "out of memory");
+
+  for (unsigned int i = 0; i < 16; i++)
+    e->data[i] = (cpu->rng.s[i / 4] >> (8 * (i % 4))) & 0xff;
+}
+
+
+/**
+ * Returns 1 if the command shouldn't be run because this is a replay, with
+ * the recorded status already in host_status.
+ */
+int svm_trace_system(svm_t *cpu, const char *cmd) {
+  if (cpu->trace->replay) {
+    cpu->host_status = (int) next_event(cpu, SVM_EV_SYSTEM)->value;
+    return 1;
+  }
+
+  svm_trace_event_t *e = add_event(cpu, SVM_EV_SYSTEM, (unsigned int) -1);
+  e->len = strlen(cmd);
+  e->data = malloc(e->len + 1);
+  if (!e->data) svm_panic(cpu, "out of memory");
+  memcpy(e->data, cmd, e->len + 1);
+  return 0;
+}
+
+
+/* the status of the last command, once the host call has finished */
+void svm_trace_status(svm_t *cpu, int status) {
+  svm_trace_t *t = cpu->trace;
+  if (t->replay) return;
+
+  for (unsigned int i = t->nevents; i-- > 0;) {
+    if (t->events[i].kind == SVM_EV_SYSTEM) {
+      t->events[i].value = (unsigned int) status;
+      return;
+    }
+  }
+}
+
+
+static void put(FILE *fp, unsigned long long v, int bytes) {
+  for (int i = 0; i < bytes; i++) fputc((v >> (8 * i)) & 0xff, fp);
+}
+
+
+static int get(FILE *fp, unsigned long long *v, int bytes) {
+  *v = 0;
+  for (int i = 0; i < bytes; i++) {
+    int c = fgetc(fp);
+    if (c == EOF) return 0;
+    *v |= (unsigned long long) c << (8 * i);
+  }
+  return 1;
+}
+
+
+int svm_trace_save(const svm_trace_t *t, const char *path) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp) return -1;
+
+  fwrite(TRACE_MAGIC, 1, 4, fp);
+  put(fp, TRACE_VERSION, 4);
+  put(fp, t->size, 4);
+  fwrite(t->code, 1, t->size, fp);
+  put(fp, t->replay ? t->total : t->count, 8);
+
+  unsigned int n = svm_trace_records(t);
+  put(fp, n, 4);
+  for (unsigned int i = 0; i < n; i++) {
+    const svm_trace_rec_t *r = svm_trace_record(t, i);
+    put(fp, r->ip, 2);
+    put(fp, r->opcode, 1);
+    put(fp, r->flags, 1);
+    put(fp, r->value[0], 4);
+    put(fp, r->value[1], 4);
+  }
+
+  put(fp, t->nevents, 4);
+  for (unsigned int i = 0; i < t->nevents; i++) {
+    const svm_trace_event_t *e = &t->events[i];
+    put(fp, e->seq, 8);
+    put(fp, e->kind, 1);
+    put(fp, e->value, 4);
+    put(fp, e->len, 4);
+    fwrite(e->data, 1, e->len, fp);
+  }
+
+  int err = ferror(fp);
+  if (fclose(fp) != 0) err = 1;
+  return err ? -1 : 0;
+}
+
+
+/* returns NULL if the file can't be read or isn't a trace */
+svm_trace_t *svm_trace_load(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return NULL;
+
+  svm_trace_t *t = trace_new();
+  unsigned long long v, n;
+  char magic[4];
+
+  if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0) goto fail;
+  if (!get(fp, &v, 4) || v != TRACE_VERSION) goto fail;
+
+  if (!get(fp, &v, 4) || v == 0 || v > 0xffff) goto fail;
+  t->size = v;
+  t->code = malloc(t->size);
+  if (!t->code || fread(t->code, 1, t->size, fp) != t->size) goto fail;
+
+  if (!get(fp, &t->count, 8)) goto fail;
+  t->total = t->count;
+
+  if (!get(fp, &n, 4) || n > t->count) goto fail;
+  t->cap = n ? n : 1;
+  t->ring = calloc(t->cap, sizeof(svm_trace_rec_t));
+  if (!t->ring) goto fail;
+
+  for (unsigned int i = 0; i < n; i++) {
+    svm_trace_rec_t *r = &t->ring[(t->count - n + i) % t->cap];
+    unsigned long long ip, opcode, flags, v0, v1;
+    if (!get(fp, &ip, 2) || !get(fp, &opcode, 1) || !get(fp, &flags, 1) ||
+        !get(fp, &v0, 4) || !get(fp, &v1, 4)) goto fail;
+    r->ip = ip; r->opcode = opcode; r->flags = flags;
+    r->value[0] = v0; r->value[1] = v1;
+  }
+
+  if (!get(fp, &n, 4)) goto fail;
+  for (unsigned int i = 0; i < n; i++) {
+    unsigned long long seq, kind, value, len;
+    if (!get(fp, &seq, 8) || !get(fp, &kind, 1) || !get(fp, &value, 4) ||
+        !get(fp, &len, 4) || len > 0xffff) goto fail;
+    if (kind == SVM_EV_SEED && len != 16) goto fail;
+
+    if (t->nevents == t->events_cap) {
+      unsigned int cap = t->events_cap ? t->events_cap * 2 : 64;
+      svm_trace_event_t *events = realloc(t->events, cap * sizeof(*events));
+      if (!events) goto fail;
+      t->events = events;
+      t->events_cap = cap;
+    }
+
+    svm_trace_event_t *e = &t->events[t->nevents];
+    e->seq = seq; e->kind = kind; e->value = value; e->len = len;
+    e->data = malloc(len + 1);
+    if (!e->data) goto fail;
+    t->nevents++;
+
+    if (fread(e->data, 1, len, fp) != len) goto fail;
+    e->data[len] = '\0';
+  }
+
+  fclose(fp);
+  return t;
+
+fail:
+  fclose(fp);
+  svm_trace_free(t);
+  return NULL;
+}
+
+
+/**
+ * Run the vm along a loaded trace: random numbers and system calls come
+ * from the recording, commands aren't run, and the vm panics if it goes
+ * anywhere the recording didn't. The vm should be made from the trace's
+ * code, and owns the trace from here.
+ */
+void svm_trace_replay(svm_t *cpu, svm_trace_t *t) {
+  t->replay = 1;
+  t->count = 0;
+  t->next = 0;
+  trace_attach(cpu, t);
+}
+
+
+void svm_trace_free(svm_trace_t *t) {
+  if (!t) return;
+  for (unsigned int i = 0; i < t->nevents; i++) free(t->events[i].data);
+  free(t->events);
+  free(t->ring);
+  free(t->code);
+  free(t->path);
+  free(t);
+}
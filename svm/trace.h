@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include "svm.h"
+
+#define SVM_TRACE_DEFAULT 65536   /* instructions kept */
+
+/* svm_trace_rec_t flags */
+#define SVM_TF_Z    0x01
+#define SVM_TF_S    0x02
+#define SVM_TF_C    0x04
+#define SVM_TF_O    0x08
+#define SVM_TF_STR0 0x10  /* value[0] is a string length */
+#define SVM_TF_STR1 0x20
+
+/* things from outside the vm a replay has to be handed back */
+#define SVM_EV_SYSTEM 2
+#define SVM_EV_SEED   3   /* the generator state, after svm_seed */
+
+typedef struct svm_trace_rec_t svm_trace_rec_t;
+typedef struct svm_trace_event_t svm_trace_event_t;
+
+/* one instruction, as it was about to run */
+struct svm_trace_rec_t {
+  unsigned short ip;
+  unsigned char opcode;
+  unsigned char flags;
+  unsigned int value[2];   /* the first two register operands */
+};
+
+struct svm_trace_event_t {
+  unsigned long long seq;  /* the instruction it happened in */
+  unsigned char kind;
+  unsigned int value;      /* the exit status */
+  char *data;              /* the command, or the generator state */
+  unsigned int len;
+};
+
+/**
+ * The last `cap` instructions go round a ring, so tracing costs the same
+ * however long the vm has been up. Events are kept from the start, there
+ * are few of them and a replay needs them all.
+ */
+struct svm_trace_t {
+  char *path;
+  int replay;
+
+  unsigned char *code;     /* the program as it was loaded */
+  unsigned int size;
+
+  svm_trace_rec_t *ring;
+  unsigned int cap;
+  unsigned long long count;   /* instructions run */
+
+  svm_trace_event_t *events;
+  unsigned int nevents, events_cap;
+
+  /* replaying, `count` is the run so far and `ring` the recorded one */
+  unsigned long long total;
+  unsigned int next;          /* next event to hand back */
+};
+
+void svm_trace_start(svm_t *cpu, const char *path, unsigned int records);
+svm_trace_t *svm_trace_load(const char *path);
+void svm_trace_replay(svm_t *cpu, svm_trace_t *trace);
+int svm_trace_save(const svm_trace_t *trace, const char *path);
+void svm_trace_free(svm_trace_t *trace);
+
+/* the ring, oldest first */
+unsigned int svm_trace_records(const svm_trace_t *trace);
+const svm_trace_rec_t *svm_trace_record(const svm_trace_t *trace, unsigned int i);
+
+/* hooks for the interpreter */
+void svm_trace_step(svm_t *cpu);
+void svm_trace_seed(svm_t *cpu);
+int svm_trace_system(svm_t *cpu, const char *cmd);
+void svm_trace_status(svm_t *cpu, int status);
+
+#endif
@@ -0,0 +1,328 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "verify.h"
+#include "op.h"
+
+/**
+ * Load-time verifier.
+ *
+ * Walks every path through the program from address 0, tracking which type
+ * each register may hold at each instruction. If every register operand is
+ * in bounds, every op_code only ever sees the register types it expects, and
+ * nothing can rewrite the code while it runs, the checked handlers are
+ * swapped for their unchecked variants. With a read-only code segment
+ * writes to memory are fine, but every path has to stay inside it.
+ *
+ * Calls are handled context-insensitively: the state at every `ret` flows to
+ * every return site. That only holds while `ret` can't pop a value pushed by
+ * `push`, so programs using both are left on the checked path.
+ *
+ * The stack isn't modelled: `pop` yields whatever type any `push` can store.
+ * That is assumed to be a number first, and the walk is redone if a string
+ * turns out to be pushed somewhere.
+ */
+
+#define CODE_SIZE 0xffff
+
+#define T_NUMBER 0x1
+#define T_STRING 0x2
+
+typedef unsigned char vstate_t[REGISTER_COUNT];
+
+typedef struct {
+  vstate_t *states;
+  unsigned char *seen;
+  unsigned char *queued;
+  unsigned int *work;
+  unsigned int nwork;
+
+  unsigned char *ret_site;
+  unsigned int *ret_sites;
+  unsigned int nret;
+  vstate_t ret_state;
+  int have_ret;
+
+  unsigned char pushed, popped;
+  unsigned int data;    /* svm_t.data */
+} verifier_t;
+
+
+static void merge(verifier_t *v, unsigned int addr, const vstate_t state) {
+  int changed = 0;
+  if (addr >= CODE_SIZE) addr = 0;
+
+  if (!v->seen[addr]) {
+    memcpy(v->states[addr], state, sizeof(vstate_t));
+    v->seen[addr] = 1;
+    changed = 1;
+  } else {
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      if ((v->states[addr][i] | state[i]) != v->states[addr][i]) {
+        v->states[addr][i] |= state[i];
+        changed = 1;
+      }
+    }
+  }
+
+  if (changed && !v->queued[addr]) {
+    v->queued[addr] = 1;
+    v->work[v->nwork++] = addr;
+  }
+}
+
+
+static void merge_ret(verifier_t *v, const vstate_t state) {
+  int changed = !v->have_ret;
+
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    unsigned char t = v->have_ret ? (v->ret_state[i] | state[i]) : state[i];
+    if (t != v->ret_state[i]) changed = 1;
+    v->ret_state[i] = t;
+  }
+  v->have_ret = 1;
+
+  if (changed)
+    for (unsigned int i = 0; i < v->nret; i++)
+      merge(v, v->ret_sites[i], v->ret_state);
+}
+
+
+static void add_ret_site(verifier_t *v, unsigned int addr) {
+  if (addr >= CODE_SIZE) addr = 0;
+  if (v->ret_site[addr]) return;
+
+  v->ret_site[addr] = 1;
+  v->ret_sites[v->nret++] = addr;
+  if (v->have_ret) merge(v, addr, v->ret_state);
+}
+
+
+#define NEED(r, t) if (s[insn->reg[r]] != (t)) return 0;
+
+/**
+ * Apply the effect of `insn` to the register state `s`, returns 0 if the
+ * instruction could fail a runtime check.
+ */
+static int transfer(verifier_t *v, const op_insn_t *insn, vstate_t s) {
+  for (unsigned int i = 0; i < insn->nreg; i++)
+    if (insn->reg[i] >= REGISTER_COUNT) return 0;
+
+  switch (insn->opcode) {
+    case INT_STORE: case INT_RANDOM:
+      s[insn->reg[0]] = T_NUMBER;
+      break;
+
+    case STACK_PUSH:
+      v->pushed |= s[insn->reg[0]];
+      break;
+
+    case STACK_POP:
+      s[insn->reg[0]] = v->popped;
+      break;
+
+    case INT_PRINT: case CMP_IMMEDIATE:
+    case MATH_INC: case MATH_DEC:
+      NEED(0, T_NUMBER);
+      break;
+
+    case INT_TOSTRING:
+      NEED(0, T_NUMBER);
+      s[insn->reg[0]] = T_STRING;
+      break;
+
+    case MATH_XOR: case MATH_ADD: case MATH_SUB: case MATH_MUL:
+    case MATH_DIV: case MATH_AND: case MATH_OR: case MATH_LFT: case MATH_RGT:
+      NEED(1, T_NUMBER); NEED(2, T_NUMBER);
+      s[insn->reg[0]] = T_NUMBER;
+      break;
+
+    case MATH_NOT:
+      NEED(1, T_NUMBER);
+      s[insn->reg[0]] = T_NUMBER;
+      break;
+
+    case STRING_STORE:
+      s[insn->reg[0]] = T_STRING;
+      break;
+
+    case STRING_PRINT: case STRING_SYSTEM: case CMP_STRING:
+      NEED(0, T_STRING);
+      break;
+
+    case STRING_CONCAT:
+      NEED(1, T_STRING); NEED(2, T_STRING);
+      s[insn->reg[0]] = T_STRING;
+      break;
+
+    case STRING_TOINT:
+      NEED(0, T_STRING);
+      s[insn->reg[0]] = T_NUMBER;
+      break;
+
+    case STRING_HASH:
+      NEED(1, T_STRING);
+      s[insn->reg[0]] = T_NUMBER;
+      break;
+
+    case STRING_PREFIX:
+      NEED(0, T_STRING); NEED(1, T_STRING);
+      break;
+
+    case STRING_FIND:
+      NEED(1, T_STRING); NEED(2, T_STRING);
+      s[insn->reg[0]] = T_NUMBER;
+      break;
+
+    case STRING_SWITCH:
+      NEED(0, T_STRING);
+      break;
+
+    case JUMP_TABLE:
+    case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+      NEED(0, T_NUMBER);
+      break;
+
+    case STORE_REG:
+      s[insn->reg[0]] = s[insn->reg[1]];
+      break;
+
+    case PEEK:
+      NEED(1, T_NUMBER);
+      s[insn->reg[0]] = T_NUMBER;
+      break;
+
+    /* self-modifying code can't be verified, unless the code is read-only */
+    case POKE:
+      if (!v->data) return 0;
+      NEED(0, T_NUMBER); NEED(1, T_NUMBER);
+      break;
+
+    case MEMCPY:
+      if (!v->data) return 0;
+      NEED(0, T_NUMBER); NEED(1, T_NUMBER); NEED(2, T_NUMBER);
+      break;
+
+    case RANDOM_FILL:
+      if (!v->data) return 0;
+      NEED(0, T_NUMBER); NEED(1, T_NUMBER);
+      break;
+  }
+
+  return 1;
+}
+
+
+static int analyze(verifier_t *v, const unsigned char *code) {
+  vstate_t state;
+  int has_push = 0, has_ret = 0;
+
+  /* registers start out as numbers */
+  memset(state, T_NUMBER, sizeof(state));
+  merge(v, 0, state);
+
+  while (v->nwork) {
+    unsigned int addr = v->work[--v->nwork];
+    v->queued[addr] = 0;
+
+    op_insn_t insn;
+    if (v->data && addr >= v->data) {
+      if (addr > v->data) return 0;
+      continue;
+    }
+    if (!op_decode(code, v->data ? v->data : CODE_SIZE, addr, &insn)) return 0;
+
+    memcpy(state, v->states[addr], sizeof(state));
+    if (!transfer(v, &insn, state)) return 0;
+
+    unsigned int next = addr + insn.length;
+
+    switch (insn.opcode) {
+      case EXIT: break;
+      case JUMP_TO: case JUMP_TO_REL: merge(v, insn.imm, state); break;
+
+      case JUMP_Z: case JUMP_NZ: case JUMP_LT: case JUMP_GT:
+      case JUMP_EQ_IMM: case JUMP_NE_IMM: case JUMP_LT_IMM: case JUMP_GT_IMM:
+      case JUMP_Z_REL: case JUMP_NZ_REL:
+        merge(v, insn.imm, state);
+        merge(v, next, state);
+        break;
+
+      case STACK_CALL: case STACK_CALL_REL:
+        add_ret_site(v, next);
+        merge(v, insn.imm, state);
+        break;
+
+      case STACK_RET:
+        has_ret = 1;
+        merge_ret(v, state);
+        break;
+
+      case STACK_PUSH:
+        has_push = 1;
+        merge(v, next, state);
+        break;
+
+      case STRING_SWITCH: case JUMP_TABLE:
+        for (unsigned int i = 0; i < op_table_size(&insn); i++)
+          merge(v, op_table_target(&insn, i), state);
+        merge(v, next, state);
+        break;
+
+      default: merge(v, next, state); break;
+    }
+  }
+
+  return !(has_push && has_ret);
+}
+
+
+/**
+ * Verify the program loaded into `cpu`, installing the unchecked handlers
+ * if it is safe. Returns 1 if the program was verified.
+ */
+int svm_verify(svm_t *cpu) {
+  verifier_t v;
+  memset(&v, '\0', sizeof(v));
+
+  v.states = malloc(CODE_SIZE * sizeof(vstate_t));
+  v.seen = calloc(CODE_SIZE, 1);
+  v.queued = calloc(CODE_SIZE, 1);
+  v.work = malloc(CODE_SIZE * sizeof(unsigned int));
+  v.ret_site = calloc(CODE_SIZE, 1);
+  v.ret_sites = malloc(CODE_SIZE * sizeof(unsigned int));
+
+  int ok = 0;
+  v.popped = T_NUMBER;
+  v.data = cpu->data;
+
+  while (v.states && v.seen && v.queued && v.work && v.ret_site && v.ret_sites) {
+    ok = analyze(&v, cpu->code);
+    if (!ok || !(v.pushed & ~v.popped)) break;
+
+    /* something else gets pushed, start over */
+    v.popped |= v.pushed;
+    memset(v.seen, '\0', CODE_SIZE);
+    memset(v.queued, '\0', CODE_SIZE);
+    memset(v.ret_site, '\0', CODE_SIZE);
+    v.nwork = v.nret = 0;
+    v.have_ret = 0;
+  }
+
+  free(v.states); free(v.seen); free(v.queued);
+  free(v.work); free(v.ret_site); free(v.ret_sites);
+
+  if (ok) {
+    cpu->verified = 1;
+    op_code_unchecked(cpu);
+  }
+
+  return ok;
+}
@@ -0,0 +1,15 @@
+/**
+ * Copyright (c) 2017 emekoi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "svm.h"
+
+int svm_verify(svm_t *cpu);
+
+#endif